@@ -27,8 +27,11 @@ static ERR_STRING_DATA GOST_str_functs[] = {
     {ERR_PACK(0, GOST_F_GOST_CIPHER_CTL, 0), "gost_cipher_ctl"},
     {ERR_PACK(0, GOST_F_GOST_EC_COMPUTE_PUBLIC, 0), "gost_ec_compute_public"},
     {ERR_PACK(0, GOST_F_GOST_EC_KEYGEN, 0), "gost_ec_keygen"},
+    {ERR_PACK(0, GOST_F_GOST_EC_POINT_MUL, 0), "gost_ec_point_mul"},
     {ERR_PACK(0, GOST_F_GOST_EC_SIGN, 0), "gost_ec_sign"},
+    {ERR_PACK(0, GOST_F_GOST_EC_SIGN_BATCH, 0), "gost_ec_sign_batch"},
     {ERR_PACK(0, GOST_F_GOST_EC_VERIFY, 0), "gost_ec_verify"},
+    {ERR_PACK(0, GOST_F_GOST_EC_VERIFY_BATCH, 0), "gost_ec_verify_batch"},
     {ERR_PACK(0, GOST_F_GOST_GRASSHOPPER_CIPHER_CTL, 0),
      "gost_grasshopper_cipher_ctl"},
     {ERR_PACK(0, GOST_F_GOST_GRASSHOPPER_SET_ASN1_PARAMETERS, 0),
@@ -39,6 +42,7 @@ static ERR_STRING_DATA GOST_str_functs[] = {
     {ERR_PACK(0, GOST_F_GOST_KDFTREE2012_256, 0), "gost_kdftree2012_256"},
     {ERR_PACK(0, GOST_F_GOST_KEXP15, 0), "gost_kexp15"},
     {ERR_PACK(0, GOST_F_GOST_KIMP15, 0), "gost_kimp15"},
+    {ERR_PACK(0, GOST_F_GOST_PBKDF2_CTRL, 0), "gost_pbkdf2_ctrl"},
     {ERR_PACK(0, GOST_F_OMAC_ACPKM_IMIT_CTRL, 0), "omac_acpkm_imit_ctrl"},
     {ERR_PACK(0, GOST_F_OMAC_ACPKM_IMIT_FINAL, 0), "omac_acpkm_imit_final"},
     {ERR_PACK(0, GOST_F_OMAC_ACPKM_IMIT_UPDATE, 0), "omac_acpkm_imit_update"},
@@ -129,6 +133,7 @@ static ERR_STRING_DATA GOST_str_reasons[] = {
     {ERR_PACK(0, 0, GOST_R_SIGNATURE_PARTS_GREATER_THAN_Q),
     "signature parts greater than q"},
     {ERR_PACK(0, 0, GOST_R_UKM_NOT_SET), "ukm not set"},
+    {ERR_PACK(0, 0, GOST_R_UKM_REUSED), "ukm reused"},
     {ERR_PACK(0, 0, GOST_R_UNSUPPORTED_CIPHER_CTL_COMMAND),
     "unsupported cipher ctl command"},
     {ERR_PACK(0, 0, GOST_R_UNSUPPORTED_PARAMETER_SET),
@@ -36,8 +36,11 @@ void ERR_GOST_error(int function, int reason, char *file, int line);
 # define GOST_F_GOST_CIPHER_CTL                           106
 # define GOST_F_GOST_EC_COMPUTE_PUBLIC                    107
 # define GOST_F_GOST_EC_KEYGEN                            108
+# define GOST_F_GOST_EC_POINT_MUL                         155
 # define GOST_F_GOST_EC_SIGN                              109
+# define GOST_F_GOST_EC_SIGN_BATCH                        157
 # define GOST_F_GOST_EC_VERIFY                            110
+# define GOST_F_GOST_EC_VERIFY_BATCH                      156
 # define GOST_F_GOST_GRASSHOPPER_CIPHER_CTL               111
 # define GOST_F_GOST_GRASSHOPPER_SET_ASN1_PARAMETERS      112
 # define GOST_F_GOST_IMIT_CTRL                            113
@@ -46,6 +49,7 @@ void ERR_GOST_error(int function, int reason, char *file, int line);
 # define GOST_F_GOST_KDFTREE2012_256                      149
 # define GOST_F_GOST_KEXP15                               143
 # define GOST_F_GOST_KIMP15                               148
+# define GOST_F_GOST_PBKDF2_CTRL                          154
 # define GOST_F_OMAC_ACPKM_IMIT_CTRL                      144
 # define GOST_F_OMAC_ACPKM_IMIT_FINAL                     145
 # define GOST_F_OMAC_ACPKM_IMIT_UPDATE                    146
@@ -120,6 +124,7 @@ void ERR_GOST_error(int function, int reason, char *file, int line);
 # define GOST_R_SIGNATURE_MISMATCH                        127
 # define GOST_R_SIGNATURE_PARTS_GREATER_THAN_Q            128
 # define GOST_R_UKM_NOT_SET                               129
+# define GOST_R_UKM_REUSED                                137
 # define GOST_R_UNSUPPORTED_CIPHER_CTL_COMMAND            130
 # define GOST_R_UNSUPPORTED_PARAMETER_SET                 131
 
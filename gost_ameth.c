@@ -7,6 +7,7 @@
  *       for OpenSSL                                                  *
  *          Requires OpenSSL 0.9.9 for compilation                    *
  **********************************************************************/
+#include <stdlib.h>
 #include <string.h>
 #include <openssl/crypto.h>
 #include <openssl/err.h>
@@ -17,6 +18,7 @@
 # include <openssl/cms.h>
 #endif
 #include "gost_lcl.h"
+#include "gosthash2012.h"
 #include "e_gost_err.h"
 
 #define PK_WRAP_PARAM "LEGACY_PK_WRAP"
@@ -194,7 +196,9 @@ static int gost_set_priv_key(EVP_PKEY *pkey, BIGNUM *priv)
             }
             if (!EC_KEY_set_private_key(ec, priv))
                 return 0;
-            if (!EVP_PKEY_missing_parameters(pkey))
+            /* Unless replacing one, the public key is computed when used */
+            if (!EVP_PKEY_missing_parameters(pkey)
+                && EC_KEY_get0_public_key(ec) != NULL)
                 return gost_ec_compute_public(ec);
             break;
         }
@@ -306,9 +310,11 @@ static void pkey_free_gost_ec(EVP_PKEY *key)
 static BIGNUM *unmask_priv_key(EVP_PKEY *pk,
                                const unsigned char *buf, int len, int num_masks)
 {
-    BIGNUM *pknum_masked = NULL, *q = NULL;
+    BIGNUM *pknum_masked = NULL, *mask;
+    const BIGNUM *q;
     const EC_KEY *key_ptr = (pk) ? EVP_PKEY_get0(pk) : NULL;
     const EC_GROUP *group = (key_ptr) ? EC_KEY_get0_group(key_ptr) : NULL;
+    BN_CTX *ctx;
 
     pknum_masked = hashsum2bn(buf, len);
     if (!pknum_masked)
@@ -320,27 +326,30 @@ static BIGNUM *unmask_priv_key(EVP_PKEY *pk,
          */
         const unsigned char *p = buf + num_masks * len;
 
-        q = BN_new();
-        if (!q || !group || EC_GROUP_get_order(group, q, NULL) <= 0) {
+        q = (group) ? EC_GROUP_get0_order(group) : NULL;
+        ctx = gost_bn_ctx_secret();
+        if (!q || !ctx) {
             BN_free(pknum_masked);
-            pknum_masked = NULL;
-            goto end;
+            gost_bn_ctx_put(ctx);
+            return NULL;
         }
 
+        BN_CTX_start(ctx);
+        mask = BN_CTX_get(ctx);
         for (; p != buf; p -= len) {
-            BIGNUM *mask = hashsum2bn(p, len);
-            BN_CTX *ctx = BN_CTX_new();
-
-            BN_mod_mul(pknum_masked, pknum_masked, mask, q, ctx);
-
-            BN_CTX_free(ctx);
-            BN_free(mask);
+            if (!mask || !BN_lebin2bn(p, len, mask)
+                || !BN_mod_mul(pknum_masked, pknum_masked, mask, q, ctx)) {
+                BN_clear_free(pknum_masked);
+                pknum_masked = NULL;
+                break;
+            }
         }
+        if (mask)
+            BN_clear(mask);
+        BN_CTX_end(ctx);
+        gost_bn_ctx_put(ctx);
     }
 
- end:
-    if (q)
-        BN_free(q);
     return pknum_masked;
 }
 
@@ -518,7 +527,7 @@ static int print_gost_ec_pub(BIO *out, const EVP_PKEY *pkey, int indent)
     BN_CTX_start(ctx);
     X = BN_CTX_get(ctx);
     Y = BN_CTX_get(ctx);
-    pubkey = (key) ? EC_KEY_get0_public_key(key) : NULL;
+    pubkey = (key) ? gost_ec_get0_public_key(key) : NULL;
     group = (key) ? EC_KEY_get0_group(key) : NULL;
     if (!pubkey || !group)
         goto err;
@@ -637,7 +646,7 @@ static int param_copy_gost_ec(EVP_PKEY *to, const EVP_PKEY *from)
         GOSTerr(GOST_F_PARAM_COPY_GOST_EC, ERR_R_INTERNAL_ERROR);
         return 0;
     }
-    if (EC_KEY_get0_private_key(eto)) {
+    if (EC_KEY_get0_private_key(eto) && EC_KEY_get0_public_key(eto)) {
         return gost_ec_compute_public(eto);
     }
     return 1;
@@ -663,6 +672,292 @@ static int param_cmp_gost_ec(const EVP_PKEY *a, const EVP_PKEY *b)
 }
 
 /* ---------- Public key functions * --------------------------------------*/
+/*
+ * Cache of decoded public keys, keyed by Streebog-256 of the algorithm,
+ * its parameters and the key bits of SubjectPublicKeyInfo. Entries keep
+ * the curve and the already validated point, every hit gets an EC_KEY of
+ * its own built from them. Entries are chained into a hash table by the
+ * first bytes of the key and looked up under a read lock. Eviction gives
+ * entries used since they were last passed another round.
+ */
+typedef struct gost_spki_entry {
+    struct gost_spki_entry *prev, *next, *hnext;
+    unsigned char hash[32];
+    int nid;
+    int curve_nid;
+    EC_POINT *point;
+    int used;
+} GOST_SPKI_ENTRY;
+
+static struct {
+    GOST_SPKI_ENTRY *head, *tail;
+    GOST_SPKI_ENTRY **table;
+    size_t mask;                /* table size - 1, a power of two minus 1 */
+    long size, max;             /* max < 0 until read from engine param */
+    int hits, misses;
+    CRYPTO_RWLOCK *lock;
+    CRYPTO_RWLOCK *count_lock;  /* for CRYPTO_atomic_add without atomics */
+} gost_spki_cache = { NULL, NULL, NULL, 0, 0, -1, 0, 0, NULL, NULL };
+static CRYPTO_ONCE gost_spki_cache_once = CRYPTO_ONCE_STATIC_INIT;
+
+static void gost_spki_cache_init(void)
+{
+    gost_spki_cache.lock = CRYPTO_THREAD_lock_new();
+    gost_spki_cache.count_lock = CRYPTO_THREAD_lock_new();
+}
+
+static void spki_count(int *counter)
+{
+    int tmp;
+
+    CRYPTO_atomic_add(counter, 1, &tmp, gost_spki_cache.count_lock);
+}
+
+static GOST_SPKI_ENTRY **spki_bucket(const unsigned char *hash)
+{
+    size_t h = 0;
+    int i;
+
+    for (i = 0; i < (int)sizeof(h); i++)
+        h = (h << 8) | hash[i];
+    return &gost_spki_cache.table[h & gost_spki_cache.mask];
+}
+
+static GOST_SPKI_ENTRY *spki_find(const unsigned char *hash, int nid)
+{
+    GOST_SPKI_ENTRY *e;
+
+    if (gost_spki_cache.max <= 0)
+        return NULL;
+    for (e = *spki_bucket(hash); e; e = e->hnext) {
+        if (e->nid == nid && memcmp(e->hash, hash, sizeof(e->hash)) == 0)
+            break;
+    }
+    return e;
+}
+
+static void spki_unlink(GOST_SPKI_ENTRY *e)
+{
+    GOST_SPKI_ENTRY **b = spki_bucket(e->hash);
+
+    while (*b != e)
+        b = &(*b)->hnext;
+    *b = e->hnext;
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        gost_spki_cache.head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        gost_spki_cache.tail = e->prev;
+    gost_spki_cache.size--;
+}
+
+static void spki_push_front(GOST_SPKI_ENTRY *e)
+{
+    GOST_SPKI_ENTRY **b = spki_bucket(e->hash);
+
+    e->hnext = *b;
+    *b = e;
+    e->prev = NULL;
+    e->next = gost_spki_cache.head;
+    if (e->next)
+        e->next->prev = e;
+    else
+        gost_spki_cache.tail = e;
+    gost_spki_cache.head = e;
+    gost_spki_cache.size++;
+}
+
+/* Called with the write lock held, so no reader touches used meanwhile */
+static void spki_trim(long max)
+{
+    while (gost_spki_cache.size > max) {
+        GOST_SPKI_ENTRY *e = gost_spki_cache.tail;
+
+        spki_unlink(e);
+        if (e->used && max > 0) {
+            e->used = 0;
+            spki_push_front(e);
+            continue;
+        }
+        EC_POINT_free(e->point);
+        OPENSSL_free(e);
+    }
+}
+
+/*
+ * Keeps at most max keys and resizes the table to hold them, on
+ * allocation failure the cache is disabled
+ */
+static void spki_resize(long max)
+{
+    GOST_SPKI_ENTRY **table = NULL, *e;
+    size_t n = 1;
+
+    spki_trim(max);
+    if (max > 0) {
+        while (n < (size_t)max && n < ((size_t)1 << 20))
+            n <<= 1;
+        if ((table = OPENSSL_zalloc(n * sizeof(*table))) == NULL) {
+            spki_trim(0);
+            max = 0;
+        }
+    }
+    OPENSSL_free(gost_spki_cache.table);
+    gost_spki_cache.table = table;
+    gost_spki_cache.mask = n - 1;
+    gost_spki_cache.max = max;
+    for (e = gost_spki_cache.tail; e; e = e->prev) {
+        GOST_SPKI_ENTRY **b = spki_bucket(e->hash);
+
+        e->hnext = *b;
+        *b = e;
+    }
+}
+
+static int spki_write_lock(void)
+{
+    const char *max;
+
+    if (!CRYPTO_THREAD_run_once(&gost_spki_cache_once, gost_spki_cache_init)
+        || gost_spki_cache.lock == NULL || gost_spki_cache.count_lock == NULL
+        || !CRYPTO_THREAD_write_lock(gost_spki_cache.lock))
+        return 0;
+    if (gost_spki_cache.max < 0) {
+        max = get_gost_engine_param(GOST_PARAM_PUBKEY_CACHE);
+        spki_resize(max && atol(max) > 0 ? atol(max) : 0);
+    }
+    return 1;
+}
+
+/* Falls back to the write lock until the size is read from the param */
+static int spki_read_lock(void)
+{
+    if (!CRYPTO_THREAD_run_once(&gost_spki_cache_once, gost_spki_cache_init)
+        || gost_spki_cache.lock == NULL || gost_spki_cache.count_lock == NULL
+        || !CRYPTO_THREAD_read_lock(gost_spki_cache.lock))
+        return 0;
+    if (gost_spki_cache.max >= 0)
+        return 1;
+    CRYPTO_THREAD_unlock(gost_spki_cache.lock);
+    return spki_write_lock();
+}
+
+static void spki_hash(unsigned char *hash, int nid,
+                      const ASN1_STRING *params,
+                      const unsigned char *key, int key_len)
+{
+    gost2012_hash_ctx ctx;
+    unsigned char n[8];
+
+    n[0] = (unsigned char)(nid >> 24);
+    n[1] = (unsigned char)(nid >> 16);
+    n[2] = (unsigned char)(nid >> 8);
+    n[3] = (unsigned char)nid;
+    n[4] = (unsigned char)(params->length >> 24);
+    n[5] = (unsigned char)(params->length >> 16);
+    n[6] = (unsigned char)(params->length >> 8);
+    n[7] = (unsigned char)params->length;
+    init_gost2012_hash_ctx(&ctx, 256);
+    gost2012_hash_block(&ctx, n, sizeof(n));
+    gost2012_hash_block(&ctx, params->data, params->length);
+    gost2012_hash_block(&ctx, key, key_len);
+    gost2012_finish_hash(&ctx, hash);
+}
+
+/* Returns a new key built from the cached entry for hash, or NULL */
+static EC_KEY *spki_get(const unsigned char *hash, int nid)
+{
+    GOST_SPKI_ENTRY *e;
+    EC_KEY *key = NULL;
+
+    if (!spki_read_lock())
+        return NULL;
+    if (gost_spki_cache.max == 0) {
+        CRYPTO_THREAD_unlock(gost_spki_cache.lock);
+        return NULL;
+    }
+    if ((e = spki_find(hash, nid)) != NULL) {
+        /* The point was checked to be on the curve when it was decoded */
+        if ((key = EC_KEY_new()) == NULL
+            || !fill_GOST_EC_params(key, e->curve_nid)
+            || !EC_KEY_set_public_key(key, e->point)) {
+            EC_KEY_free(key);
+            key = NULL;
+        }
+        spki_count(&e->used);
+    }
+    spki_count(key ? &gost_spki_cache.hits : &gost_spki_cache.misses);
+    CRYPTO_THREAD_unlock(gost_spki_cache.lock);
+    return key;
+}
+
+static void spki_put(const unsigned char *hash, int nid, const EC_KEY *key)
+{
+    const EC_GROUP *group = EC_KEY_get0_group(key);
+    const EC_POINT *point = EC_KEY_get0_public_key(key);
+    GOST_SPKI_ENTRY *e;
+
+    if (group == NULL || point == NULL || !spki_write_lock())
+        return;
+    /* Another thread could have decoded the same key meanwhile */
+    if (gost_spki_cache.max == 0 || spki_find(hash, nid) != NULL)
+        goto end;
+    if ((e = OPENSSL_zalloc(sizeof(*e))) == NULL)
+        goto end;
+    if ((e->point = EC_POINT_dup(point, group)) == NULL) {
+        OPENSSL_free(e);
+        goto end;
+    }
+    memcpy(e->hash, hash, sizeof(e->hash));
+    e->nid = nid;
+    e->curve_nid = EC_GROUP_get_curve_name(group);
+    spki_trim(gost_spki_cache.max - 1);
+    spki_push_front(e);
+ end:
+    CRYPTO_THREAD_unlock(gost_spki_cache.lock);
+}
+
+/* Sets the number of keys to keep, 0 disables the cache */
+int gost_pubkey_cache_set_size(long max)
+{
+    if (max < 0 || !spki_write_lock())
+        return 0;
+    spki_resize(max);
+    CRYPTO_THREAD_unlock(gost_spki_cache.lock);
+    return gost_spki_cache.max == max;
+}
+
+/* Fills stats with hits, misses and the number of keys in the cache */
+int gost_pubkey_cache_stats(unsigned long *stats)
+{
+    if (stats == NULL || !spki_write_lock())
+        return 0;
+    stats[0] = (unsigned int)gost_spki_cache.hits;
+    stats[1] = (unsigned int)gost_spki_cache.misses;
+    stats[2] = gost_spki_cache.size;
+    CRYPTO_THREAD_unlock(gost_spki_cache.lock);
+    return 1;
+}
+
+/*
+ * Empties the cache and clears its counters, called on engine destruction.
+ * The size is read from the engine param again on next use, the locks
+ * are kept.
+ */
+void gost_pubkey_cache_free(void)
+{
+    if (gost_spki_cache.lock == NULL)
+        return;
+    CRYPTO_THREAD_write_lock(gost_spki_cache.lock);
+    spki_resize(0);
+    gost_spki_cache.max = -1;
+    gost_spki_cache.hits = gost_spki_cache.misses = 0;
+    CRYPTO_THREAD_unlock(gost_spki_cache.lock);
+}
+
 static int pub_decode_gost_ec(EVP_PKEY *pk, X509_PUBKEY *pub)
 {
     X509_ALGOR *palg = NULL;
@@ -676,9 +971,26 @@ static int pub_decode_gost_ec(EVP_PKEY *pk, X509_PUBKEY *pub)
     size_t len;
     const EC_GROUP *group;
 
+    unsigned char hash[32];
+    const ASN1_STRING *pval = NULL;
+    int ptype = V_ASN1_UNDEF, nid;
+    EC_KEY *cached;
+
     if (!X509_PUBKEY_get0_param(&palgobj, &pubkey_buf, &pub_len, &palg, pub))
         return 0;
-    EVP_PKEY_assign(pk, OBJ_obj2nid(palgobj), NULL);
+    nid = OBJ_obj2nid(palgobj);
+    X509_ALGOR_get0(NULL, &ptype, (const void **)&pval, palg);
+    if (ptype == V_ASN1_SEQUENCE) {
+        spki_hash(hash, nid, pval, pubkey_buf, pub_len);
+        if ((cached = spki_get(hash, nid)) != NULL) {
+            if (!EVP_PKEY_assign(pk, nid, cached)) {
+                EC_KEY_free(cached);
+                return 0;
+            }
+            return 1;
+        }
+    }
+    EVP_PKEY_assign(pk, nid, NULL);
     if (!decode_gost_algor_params(pk, palg))
         return 0;
     group = EC_KEY_get0_group(EVP_PKEY_get0(pk));
@@ -717,6 +1029,8 @@ static int pub_decode_gost_ec(EVP_PKEY *pk, X509_PUBKEY *pub)
         return 0;
     }
     EC_POINT_free(pub_key);
+    if (ptype == V_ASN1_SEQUENCE)
+        spki_put(hash, nid, EVP_PKEY_get0(pk));
     return 1;
 
 }
@@ -745,7 +1059,7 @@ static int pub_encode_gost_ec(X509_PUBKEY *pub, const EVP_PKEY *pk)
         goto err;
     }
     EC_GROUP_get_order(EC_KEY_get0_group(ec), order, NULL);
-    pub_key = EC_KEY_get0_public_key(ec);
+    pub_key = gost_ec_get0_public_key(ec);
     if (!pub_key) {
         GOSTerr(GOST_F_PUB_ENCODE_GOST_EC, GOST_R_PUBLIC_KEY_UNDEFINED);
         goto err;
@@ -808,8 +1122,8 @@ static int pub_cmp_gost_ec(const EVP_PKEY *a, const EVP_PKEY *b)
     const EC_POINT *ka, *kb;
     if (!ea || !eb)
         return 0;
-    ka = EC_KEY_get0_public_key(ea);
-    kb = EC_KEY_get0_public_key(eb);
+    ka = gost_ec_get0_public_key(ea);
+    kb = gost_ec_get0_public_key(eb);
     if (!ka || !kb)
         return 0;
     return (0 == EC_POINT_cmp(EC_KEY_get0_group(ea), ka, kb, NULL));
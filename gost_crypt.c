@@ -469,8 +469,11 @@ static int magma_cipher_init_param(EVP_CIPHER_CTX *ctx,
             return 0;
         EVP_CIPHER_CTX_set_app_data(ctx, EVP_CIPHER_CTX_get_cipher_data(ctx));
     }
-    if (key)
+    if (key) {
         magma_key(&(c->cctx), key);
+        memcpy(c->master_key, key, 32);
+        c->tree.levels = 0;
+    }
     if (iv) {
         memcpy((unsigned char *)EVP_CIPHER_CTX_original_iv(ctx), iv,
                EVP_CIPHER_CTX_iv_length(ctx));
@@ -853,8 +856,11 @@ static int gost_cipher_do_cnt(EVP_CIPHER_CTX *ctx, unsigned char *out,
 /* Cleaning up of EVP_CIPHER_CTX */
 int gost_cipher_cleanup(EVP_CIPHER_CTX *ctx)
 {
-    gost_destroy(&((struct ossl_gost_cipher_ctx *)
-                   EVP_CIPHER_CTX_get_cipher_data(ctx))->cctx);
+    struct ossl_gost_cipher_ctx *c = EVP_CIPHER_CTX_get_cipher_data(ctx);
+
+    gost_destroy(&c->cctx);
+    OPENSSL_cleanse(c->master_key, sizeof(c->master_key));
+    OPENSSL_cleanse(&c->tree, sizeof(c->tree));
     EVP_CIPHER_CTX_set_app_data(ctx, NULL);
     return 1;
 }
@@ -946,6 +952,56 @@ int gost_cipher_ctl(EVP_CIPHER_CTX *ctx, int type, int arg, void *ptr)
             c->key_meshing = arg;
             return 1;
         }
+#ifdef EVP_CTRL_TLS1_2_TLSTREE
+    case EVP_CTRL_TLS1_2_TLSTREE:
+        {
+            unsigned char newkey[32];
+            static const unsigned char zeroseq[8];
+            struct ossl_gost_cipher_ctx *c =
+                EVP_CIPHER_CTX_get_cipher_data(ctx);
+            unsigned char *iv = EVP_CIPHER_CTX_iv_noconst(ctx);
+            const unsigned char *oiv = EVP_CIPHER_CTX_original_iv(ctx);
+            unsigned char seq[8];
+            int j, carry, ret;
+
+            if (EVP_CIPHER_CTX_nid(ctx) != NID_magma_ctr)
+                return -1;
+
+            memcpy(seq, ptr, 8);
+            if (EVP_CIPHER_CTX_encrypting(ctx)) {
+                /*
+                 * OpenSSL increments seq after mac calculation.
+                 * As we have Mac-Then-Encrypt, we need decrement it here on encryption
+                 * to derive the key correctly.
+                 * */
+                if (memcmp(seq, zeroseq, 8) != 0) {
+                    for (j = 7; j >= 0; j--) {
+                        if (seq[j] != 0) {
+                            seq[j]--;
+                            break;
+                        } else
+                            seq[j] = 0xFF;
+                    }
+                }
+            }
+            ret = gost_tlstree_cached(&c->tree, NID_magma_cbc, c->master_key,
+                                      newkey, seq);
+            if (ret <= 0)
+                return -1;
+            /* IV is the upper half of the counter, seq is added mod 2^32 */
+            for (j = 3, carry = 0; j >= 0; j--) {
+                int adj_byte = oiv[j] + seq[j + 4] + carry;
+                carry = (adj_byte > 255) ? 1 : 0;
+                iv[j] = adj_byte & 0xFF;
+            }
+            memset(iv + 4, 0, 4);
+            EVP_CIPHER_CTX_set_num(ctx, 0);
+            if (ret == 1)
+                magma_key(&c->cctx, newkey);
+            OPENSSL_cleanse(newkey, sizeof(newkey));
+            return 1;
+        }
+#endif
     default:
         GOSTerr(GOST_F_GOST_CIPHER_CTL, GOST_R_UNSUPPORTED_CIPHER_CTL_COMMAND);
         return -1;
@@ -16,7 +16,9 @@
 
 static char *gost_params[GOST_PARAM_MAX + 1] = { NULL };
 static const char *gost_envnames[] =
-    { "CRYPT_PARAMS", "GOST_PBE_HMAC", "GOST_PK_FORMAT" };
+    { "CRYPT_PARAMS", "GOST_PBE_HMAC", "GOST_PK_FORMAT",
+      "GOST_VERIFY_CACHE", "GOST_PRESIGN_POOL", "GOST_PUBKEY_CACHE",
+      "GOST_EPHEMERAL_POOL", "GOST_NONCE", "GOST_VERIFY_RESULTS" };
 
 const ENGINE_CMD_DEFN gost_cmds[] = {
     {GOST_CTRL_CRYPT_PARAMS,
@@ -31,6 +33,54 @@ const ENGINE_CMD_DEFN gost_cmds[] = {
      "GOST_PK_FORMAT",
      "Private key format params",
      ENGINE_CMD_FLAG_STRING},
+    {GOST_CTRL_VERIFY_CACHE,
+     "VERIFY_CACHE",
+     "Number of public keys to cache verification tables for, 0 disables",
+     ENGINE_CMD_FLAG_STRING},
+    {GOST_CTRL_PRESIGN_POOL,
+     "PRESIGN_POOL",
+     "Number of presignatures to keep per curve, 0 disables",
+     ENGINE_CMD_FLAG_STRING},
+    {GOST_CTRL_PUBKEY_CACHE,
+     "PUBKEY_CACHE",
+     "Number of decoded public keys to cache, 0 disables",
+     ENGINE_CMD_FLAG_STRING},
+    {GOST_CTRL_EPHEMERAL_POOL,
+     "EPHEMERAL_POOL",
+     "Number of ephemeral key pairs to keep per curve, 0 disables",
+     ENGINE_CMD_FLAG_STRING},
+    {GOST_CTRL_NONCE,
+     "NONCE",
+     "Signature nonces: RANDOM, HEDGED or DETERMINISTIC",
+     ENGINE_CMD_FLAG_STRING},
+    {GOST_CTRL_VERIFY_RESULTS,
+     "VERIFY_RESULTS",
+     "Number of successful signature verifications to cache, 0 disables",
+     ENGINE_CMD_FLAG_STRING},
+    {GOST_CTRL_VERIFY_CACHE_STATS,
+     "VERIFY_CACHE_STATS",
+     "Get verification cache hits, misses and size to unsigned long[3]",
+     ENGINE_CMD_FLAG_INTERNAL},
+    {GOST_CTRL_PRESIGN_FILL,
+     "PRESIGN_FILL",
+     "Fill presignature pools of the curves used for signing",
+     ENGINE_CMD_FLAG_NO_INPUT},
+    {GOST_CTRL_PUBKEY_CACHE_STATS,
+     "PUBKEY_CACHE_STATS",
+     "Get public key cache hits, misses and size to unsigned long[3]",
+     ENGINE_CMD_FLAG_INTERNAL},
+    {GOST_CTRL_EPHEMERAL_FILL,
+     "EPHEMERAL_FILL",
+     "Fill ephemeral key pools of the curves used for key transport",
+     ENGINE_CMD_FLAG_NO_INPUT},
+    {GOST_CTRL_VERIFY_RESULTS_STATS,
+     "VERIFY_RESULTS_STATS",
+     "Get verification result cache hits, misses and size to unsigned long[3]",
+     ENGINE_CMD_FLAG_INTERNAL},
+    {GOST_CTRL_PBKDF2,
+     "PBKDF2",
+     "Derive a key with PBKDF2-HMAC-Streebog, GOST_PBKDF2_PARAMS argument",
+     0},
     {0, NULL, NULL, 0}
 };
 
@@ -49,10 +99,45 @@ int gost_control_func(ENGINE *e, int cmd, long i, void *p, void (*f) (void))
 {
     int param = cmd - ENGINE_CMD_BASE;
     int ret = 0;
+    if (cmd == GOST_CTRL_VERIFY_CACHE_STATS)
+        return gost_ec_verify_cache_stats(p);
+    if (cmd == GOST_CTRL_PRESIGN_FILL)
+        return gost_ec_presign_fill();
+    if (cmd == GOST_CTRL_PUBKEY_CACHE_STATS)
+        return gost_pubkey_cache_stats(p);
+    if (cmd == GOST_CTRL_EPHEMERAL_FILL)
+        return gost_ec_ephemeral_fill();
+    if (cmd == GOST_CTRL_VERIFY_RESULTS_STATS)
+        return gost_ec_verify_results_stats(p);
+    if (cmd == GOST_CTRL_PBKDF2)
+        return gost_pbkdf2_ctrl(p);
     if (param < 0 || param > GOST_PARAM_MAX) {
         return -1;
     }
     ret = gost_set_default_param(param, p);
+    if (ret && param == GOST_PARAM_VERIFY_CACHE) {
+        const char *size = get_gost_engine_param(param);
+
+        ret = size && gost_ec_verify_cache_set_size(atol(size));
+    } else if (ret && param == GOST_PARAM_PRESIGN_POOL) {
+        const char *size = get_gost_engine_param(param);
+
+        ret = size && gost_ec_presign_set_size(atol(size));
+    } else if (ret && param == GOST_PARAM_PUBKEY_CACHE) {
+        const char *size = get_gost_engine_param(param);
+
+        ret = size && gost_pubkey_cache_set_size(atol(size));
+    } else if (ret && param == GOST_PARAM_EPHEMERAL_POOL) {
+        const char *size = get_gost_engine_param(param);
+
+        ret = size && gost_ec_ephemeral_set_size(atol(size));
+    } else if (ret && param == GOST_PARAM_NONCE) {
+        ret = gost_ec_nonce_set_mode(get_gost_engine_param(param));
+    } else if (ret && param == GOST_PARAM_VERIFY_RESULTS) {
+        const char *size = get_gost_engine_param(param);
+
+        ret = size && gost_ec_verify_results_set_size(atol(size));
+    }
     return ret;
 }
 
@@ -0,0 +1,1736 @@
+/**********************************************************************
+ *                        gost_ec_arith.c                             *
+ *         This file is distributed under the same license as OpenSSL *
+ *                                                                    *
+ *     Fixed width constant time arithmetic for GOST R 34.10 curves   *
+ *                                                                    *
+ * Field elements are arrays of 64-bit limbs of the size of the curve *
+ * prime. Nothing here branches on or indexes memory by secret data.  *
+ **********************************************************************/
+#include <string.h>
+#include "gost_ec_arith.h"
+
+#define MAXL GOST_EC_MAX_LIMBS
+
+/*
+ * The *_n() bodies below take the limb count as an argument and are
+ * instantiated with constant counts, ask the compiler to unroll them.
+ */
+#if defined(__clang__)
+# define FE_UNROLL _Pragma("unroll")
+#elif defined(__GNUC__) && __GNUC__ >= 8
+# define FE_UNROLL _Pragma("GCC unroll 8")
+#else
+# define FE_UNROLL
+#endif
+
+/* r = a * b + c + d, returns high limb. Can not overflow. */
+static inline gost_limb mac64(gost_limb *r, gost_limb a, gost_limb b,
+                              gost_limb c, gost_limb d)
+{
+#if defined(__SIZEOF_INT128__)
+    unsigned __int128 t = (unsigned __int128)a * b + c + d;
+
+    *r = (gost_limb)t;
+    return (gost_limb)(t >> 64);
+#else
+    uint64_t al = (uint32_t)a, ah = a >> 32, bl = (uint32_t)b, bh = b >> 32;
+    uint64_t ll = al * bl, lh = al * bh, hl = ah * bl, hh = ah * bh;
+    uint64_t mid = (ll >> 32) + (uint32_t)lh + (uint32_t)hl;
+    uint64_t lo = (mid << 32) | (uint32_t)ll;
+    uint64_t hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+
+    lo += c;
+    hi += lo < c;
+    lo += d;
+    hi += lo < d;
+    *r = lo;
+    return hi;
+#endif
+}
+
+/* r = a + b + carry, returns carry */
+static inline gost_limb adc64(gost_limb *r, gost_limb a, gost_limb b,
+                              gost_limb carry)
+{
+    gost_limb t = a + carry;
+    gost_limb c = t < carry;
+
+    t += b;
+    c += t < b;
+    *r = t;
+    return c;
+}
+
+/* r = a - b - borrow, returns borrow */
+static inline gost_limb sbb64(gost_limb *r, gost_limb a, gost_limb b,
+                              gost_limb borrow)
+{
+    gost_limb t = a - b;
+    gost_limb c = a < b;
+
+    c |= t < borrow;
+    *r = t - borrow;
+    return c;
+}
+
+/* All ones if the limb is zero, zero otherwise */
+static inline gost_limb limb_is_zero(gost_limb a)
+{
+    return (gost_limb)0 - (((~a & (a - 1)) >> 63) & 1);
+}
+
+static gost_limb fe_is_zero(const GOST_EC_MOD *m, const gost_limb *a)
+{
+    gost_limb t = 0;
+    unsigned int i;
+
+    for (i = 0; i < m->n; i++)
+        t |= a[i];
+    return limb_is_zero(t);
+}
+
+/* r = mask ? a : r */
+static void fe_cmov(const GOST_EC_MOD *m, gost_limb *r, const gost_limb *a,
+                    gost_limb mask)
+{
+    unsigned int i;
+
+    for (i = 0; i < m->n; i++)
+        r[i] ^= mask & (r[i] ^ a[i]);
+}
+
+static void fe_copy(const GOST_EC_MOD *m, gost_limb *r, const gost_limb *a)
+{
+    memcpy(r, a, m->n * sizeof(gost_limb));
+}
+
+/*
+ * r = t mod m for t < 2m, where the value of t is hi * 2^(64n) + t[]
+ */
+static inline void fe_reduce_once(const GOST_EC_MOD *m, gost_limb *r,
+                                  const gost_limb *t, gost_limb hi,
+                                  const unsigned int n)
+{
+    gost_limb d[MAXL], borrow = 0;
+    unsigned int i;
+
+    FE_UNROLL
+    for (i = 0; i < n; i++)
+        borrow = sbb64(&d[i], t[i], m->m[i], borrow);
+    /* keep t when t < m, i.e. no high limb and the subtraction borrowed */
+    borrow = (gost_limb)0 - (~hi & borrow & 1);
+    FE_UNROLL
+    for (i = 0; i < n; i++)
+        r[i] = (t[i] & borrow) | (d[i] & ~borrow);
+}
+
+static inline void fe_add_n(const GOST_EC_MOD *m, gost_limb *r,
+                            const gost_limb *a, const gost_limb *b,
+                            const unsigned int n)
+{
+    gost_limb t[MAXL], carry = 0;
+    unsigned int i;
+
+    FE_UNROLL
+    for (i = 0; i < n; i++)
+        carry = adc64(&t[i], a[i], b[i], carry);
+    fe_reduce_once(m, r, t, carry, n);
+}
+
+static inline void fe_sub_n(const GOST_EC_MOD *m, gost_limb *r,
+                            const gost_limb *a, const gost_limb *b,
+                            const unsigned int n)
+{
+    gost_limb t[MAXL], mask, borrow = 0, carry = 0;
+    unsigned int i;
+
+    FE_UNROLL
+    for (i = 0; i < n; i++)
+        borrow = sbb64(&t[i], a[i], b[i], borrow);
+    mask = (gost_limb)0 - borrow;
+    FE_UNROLL
+    for (i = 0; i < n; i++)
+        carry = adc64(&r[i], t[i], m->m[i] & mask, carry);
+}
+
+static void fe_add(const GOST_EC_MOD *m, gost_limb *r, const gost_limb *a,
+                   const gost_limb *b)
+{
+    if (m->n == 4)
+        fe_add_n(m, r, a, b, 4);
+    else
+        fe_add_n(m, r, a, b, 8);
+}
+
+static void fe_sub(const GOST_EC_MOD *m, gost_limb *r, const gost_limb *a,
+                   const gost_limb *b)
+{
+    if (m->n == 4)
+        fe_sub_n(m, r, a, b, 4);
+    else
+        fe_sub_n(m, r, a, b, 8);
+}
+
+static void fe_neg(const GOST_EC_MOD *m, gost_limb *r, const gost_limb *a)
+{
+    gost_limb zero[MAXL];
+
+    memset(zero, 0, sizeof(zero));
+    fe_sub(m, r, zero, a);
+}
+
+/* Montgomery multiplication, CIOS */
+static inline void fe_mul_mont_n(const GOST_EC_MOD *m, gost_limb *r,
+                                 const gost_limb *a, const gost_limb *b,
+                                 const unsigned int n)
+{
+    gost_limb t[MAXL + 2], u, carry, lo;
+    unsigned int i, j;
+
+    memset(t, 0, sizeof(t));
+    FE_UNROLL
+    for (i = 0; i < n; i++) {
+        carry = 0;
+        FE_UNROLL
+        for (j = 0; j < n; j++)
+            carry = mac64(&t[j], a[j], b[i], t[j], carry);
+        t[n + 1] = adc64(&t[n], t[n], carry, 0);
+
+        u = t[0] * m->m0;
+        carry = mac64(&lo, u, m->m[0], t[0], 0);
+        FE_UNROLL
+        for (j = 1; j < n; j++)
+            carry = mac64(&t[j - 1], u, m->m[j], t[j], carry);
+        carry = adc64(&t[n - 1], t[n], carry, 0);
+        t[n] = t[n + 1] + carry;
+    }
+    fe_reduce_once(m, r, t, t[n], n);
+}
+
+/* t = a * b, 2n limbs */
+static inline void fe_mul_wide_n(gost_limb *t, const gost_limb *a,
+                                 const gost_limb *b, const unsigned int n)
+{
+    gost_limb carry;
+    unsigned int i, j;
+
+    FE_UNROLL
+    for (i = 0; i < n; i++) {
+        carry = 0;
+        FE_UNROLL
+        for (j = 0; j < n; j++)
+            carry = mac64(&t[i + j], a[j], b[i], i ? t[i + j] : 0, carry);
+        t[i + n] = carry;
+    }
+}
+
+/* Multiplication modulo 2^(64n) - c */
+static inline void fe_mul_pm_n(const GOST_EC_MOD *m, gost_limb *r,
+                               const gost_limb *a, const gost_limb *b,
+                               const unsigned int n)
+{
+    gost_limb t[2 * MAXL], acc[MAXL], carry, hi;
+    unsigned int i;
+
+    memset(acc, 0, sizeof(acc));
+    fe_mul_wide_n(t, a, b, n);
+
+    /* 2^(64n) == c, fold the high half in */
+    hi = 0;
+    FE_UNROLL
+    for (i = 0; i < n; i++)
+        hi = mac64(&acc[i], t[n + i], m->c, t[i], hi);
+    /* hi <= c, so hi * c fits into one limb */
+    carry = adc64(&acc[0], acc[0], hi * m->c, 0);
+    FE_UNROLL
+    for (i = 1; i < n; i++)
+        carry = adc64(&acc[i], acc[i], 0, carry);
+    /* on a wrap acc is small and adding c once more can not overflow */
+    carry = adc64(&acc[0], acc[0], m->c & ((gost_limb)0 - carry), 0);
+    FE_UNROLL
+    for (i = 1; i < n; i++)
+        carry = adc64(&acc[i], acc[i], 0, carry);
+    fe_reduce_once(m, r, acc, 0, n);
+}
+
+/* Multiplication modulo 2^(64n - 1) + e/2, where 2^(64n) == -e */
+static inline void fe_mul_pp_n(const GOST_EC_MOD *m, gost_limb *r,
+                               const gost_limb *a, const gost_limb *b,
+                               const unsigned int n)
+{
+    gost_limb t[2 * MAXL], x[MAXL], acc[MAXL], mask, carry, hi;
+    unsigned int i;
+
+    memset(x, 0, sizeof(x));
+    memset(acc, 0, sizeof(acc));
+    fe_mul_wide_n(t, a, b, n);
+
+    /* x + hi * 2^(64n) = e * high half, hi < e */
+    hi = 0;
+    FE_UNROLL
+    for (i = 0; i < n; i++)
+        hi = mac64(&x[i], t[n + i], m->e, 0, hi);
+    /* low half minus x, a borrow of 2^(64n) is worth e more */
+    carry = 0;
+    FE_UNROLL
+    for (i = 0; i < n; i++)
+        carry = sbb64(&acc[i], t[i], x[i], carry);
+    /* hi + borrow <= e, so the product fits into one limb */
+    carry = adc64(&acc[0], acc[0], (hi + carry) * m->e, 0);
+    FE_UNROLL
+    for (i = 1; i < n; i++)
+        carry = adc64(&acc[i], acc[i], 0, carry);
+    /*
+     * On a wrap acc is small and the lost 2^(64n) is replaced by
+     * 2^(64n) - m = m - e, which can not overflow
+     */
+    mask = (gost_limb)0 - carry;
+    carry = 0;
+    FE_UNROLL
+    for (i = 0; i < n; i++)
+        carry = adc64(&acc[i], acc[i], m->m[i] & mask, carry);
+    carry = sbb64(&acc[0], acc[0], m->e & mask, 0);
+    FE_UNROLL
+    for (i = 1; i < n; i++)
+        carry = sbb64(&acc[i], acc[i], 0, carry);
+    fe_reduce_once(m, r, acc, 0, n);
+}
+
+static void fe_mul_mont(const GOST_EC_MOD *m, gost_limb *r,
+                        const gost_limb *a, const gost_limb *b)
+{
+    if (m->n == 4)
+        fe_mul_mont_n(m, r, a, b, 4);
+    else
+        fe_mul_mont_n(m, r, a, b, 8);
+}
+
+static void fe_mul(const GOST_EC_MOD *m, gost_limb *r, const gost_limb *a,
+                   const gost_limb *b)
+{
+    if (m->c != 0) {
+        if (m->n == 4)
+            fe_mul_pm_n(m, r, a, b, 4);
+        else
+            fe_mul_pm_n(m, r, a, b, 8);
+    } else if (m->e != 0) {
+        if (m->n == 4)
+            fe_mul_pp_n(m, r, a, b, 4);
+        else
+            fe_mul_pp_n(m, r, a, b, 8);
+    } else {
+        fe_mul_mont(m, r, a, b);
+    }
+}
+
+static void fe_sqr(const GOST_EC_MOD *m, gost_limb *r, const gost_limb *a)
+{
+    fe_mul(m, r, a, a);
+}
+
+/*
+ * r = a^e with a public exponent, fixed 4-bit window
+ */
+static void fe_exp(const GOST_EC_MOD *m, gost_limb *r, const gost_limb *a,
+                   const gost_limb *e)
+{
+    gost_limb tbl[16][MAXL], acc[MAXL];
+    int i;
+    unsigned int k, d;
+
+    fe_copy(m, tbl[0], m->one);
+    for (k = 1; k < 16; k++)
+        fe_mul(m, tbl[k], tbl[k - 1], a);
+
+    fe_copy(m, acc, m->one);
+    for (i = m->n * 16 - 1; i >= 0; i--) {
+        for (k = 0; k < 4; k++)
+            fe_sqr(m, acc, acc);
+        d = (e[i / 16] >> ((i % 16) * 4)) & 0xF;
+        fe_mul(m, acc, acc, tbl[d]);
+    }
+    fe_copy(m, r, acc);
+}
+
+/* r = a^-1 = a^(m - 2), m prime. Inversion of zero gives zero. */
+static void fe_inv(const GOST_EC_MOD *m, gost_limb *r, const gost_limb *a)
+{
+    gost_limb e[MAXL], two[MAXL], borrow = 0;
+    unsigned int i;
+
+    memset(two, 0, sizeof(two));
+    two[0] = 2;
+    for (i = 0; i < m->n; i++)
+        borrow = sbb64(&e[i], m->m[i], two[i], borrow);
+    fe_exp(m, r, a, e);
+}
+
+/* Conversion from canonical value a < m to internal form */
+static void fe_to_mod(const GOST_EC_MOD *m, gost_limb *r, const gost_limb *a)
+{
+    if (m->c || m->e)
+        fe_copy(m, r, a);
+    else
+        fe_mul_mont(m, r, a, m->rr);
+}
+
+static void fe_from_mod(const GOST_EC_MOD *m, gost_limb *r,
+                        const gost_limb *a)
+{
+    gost_limb one[MAXL];
+
+    if (m->c || m->e) {
+        fe_copy(m, r, a);
+        return;
+    }
+    memset(one, 0, sizeof(one));
+    one[0] = 1;
+    fe_mul_mont(m, r, a, one);
+}
+
+static void limbs_from_bytes(gost_limb *r, unsigned int n,
+                             const unsigned char *in)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < n; i++) {
+        r[i] = 0;
+        for (j = 0; j < 8; j++)
+            r[i] |= (gost_limb)in[i * 8 + j] << (j * 8);
+    }
+}
+
+static void limbs_to_bytes(unsigned char *out, unsigned int n,
+                           const gost_limb *a)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < n; i++)
+        for (j = 0; j < 8; j++)
+            out[i * 8 + j] = (unsigned char)(a[i] >> (j * 8));
+}
+
+/* Parse big-endian hex string, returns 0 if it does not fit */
+static int limbs_from_hex(gost_limb *r, unsigned int n, const char *hex)
+{
+    size_t len = strlen(hex), i;
+    unsigned int v;
+    char ch;
+
+    memset(r, 0, n * sizeof(gost_limb));
+    if (len > n * 16)
+        return 0;
+    for (i = 0; i < len; i++) {
+        ch = hex[len - 1 - i];
+        if (ch >= '0' && ch <= '9')
+            v = ch - '0';
+        else if (ch >= 'a' && ch <= 'f')
+            v = ch - 'a' + 10;
+        else if (ch >= 'A' && ch <= 'F')
+            v = ch - 'A' + 10;
+        else
+            return 0;
+        r[i / 16] |= (gost_limb)v << ((i % 16) * 4);
+    }
+    return 1;
+}
+
+/* Compare canonical values, -1, 0 or 1. Not constant time. */
+static int limbs_cmp(const gost_limb *a, const gost_limb *b, unsigned int n)
+{
+    while (n--) {
+        if (a[n] != b[n])
+            return a[n] < b[n] ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * Sets up prime modulus from big-endian hex. Special forms are only looked
+ * for if special is set, otherwise residues are always in Montgomery form.
+ */
+static int mod_init(GOST_EC_MOD *m, const char *hex, int special)
+{
+    gost_limb inv = 1, t[MAXL], carry;
+    unsigned int n, i, k;
+
+    memset(m, 0, sizeof(*m));
+    for (n = 1; n <= MAXL; n++) {
+        if (strlen(hex) <= n * 16)
+            break;
+    }
+    /* The field code is instantiated for 256 and 512-bit moduli only */
+    if ((n != 4 && n != 8) || !limbs_from_hex(m->m, n, hex)
+        || !(m->m[0] & 1)
+        || m->m[n - 1] == 0)
+        return 0;
+    m->n = n;
+
+    /* Newton iteration for m^-1 mod 2^64 */
+    for (i = 0; i < 6; i++)
+        inv *= 2 - m->m[0] * inv;
+    m->m0 = (gost_limb)0 - inv;
+
+    /* Pseudo-Mersenne prime 2^(64n) - c */
+    m->c = (gost_limb)0 - m->m[0];
+    for (i = 1; i < n; i++) {
+        if (m->m[i] != ~(gost_limb)0)
+            m->c = 0;
+    }
+    if (m->c >= ((gost_limb)1 << 32) || !special)
+        m->c = 0;
+
+    /* Prime 2^(64n - 1) + e/2 */
+    m->e = m->m[0] << 1;
+    for (i = 1; i < n; i++) {
+        if (m->m[i] != (i == n - 1 ? (gost_limb)1 << 63 : 0))
+            m->e = 0;
+    }
+    if (m->e >= ((gost_limb)1 << 32) || !special)
+        m->e = 0;
+
+    /* 2^(64n) mod m and 2^(128n) mod m by doubling */
+    memset(t, 0, sizeof(t));
+    t[0] = 1;
+    for (k = 0; k < 128 * n; k++) {
+        carry = 0;
+        for (i = 0; i < n; i++)
+            carry = adc64(&t[i], t[i], t[i], carry);
+        if (n == 4)
+            fe_reduce_once(m, t, t, carry, 4);
+        else
+            fe_reduce_once(m, t, t, carry, 8);
+        if (k == 64 * n - 1)
+            memcpy(m->one, t, sizeof(t));
+    }
+    memcpy(m->rr, t, sizeof(t));
+    if (m->c || m->e) {
+        memset(m->one, 0, sizeof(m->one));
+        m->one[0] = 1;
+    }
+    return 1;
+}
+
+static int fe_from_hex(const GOST_EC_MOD *m, gost_limb *r, const char *hex)
+{
+    gost_limb t[MAXL];
+
+    if (!limbs_from_hex(t, m->n, hex) || limbs_cmp(t, m->m, m->n) >= 0)
+        return 0;
+    fe_to_mod(m, r, t);
+    return 1;
+}
+
+/*
+ * Point doubling, dbl-2001-b for a = -3 and dbl-2007-bl otherwise.
+ * Doubling the point at infinity gives the point at infinity.
+ */
+static void point_dbl(const GOST_EC_CURVE *c, GOST_EC_POINT *r,
+                      const GOST_EC_POINT *a)
+{
+    const GOST_EC_MOD *p = &c->p;
+    gost_limb t0[MAXL], t1[MAXL], t2[MAXL], t3[MAXL], t4[MAXL];
+
+    if (c->a_is_minus3) {
+        fe_sqr(p, t0, a->Z);                /* delta */
+        fe_sqr(p, t1, a->Y);                /* gamma */
+        fe_mul(p, t2, a->X, t1);            /* beta */
+        fe_sub(p, t3, a->X, t0);
+        fe_add(p, t4, a->X, t0);
+        fe_mul(p, t3, t3, t4);
+        fe_add(p, t4, t3, t3);
+        fe_add(p, t3, t4, t3);              /* alpha */
+        fe_add(p, r->Z, a->Y, a->Z);
+        fe_sqr(p, r->Z, r->Z);
+        fe_sub(p, r->Z, r->Z, t1);
+        fe_sub(p, r->Z, r->Z, t0);
+        fe_add(p, t2, t2, t2);
+        fe_add(p, t2, t2, t2);              /* 4 beta */
+        fe_sqr(p, t4, t3);
+        fe_sub(p, t4, t4, t2);
+        fe_sub(p, r->X, t4, t2);
+        fe_sub(p, t2, t2, r->X);
+        fe_mul(p, t2, t3, t2);
+        fe_sqr(p, t1, t1);
+        fe_add(p, t1, t1, t1);
+        fe_add(p, t1, t1, t1);
+        fe_add(p, t1, t1, t1);              /* 8 gamma^2 */
+        fe_sub(p, r->Y, t2, t1);
+    } else {
+        fe_sqr(p, t0, a->X);                /* XX */
+        fe_sqr(p, t1, a->Y);                /* YY */
+        fe_sqr(p, t2, t1);                  /* YYYY */
+        fe_sqr(p, t3, a->Z);                /* ZZ */
+        fe_add(p, t4, a->X, t1);
+        fe_sqr(p, t4, t4);
+        fe_sub(p, t4, t4, t0);
+        fe_sub(p, t4, t4, t2);
+        fe_add(p, t4, t4, t4);              /* S */
+        fe_add(p, r->Z, a->Y, a->Z);
+        fe_sqr(p, r->Z, r->Z);
+        fe_sub(p, r->Z, r->Z, t1);
+        fe_sub(p, r->Z, r->Z, t3);
+        fe_sqr(p, t3, t3);
+        fe_mul(p, t3, t3, c->a);
+        fe_add(p, t1, t0, t0);
+        fe_add(p, t0, t1, t0);
+        fe_add(p, t0, t0, t3);              /* M */
+        fe_sqr(p, t1, t0);
+        fe_sub(p, t1, t1, t4);
+        fe_sub(p, r->X, t1, t4);            /* T */
+        fe_sub(p, t4, t4, r->X);
+        fe_mul(p, t4, t0, t4);
+        fe_add(p, t2, t2, t2);
+        fe_add(p, t2, t2, t2);
+        fe_add(p, t2, t2, t2);              /* 8 YYYY */
+        fe_sub(p, r->Y, t4, t2);
+    }
+}
+
+static void point_cmov(const GOST_EC_MOD *p, GOST_EC_POINT *r,
+                       const GOST_EC_POINT *a, gost_limb mask)
+{
+    fe_cmov(p, r->X, a->X, mask);
+    fe_cmov(p, r->Y, a->Y, mask);
+    fe_cmov(p, r->Z, a->Z, mask);
+}
+
+/*
+ * Point addition, add-2007-bl. The point at infinity is handled by
+ * constant time selection. Equal operands are doubled instead, that
+ * branch is never taken inside a multiplication by a scalar below the
+ * order of the point, so it depends on public inputs only.
+ */
+static void point_add(const GOST_EC_CURVE *c, GOST_EC_POINT *r,
+                      const GOST_EC_POINT *a, const GOST_EC_POINT *b)
+{
+    const GOST_EC_MOD *p = &c->p;
+    gost_limb z1z1[MAXL], z2z2[MAXL], u1[MAXL], u2[MAXL], s1[MAXL],
+        s2[MAXL], h[MAXL], i[MAXL], j[MAXL], rr[MAXL], v[MAXL];
+    gost_limb inf_a, inf_b, same;
+    GOST_EC_POINT res;
+
+    inf_a = fe_is_zero(p, a->Z);
+    inf_b = fe_is_zero(p, b->Z);
+
+    fe_sqr(p, z1z1, a->Z);
+    fe_sqr(p, z2z2, b->Z);
+    fe_mul(p, u1, a->X, z2z2);
+    fe_mul(p, u2, b->X, z1z1);
+    fe_mul(p, s1, a->Y, b->Z);
+    fe_mul(p, s1, s1, z2z2);
+    fe_mul(p, s2, b->Y, a->Z);
+    fe_mul(p, s2, s2, z1z1);
+    fe_sub(p, h, u2, u1);
+    fe_sub(p, rr, s2, s1);
+    same = fe_is_zero(p, h) & fe_is_zero(p, rr) & ~inf_a & ~inf_b;
+    if (same) {
+        point_dbl(c, r, a);
+        return;
+    }
+
+    fe_add(p, i, h, h);
+    fe_sqr(p, i, i);
+    fe_mul(p, j, h, i);
+    fe_add(p, rr, rr, rr);
+    fe_mul(p, v, u1, i);
+    fe_sqr(p, res.X, rr);
+    fe_sub(p, res.X, res.X, j);
+    fe_sub(p, res.X, res.X, v);
+    fe_sub(p, res.X, res.X, v);
+    fe_sub(p, res.Y, v, res.X);
+    fe_mul(p, res.Y, res.Y, rr);
+    fe_mul(p, s1, s1, j);
+    fe_add(p, s1, s1, s1);
+    fe_sub(p, res.Y, res.Y, s1);
+    fe_add(p, res.Z, a->Z, b->Z);
+    fe_sqr(p, res.Z, res.Z);
+    fe_sub(p, res.Z, res.Z, z1z1);
+    fe_sub(p, res.Z, res.Z, z2z2);
+    fe_mul(p, res.Z, res.Z, h);
+
+    point_cmov(p, &res, b, inf_a);
+    point_cmov(p, &res, a, inf_b);
+    *r = res;
+}
+
+/* tbl[i] = i*P for the 4-bit window */
+static void point_table(const GOST_EC_CURVE *c, GOST_EC_POINT *tbl,
+                        const GOST_EC_POINT *P)
+{
+    unsigned int i;
+
+    memset(&tbl[0], 0, sizeof(tbl[0]));
+    tbl[1] = *P;
+    for (i = 2; i < 16; i++) {
+        if (i & 1)
+            point_add(c, &tbl[i], &tbl[i - 1], P);
+        else
+            point_dbl(c, &tbl[i], &tbl[i / 2]);
+    }
+}
+
+/* r = tbl[d], reading every entry */
+static void point_lookup(const GOST_EC_MOD *p, GOST_EC_POINT *r,
+                         const GOST_EC_POINT *tbl, unsigned int d)
+{
+    unsigned int j;
+
+    memset(r, 0, sizeof(*r));
+    for (j = 0; j < 16; j++)
+        point_cmov(p, r, &tbl[j], limb_is_zero(j ^ d));
+}
+
+static unsigned int scalar_digit(const gost_limb *k, int w)
+{
+    return (k[w / 16] >> ((w % 16) * 4)) & 0xF;
+}
+
+/*
+ * r = k*P, fixed 4-bit window over all the limbs of k, so the sequence
+ * of operations does not depend on the scalar. k must be below the order
+ * of P.
+ */
+static void point_mul(const GOST_EC_CURVE *c, GOST_EC_POINT *r,
+                      const GOST_EC_POINT *P, const gost_limb *k)
+{
+    const GOST_EC_MOD *p = &c->p;
+    GOST_EC_POINT tbl[16], acc, t;
+    unsigned int i;
+    int w;
+
+    point_table(c, tbl, P);
+    memset(&acc, 0, sizeof(acc));
+    for (w = p->n * 16 - 1; w >= 0; w--) {
+        for (i = 0; i < 4; i++)
+            point_dbl(c, &acc, &acc);
+        point_lookup(p, &t, tbl, scalar_digit(k, w));
+        point_add(c, &acc, &acc, &t);
+    }
+    *r = acc;
+    OPENSSL_cleanse(tbl, sizeof(tbl));
+    OPENSSL_cleanse(&t, sizeof(t));
+}
+
+/*
+ * r = k*P + l*Q with the doublings shared between both scalars, same
+ * requirements as for point_mul().
+ */
+static void point_mul2(const GOST_EC_CURVE *c, GOST_EC_POINT *r,
+                       const GOST_EC_POINT *P, const gost_limb *k,
+                       const GOST_EC_POINT *Q, const gost_limb *l)
+{
+    const GOST_EC_MOD *p = &c->p;
+    GOST_EC_POINT tp[16], tq[16], acc, t;
+    unsigned int i;
+    int w;
+
+    point_table(c, tp, P);
+    point_table(c, tq, Q);
+    memset(&acc, 0, sizeof(acc));
+    for (w = p->n * 16 - 1; w >= 0; w--) {
+        for (i = 0; i < 4; i++)
+            point_dbl(c, &acc, &acc);
+        point_lookup(p, &t, tp, scalar_digit(k, w));
+        point_add(c, &acc, &acc, &t);
+        point_lookup(p, &t, tq, scalar_digit(l, w));
+        point_add(c, &acc, &acc, &t);
+    }
+    *r = acc;
+    OPENSSL_cleanse(tp, sizeof(tp));
+    OPENSSL_cleanse(tq, sizeof(tq));
+    OPENSSL_cleanse(&t, sizeof(t));
+}
+
+/* Affine coordinates in canonical form, returns 0 for infinity */
+static int point_get_affine(const GOST_EC_CURVE *c, gost_limb *x,
+                            gost_limb *y, const GOST_EC_POINT *a)
+{
+    const GOST_EC_MOD *p = &c->p;
+    gost_limb zi[MAXL], zi2[MAXL], t[MAXL];
+
+    if (fe_is_zero(p, a->Z))
+        return 0;
+    fe_inv(p, zi, a->Z);
+    fe_sqr(p, zi2, zi);
+    fe_mul(p, t, a->X, zi2);
+    fe_from_mod(p, x, t);
+    if (y != NULL) {
+        fe_mul(p, zi2, zi2, zi);
+        fe_mul(p, t, a->Y, zi2);
+        fe_from_mod(p, y, t);
+    }
+    return 1;
+}
+
+/*
+ * Twisted Edwards forms of the tc26 curves with cofactor 4, e = 1
+ * (R 1323565.1.024-2019)
+ */
+static const struct {
+    int nid;
+    const char *d;
+} gost_ec_edwards[] = {
+    {NID_id_tc26_gost_3410_2012_256_paramSetA,
+     "0605F6B7C183FA81578BC39CFAD518132B9DF62897009AF7E522C32D6DC7BFFB"},
+    {NID_id_tc26_gost_3410_2012_512_paramSetC,
+     "9E4F5D8C017D8D9F13A5CF3CDF5BFE4DAB402D54198E31EBDE28A0621050439C"
+     "A6B39E0A515C06B304E2CE43E79E369E91A0CFC2BC2A22B4CA302DBB33EE7550"},
+};
+
+static void ed_set_identity(const GOST_EC_MOD *p, GOST_EC_EPOINT *r)
+{
+    memset(r, 0, sizeof(*r));
+    fe_copy(p, r->Y, p->one);
+    fe_copy(p, r->Z, p->one);
+}
+
+static void ed_cmov(const GOST_EC_MOD *p, GOST_EC_EPOINT *r,
+                    const GOST_EC_EPOINT *a, gost_limb mask)
+{
+    fe_cmov(p, r->X, a->X, mask);
+    fe_cmov(p, r->Y, a->Y, mask);
+    fe_cmov(p, r->Z, a->Z, mask);
+    fe_cmov(p, r->T, a->T, mask);
+}
+
+/* dbl-2008-hwcd with a = 1, complete */
+static void ed_dbl(const GOST_EC_CURVE *c, GOST_EC_EPOINT *r,
+                   const GOST_EC_EPOINT *a)
+{
+    const GOST_EC_MOD *p = &c->p;
+    gost_limb A[MAXL], B[MAXL], C[MAXL], E[MAXL], F[MAXL], G[MAXL],
+        H[MAXL];
+
+    fe_sqr(p, A, a->X);
+    fe_sqr(p, B, a->Y);
+    fe_sqr(p, C, a->Z);
+    fe_add(p, C, C, C);
+    fe_add(p, E, a->X, a->Y);
+    fe_sqr(p, E, E);
+    fe_sub(p, E, E, A);
+    fe_sub(p, E, E, B);
+    fe_add(p, G, A, B);
+    fe_sub(p, F, G, C);
+    fe_sub(p, H, A, B);
+    fe_mul(p, r->X, E, F);
+    fe_mul(p, r->Y, G, H);
+    fe_mul(p, r->T, E, H);
+    fe_mul(p, r->Z, F, G);
+}
+
+/*
+ * add-2008-hwcd with a = 1. The law is complete since d is not a square,
+ * so any inputs are fine, equal ones and the identity included.
+ */
+static void ed_add(const GOST_EC_CURVE *c, GOST_EC_EPOINT *r,
+                   const GOST_EC_EPOINT *a, const GOST_EC_EPOINT *b)
+{
+    const GOST_EC_MOD *p = &c->p;
+    gost_limb A[MAXL], B[MAXL], C[MAXL], D[MAXL], E[MAXL], F[MAXL],
+        G[MAXL], H[MAXL];
+
+    fe_mul(p, A, a->X, b->X);
+    fe_mul(p, B, a->Y, b->Y);
+    fe_mul(p, C, a->T, b->T);
+    fe_mul(p, C, C, c->d);
+    fe_mul(p, D, a->Z, b->Z);
+    fe_add(p, E, a->X, a->Y);
+    fe_add(p, F, b->X, b->Y);
+    fe_mul(p, E, E, F);
+    fe_sub(p, E, E, A);
+    fe_sub(p, E, E, B);
+    fe_sub(p, F, D, C);
+    fe_add(p, G, D, C);
+    fe_sub(p, H, B, A);
+    fe_mul(p, r->X, E, F);
+    fe_mul(p, r->Y, G, H);
+    fe_mul(p, r->T, E, H);
+    fe_mul(p, r->Z, F, G);
+}
+
+/*
+ * Weierstrass affine (x, y) in internal form to Edwards, projectively:
+ * u = (x - t)/y, v = (x - t - s)/(x - t + s). x - t + s never vanishes
+ * on the curve, y does only at (t, 0), which maps to (0, -1).
+ */
+static void ed_from_affine(const GOST_EC_CURVE *c, GOST_EC_EPOINT *r,
+                           const gost_limb *x, const gost_limb *y)
+{
+    const GOST_EC_MOD *p = &c->p;
+    gost_limb xt[MAXL], num[MAXL], den[MAXL];
+    GOST_EC_EPOINT two;
+
+    fe_sub(p, xt, x, c->t);
+    fe_sub(p, num, xt, c->s);
+    fe_add(p, den, xt, c->s);
+    fe_mul(p, r->X, xt, den);
+    fe_mul(p, r->Y, num, y);
+    fe_mul(p, r->Z, y, den);
+    fe_mul(p, r->T, xt, num);
+
+    memset(&two, 0, sizeof(two));
+    fe_neg(p, two.Y, p->one);
+    fe_copy(p, two.Z, p->one);
+    ed_cmov(p, r, &two, fe_is_zero(p, y));
+}
+
+/*
+ * Edwards to Weierstrass affine coordinates in canonical form, returns 0
+ * for the identity. With w = 1/((Z - Y)X) we have
+ * x = s(Z + Y)Xw + t and y = s(Z + Y)Zw, which also gives (t, 0) for
+ * (0, -1) as inversion of zero gives zero.
+ */
+static int ed_get_affine(const GOST_EC_CURVE *c, gost_limb *x,
+                         gost_limb *y, const GOST_EC_EPOINT *a)
+{
+    const GOST_EC_MOD *p = &c->p;
+    gost_limb w[MAXL], sp[MAXL], t[MAXL];
+
+    fe_sub(p, w, a->Z, a->Y);
+    if (fe_is_zero(p, a->X) & fe_is_zero(p, w))
+        return 0;
+    fe_mul(p, w, w, a->X);
+    fe_inv(p, w, w);
+    fe_add(p, sp, a->Z, a->Y);
+    fe_mul(p, sp, sp, c->s);
+    fe_mul(p, sp, sp, w);
+    fe_mul(p, t, sp, a->X);
+    fe_add(p, t, t, c->t);
+    fe_from_mod(p, x, t);
+    if (y != NULL) {
+        fe_mul(p, t, sp, a->Z);
+        fe_from_mod(p, y, t);
+    }
+    return 1;
+}
+
+/* tbl[i] = i*P for the 4-bit window */
+static void ed_table(const GOST_EC_CURVE *c, GOST_EC_EPOINT *tbl,
+                     const GOST_EC_EPOINT *P)
+{
+    unsigned int i;
+
+    ed_set_identity(&c->p, &tbl[0]);
+    tbl[1] = *P;
+    for (i = 2; i < 16; i++) {
+        if (i & 1)
+            ed_add(c, &tbl[i], &tbl[i - 1], P);
+        else
+            ed_dbl(c, &tbl[i], &tbl[i / 2]);
+    }
+}
+
+static void ed_lookup(const GOST_EC_MOD *p, GOST_EC_EPOINT *r,
+                      const GOST_EC_EPOINT *tbl, unsigned int d)
+{
+    unsigned int j;
+
+    memset(r, 0, sizeof(*r));
+    for (j = 0; j < 16; j++)
+        ed_cmov(p, r, &tbl[j], limb_is_zero(j ^ d));
+}
+
+/* r = k*P + l*Q, where P or Q can be NULL. Same window as point_mul(). */
+static void ed_mul2(const GOST_EC_CURVE *c, GOST_EC_EPOINT *r,
+                    const GOST_EC_EPOINT *P, const gost_limb *k,
+                    const GOST_EC_EPOINT *Q, const gost_limb *l)
+{
+    const GOST_EC_MOD *p = &c->p;
+    GOST_EC_EPOINT tp[16], tq[16], acc, t;
+    unsigned int i;
+    int w;
+
+    if (P != NULL)
+        ed_table(c, tp, P);
+    if (Q != NULL)
+        ed_table(c, tq, Q);
+    ed_set_identity(p, &acc);
+    for (w = p->n * 16 - 1; w >= 0; w--) {
+        for (i = 0; i < 4; i++)
+            ed_dbl(c, &acc, &acc);
+        if (P != NULL) {
+            ed_lookup(p, &t, tp, scalar_digit(k, w));
+            ed_add(c, &acc, &acc, &t);
+        }
+        if (Q != NULL) {
+            ed_lookup(p, &t, tq, scalar_digit(l, w));
+            ed_add(c, &acc, &acc, &t);
+        }
+    }
+    *r = acc;
+    OPENSSL_cleanse(tp, sizeof(tp));
+    OPENSSL_cleanse(tq, sizeof(tq));
+    OPENSSL_cleanse(&t, sizeof(t));
+}
+
+/* Sets up the twisted Edwards form if the curve has a known one */
+static int ed_init(GOST_EC_CURVE *c)
+{
+    const GOST_EC_MOD *p = &c->p;
+    gost_limb k[MAXL], t0[MAXL], t1[MAXL], t2[MAXL];
+    size_t i;
+
+    for (i = 0; i < sizeof(gost_ec_edwards) / sizeof(gost_ec_edwards[0]);
+         i++) {
+        if (gost_ec_edwards[i].nid == c->nid)
+            break;
+    }
+    if (i == sizeof(gost_ec_edwards) / sizeof(gost_ec_edwards[0])
+        || !fe_from_hex(p, c->d, gost_ec_edwards[i].d))
+        return 0;
+
+    /* s = (1 - d)/4, t = (1 + d)/6 */
+    memset(k, 0, sizeof(k));
+    k[0] = 4;
+    fe_to_mod(p, k, k);
+    fe_inv(p, k, k);
+    fe_sub(p, c->s, p->one, c->d);
+    fe_mul(p, c->s, c->s, k);
+    memset(k, 0, sizeof(k));
+    k[0] = 6;
+    fe_to_mod(p, k, k);
+    fe_inv(p, k, k);
+    fe_add(p, c->t, p->one, c->d);
+    fe_mul(p, c->t, c->t, k);
+
+    /* a = s^2 - 3t^2 and b = 2t^3 - ts^2 */
+    fe_sqr(p, t0, c->s);
+    fe_sqr(p, t1, c->t);
+    fe_add(p, t2, t1, t1);
+    fe_add(p, t2, t2, t1);
+    fe_sub(p, t2, t0, t2);
+    if (limbs_cmp(t2, c->a, p->n) != 0)
+        return 0;
+    fe_add(p, t1, t1, t1);
+    fe_sub(p, t1, t1, t0);
+    fe_mul(p, t1, t1, c->t);
+    if (limbs_cmp(t1, c->b, p->n) != 0)
+        return 0;
+
+    ed_from_affine(c, &c->EG, c->G.X, c->G.Y);
+    return 1;
+}
+
+/*
+ * Fixed-base multiplication by comb tables. The scalar is recoded into
+ * COMB_DIGITS signed digits in [-8, 8], digit i is looked up in row
+ * i / GOST_EC_COMB_SPACING which holds multiples of 16^i * G scaled down
+ * to the start of its row, so the whole multiplication takes only
+ * 4 * (GOST_EC_COMB_SPACING - 1) doublings.
+ */
+#define COMB_DIGITS(n) ((n) * 16 + 1)
+#define COMB_ROWS(n) \
+    ((COMB_DIGITS(n) + GOST_EC_COMB_SPACING - 1) / GOST_EC_COMB_SPACING)
+
+static size_t comb_entry_size(const GOST_EC_CURVE *c)
+{
+    return (c->edwards ? 3 : 2) * c->p.n;
+}
+
+/*
+ * Signed 4-bit recoding, d[i] = v - 16 * carry for v = nibble + carry
+ * with the carry out set for v >= 8. The last digit is the final carry.
+ */
+static void comb_recode(const GOST_EC_MOD *p, int *d, const gost_limb *k)
+{
+    unsigned int carry = 0, v;
+    int i;
+
+    for (i = 0; i < COMB_DIGITS(p->n) - 1; i++) {
+        v = scalar_digit(k, i) + carry;
+        carry = (v + 8) >> 4;
+        d[i] = (int)v - (int)(carry << 4);
+    }
+    d[i] = carry;
+}
+
+/* Absolute value and sign mask of a recoded digit without branches */
+static unsigned int comb_digit(int d, gost_limb *neg)
+{
+    unsigned int s = (unsigned int)d >> (sizeof(int) * 8 - 1);
+
+    *neg = (gost_limb)0 - s;
+    return ((unsigned int)d ^ (0U - s)) + s;
+}
+
+/* r = entry |d| of the row, reading every entry, or zeros for d == 0 */
+static void comb_lookup(const GOST_EC_CURVE *c, gost_limb *r,
+                        const gost_limb *row, unsigned int d)
+{
+    size_t size = comb_entry_size(c);
+    unsigned int j;
+    size_t i;
+
+    memset(r, 0, size * sizeof(gost_limb));
+    for (j = 1; j <= GOST_EC_COMB_ENTRIES; j++, row += size) {
+        gost_limb mask = limb_is_zero(j ^ d);
+
+        for (i = 0; i < size; i++)
+            r[i] ^= mask & (r[i] ^ row[i]);
+    }
+}
+
+/*
+ * Mixed addition with an affine point, madd-2007-bl. The point at
+ * infinity for acc is handled by constant time selection and an all-zero
+ * b stands for infinity. As with point_add(), equal operands are doubled
+ * instead; with the rows of the comb this is as unlikely as finding the
+ * discrete logarithm.
+ */
+static void point_add_affine(const GOST_EC_CURVE *c, GOST_EC_POINT *r,
+                             const GOST_EC_POINT *a, const gost_limb *bx,
+                             const gost_limb *by, gost_limb inf_b)
+{
+    const GOST_EC_MOD *p = &c->p;
+    gost_limb z1z1[MAXL], u2[MAXL], s2[MAXL], h[MAXL], hh[MAXL], i[MAXL],
+        j[MAXL], rr[MAXL], v[MAXL];
+    gost_limb inf_a, same;
+    GOST_EC_POINT res, b;
+
+    inf_a = fe_is_zero(p, a->Z);
+
+    fe_sqr(p, z1z1, a->Z);
+    fe_mul(p, u2, bx, z1z1);
+    fe_mul(p, s2, by, a->Z);
+    fe_mul(p, s2, s2, z1z1);
+    fe_sub(p, h, u2, a->X);
+    fe_sub(p, rr, s2, a->Y);
+    same = fe_is_zero(p, h) & fe_is_zero(p, rr) & ~inf_a & ~inf_b;
+    if (same) {
+        point_dbl(c, r, a);
+        return;
+    }
+
+    fe_sqr(p, hh, h);
+    fe_add(p, i, hh, hh);
+    fe_add(p, i, i, i);
+    fe_mul(p, j, h, i);
+    fe_add(p, rr, rr, rr);
+    fe_mul(p, v, a->X, i);
+    fe_sqr(p, res.X, rr);
+    fe_sub(p, res.X, res.X, j);
+    fe_sub(p, res.X, res.X, v);
+    fe_sub(p, res.X, res.X, v);
+    fe_sub(p, res.Y, v, res.X);
+    fe_mul(p, res.Y, res.Y, rr);
+    fe_mul(p, j, a->Y, j);
+    fe_add(p, j, j, j);
+    fe_sub(p, res.Y, res.Y, j);
+    fe_add(p, res.Z, a->Z, h);
+    fe_sqr(p, res.Z, res.Z);
+    fe_sub(p, res.Z, res.Z, z1z1);
+    fe_sub(p, res.Z, res.Z, hh);
+
+    fe_copy(p, b.X, bx);
+    fe_copy(p, b.Y, by);
+    fe_copy(p, b.Z, p->one);
+    point_cmov(p, &res, &b, inf_a);
+    point_cmov(p, &res, a, inf_b);
+    *r = res;
+}
+
+/* r = k*P from the comb table of P, k below the order of P */
+static void point_mul_comb(const GOST_EC_CURVE *c, GOST_EC_POINT *r,
+                           const gost_limb *tbl, const gost_limb *k)
+{
+    const GOST_EC_MOD *p = &c->p;
+    size_t row = GOST_EC_COMB_ENTRIES * comb_entry_size(c);
+    int d[COMB_DIGITS(MAXL)];
+    gost_limb t[2 * MAXL], y[MAXL], neg;
+    GOST_EC_POINT acc;
+    unsigned int a, i, abs;
+    int s;
+
+    comb_recode(p, d, k);
+    memset(&acc, 0, sizeof(acc));
+    for (s = GOST_EC_COMB_SPACING - 1; s >= 0; s--) {
+        if (s != GOST_EC_COMB_SPACING - 1)
+            for (i = 0; i < 4; i++)
+                point_dbl(c, &acc, &acc);
+        for (a = 0; a < COMB_ROWS(p->n); a++) {
+            if (a * GOST_EC_COMB_SPACING + s >= COMB_DIGITS(p->n))
+                break;
+            abs = comb_digit(d[a * GOST_EC_COMB_SPACING + s], &neg);
+            comb_lookup(c, t, tbl + a * row, abs);
+            fe_neg(p, y, t + p->n);
+            fe_cmov(p, t + p->n, y, neg);
+            point_add_affine(c, &acc, &acc, t, t + p->n,
+                             limb_is_zero(abs));
+        }
+    }
+    *r = acc;
+    OPENSSL_cleanse(d, sizeof(d));
+    OPENSSL_cleanse(t, sizeof(t));
+    OPENSSL_cleanse(y, sizeof(y));
+}
+
+/*
+ * Mixed Edwards addition with (u, v, duv), add-2008-hwcd with Z2 = 1.
+ * Complete like ed_add(), an identity entry is (0, 1, 0).
+ */
+static void ed_add_affine(const GOST_EC_CURVE *c, GOST_EC_EPOINT *r,
+                          const GOST_EC_EPOINT *a, const gost_limb *b)
+{
+    const GOST_EC_MOD *p = &c->p;
+    const gost_limb *u = b, *v = b + p->n, *w = b + 2 * p->n;
+    gost_limb A[MAXL], B[MAXL], C[MAXL], E[MAXL], F[MAXL], G[MAXL],
+        H[MAXL];
+
+    fe_mul(p, A, a->X, u);
+    fe_mul(p, B, a->Y, v);
+    fe_mul(p, C, a->T, w);
+    fe_add(p, E, a->X, a->Y);
+    fe_add(p, F, u, v);
+    fe_mul(p, E, E, F);
+    fe_sub(p, E, E, A);
+    fe_sub(p, E, E, B);
+    fe_sub(p, F, a->Z, C);
+    fe_add(p, G, a->Z, C);
+    fe_sub(p, H, B, A);
+    fe_mul(p, r->X, E, F);
+    fe_mul(p, r->Y, G, H);
+    fe_mul(p, r->T, E, H);
+    fe_mul(p, r->Z, F, G);
+}
+
+/* Edwards variant of point_mul_comb(), -(u, v, duv) = (-u, v, -duv) */
+static void ed_mul_comb(const GOST_EC_CURVE *c, GOST_EC_EPOINT *r,
+                        const gost_limb *tbl, const gost_limb *k)
+{
+    const GOST_EC_MOD *p = &c->p;
+    size_t row = GOST_EC_COMB_ENTRIES * comb_entry_size(c);
+    int d[COMB_DIGITS(MAXL)];
+    gost_limb t[3 * MAXL], n[MAXL], neg, zero;
+    GOST_EC_EPOINT acc;
+    unsigned int a, i, abs;
+    int s;
+
+    comb_recode(p, d, k);
+    ed_set_identity(p, &acc);
+    for (s = GOST_EC_COMB_SPACING - 1; s >= 0; s--) {
+        if (s != GOST_EC_COMB_SPACING - 1)
+            for (i = 0; i < 4; i++)
+                ed_dbl(c, &acc, &acc);
+        for (a = 0; a < COMB_ROWS(p->n); a++) {
+            if (a * GOST_EC_COMB_SPACING + s >= COMB_DIGITS(p->n))
+                break;
+            abs = comb_digit(d[a * GOST_EC_COMB_SPACING + s], &neg);
+            comb_lookup(c, t, tbl + a * row, abs);
+            zero = limb_is_zero(abs);
+            fe_cmov(p, t + p->n, p->one, zero);
+            fe_neg(p, n, t);
+            fe_cmov(p, t, n, neg);
+            fe_neg(p, n, t + 2 * p->n);
+            fe_cmov(p, t + 2 * p->n, n, neg);
+            ed_add_affine(c, &acc, &acc, t);
+        }
+    }
+    *r = acc;
+    OPENSSL_cleanse(d, sizeof(d));
+    OPENSSL_cleanse(t, sizeof(t));
+    OPENSSL_cleanse(n, sizeof(n));
+}
+
+/* Size of the comb table in limbs */
+size_t gost_ec_curve_comb_size(const GOST_EC_CURVE *curve)
+{
+    return COMB_ROWS(curve->p.n) * GOST_EC_COMB_ENTRIES
+        * comb_entry_size(curve);
+}
+
+/*
+ * Writes the comb table of P, or of EP on Edwards curves, to out.
+ * Entries of a row are converted to affine form with one inversion.
+ * Returns 0 if a multiple of P hits infinity.
+ */
+static int comb_build(const GOST_EC_CURVE *c, gost_limb *out,
+                      const GOST_EC_POINT *P, const GOST_EC_EPOINT *EP)
+{
+    const GOST_EC_MOD *p = &c->p;
+    GOST_EC_POINT B, R[GOST_EC_COMB_ENTRIES];
+    GOST_EC_EPOINT EB, ER[GOST_EC_COMB_ENTRIES];
+    gost_limb acc[GOST_EC_COMB_ENTRIES][MAXL], zi[MAXL], zi2[MAXL];
+    size_t size = comb_entry_size(c);
+    unsigned int a, i, j;
+
+    if (c->edwards)
+        EB = *EP;
+    else
+        B = *P;
+    for (a = 0; a < COMB_ROWS(p->n); a++) {
+        for (j = 0; j < GOST_EC_COMB_ENTRIES; j++) {
+            if (c->edwards) {
+                if (j == 0)
+                    ER[j] = EB;
+                else
+                    ed_add(c, &ER[j], &ER[j - 1], &EB);
+                fe_copy(p, zi, ER[j].Z);
+            } else {
+                if (j == 0)
+                    R[j] = B;
+                else
+                    point_add(c, &R[j], &R[j - 1], &B);
+                fe_copy(p, zi, R[j].Z);
+            }
+            if (fe_is_zero(p, zi))
+                return 0;
+            if (j == 0)
+                fe_copy(p, acc[j], zi);
+            else
+                fe_mul(p, acc[j], acc[j - 1], zi);
+        }
+
+        /* acc[j] = Z_0 ... Z_j, walk back from the inverse of the last */
+        fe_inv(p, zi2, acc[GOST_EC_COMB_ENTRIES - 1]);
+        for (j = GOST_EC_COMB_ENTRIES; j-- > 0;) {
+            gost_limb *e = out + j * size;
+
+            if (j == 0)
+                fe_copy(p, zi, zi2);
+            else
+                fe_mul(p, zi, zi2, acc[j - 1]);
+            if (c->edwards) {
+                fe_mul(p, zi2, zi2, ER[j].Z);
+                fe_mul(p, e, ER[j].X, zi);
+                fe_mul(p, e + p->n, ER[j].Y, zi);
+                fe_mul(p, e + 2 * p->n, e, e + p->n);
+                fe_mul(p, e + 2 * p->n, e + 2 * p->n, c->d);
+            } else {
+                fe_mul(p, zi2, zi2, R[j].Z);
+                fe_mul(p, e, R[j].Y, zi);
+                fe_sqr(p, zi, zi);
+                fe_mul(p, e + p->n, e, zi);
+                fe_mul(p, e, R[j].X, zi);
+            }
+        }
+        out += GOST_EC_COMB_ENTRIES * size;
+
+        for (i = 0; i < 4 * GOST_EC_COMB_SPACING; i++) {
+            if (c->edwards)
+                ed_dbl(c, &EB, &EB);
+            else
+                point_dbl(c, &B, &B);
+        }
+    }
+    return 1;
+}
+
+/*
+ * Computes the comb table of the curve generator into out of
+ * gost_ec_curve_comb_size() limbs, meant to run at build time.
+ */
+void gost_ec_curve_comb(const GOST_EC_CURVE *curve, gost_limb *out)
+{
+    comb_build(curve, out, &curve->G, &curve->EG);
+}
+
+/*
+ * Picks up the precomputed table for the curve, making sure it was
+ * generated for this very generator point.
+ */
+static void comb_init(GOST_EC_CURVE *c)
+{
+    const GOST_EC_MOD *p = &c->p;
+    const gost_limb *tbl = gost_ec_precomputed(c->nid);
+    gost_limb t[MAXL];
+
+    if (tbl == NULL)
+        return;
+    if (c->edwards) {
+        fe_mul(p, t, tbl, c->EG.Z);
+        if (limbs_cmp(t, c->EG.X, p->n) != 0)
+            return;
+        fe_mul(p, t, tbl + p->n, c->EG.Z);
+        if (limbs_cmp(t, c->EG.Y, p->n) != 0)
+            return;
+    } else if (limbs_cmp(tbl, c->G.X, p->n) != 0
+               || limbs_cmp(tbl + p->n, c->G.Y, p->n) != 0) {
+        return;
+    }
+    c->comb = tbl;
+}
+
+/*
+ * Sets up curve from parameter set. Returns 0 when the prime is neither
+ * 256 nor 512-bit long, or the order is not of the same size.
+ */
+int gost_ec_curve_init(GOST_EC_CURVE *curve, const R3410_ec_params *params)
+{
+    GOST_EC_MOD *p = &curve->p;
+    gost_limb three[MAXL], minus3[MAXL];
+
+    memset(curve, 0, sizeof(*curve));
+    if (!mod_init(p, params->p, 1)
+        || !mod_init(&curve->q, params->q, 0)
+        || curve->q.n != p->n
+        || !fe_from_hex(p, curve->a, params->a)
+        || !fe_from_hex(p, curve->b, params->b)
+        || !fe_from_hex(p, curve->G.X, params->x)
+        || !fe_from_hex(p, curve->G.Y, params->y))
+        return 0;
+    fe_copy(p, curve->G.Z, p->one);
+
+    memset(three, 0, sizeof(three));
+    three[0] = 3;
+    fe_to_mod(p, three, three);
+    fe_neg(p, minus3, three);
+    curve->a_is_minus3 = limbs_cmp(curve->a, minus3, p->n) == 0;
+    curve->nid = params->nid;
+    curve->edwards = ed_init(curve);
+    comb_init(curve);
+    return 1;
+}
+
+/* Size of coordinates and scalars in bytes */
+size_t gost_ec_curve_size(const GOST_EC_CURVE *curve)
+{
+    return curve->p.n * sizeof(gost_limb);
+}
+
+/*
+ * Loads little-endian scalar modulo q in Montgomery form. Any value of
+ * the curve size is accepted, REDC(a * R^2) is reduced for a < R.
+ */
+static void sc_from_bytes(const GOST_EC_MOD *q, gost_limb *r,
+                          const unsigned char *in)
+{
+    gost_limb t[MAXL];
+
+    limbs_from_bytes(t, q->n, in);
+    fe_mul_mont(q, r, t, q->rr);
+    OPENSSL_cleanse(t, sizeof(t));
+}
+
+static void sc_to_bytes(const GOST_EC_MOD *q, unsigned char *out,
+                        const gost_limb *a)
+{
+    gost_limb t[MAXL];
+
+    fe_from_mod(q, t, a);
+    limbs_to_bytes(out, q->n, t);
+    OPENSSL_cleanse(t, sizeof(t));
+}
+
+/*
+ * Signature scalar s = r * d + k * e mod q, e taken as 1 if it is 0 mod
+ * q. All values are little-endian of the curve size, the digest e may
+ * exceed q.
+ */
+void gost_ec_curve_sign_scalar(const GOST_EC_CURVE *curve, unsigned char *s,
+                               const unsigned char *d, const unsigned char *k,
+                               const unsigned char *r, const unsigned char *e)
+{
+    const GOST_EC_MOD *q = &curve->q;
+    gost_limb a[MAXL], b[MAXL], t[MAXL];
+
+    sc_from_bytes(q, t, e);
+    fe_cmov(q, t, q->one, fe_is_zero(q, t));
+    sc_from_bytes(q, a, k);
+    fe_mul(q, t, a, t);
+    sc_from_bytes(q, a, d);
+    sc_from_bytes(q, b, r);
+    fe_mul(q, a, a, b);
+    fe_add(q, t, t, a);
+    sc_to_bytes(q, s, t);
+    OPENSSL_cleanse(a, sizeof(a));
+    OPENSSL_cleanse(t, sizeof(t));
+}
+
+/*
+ * Verification scalars z1 = s / e and z2 = -r / e mod q, e taken as 1
+ * if it is 0 mod q. The inversion is done by Fermat's little theorem.
+ */
+void gost_ec_curve_verify_scalars(const GOST_EC_CURVE *curve,
+                                  unsigned char *z1, unsigned char *z2,
+                                  const unsigned char *r,
+                                  const unsigned char *s,
+                                  const unsigned char *e)
+{
+    const GOST_EC_MOD *q = &curve->q;
+    gost_limb v[MAXL], t[MAXL];
+
+    sc_from_bytes(q, v, e);
+    fe_cmov(q, v, q->one, fe_is_zero(q, v));
+    fe_inv(q, v, v);
+    sc_from_bytes(q, t, s);
+    fe_mul(q, t, t, v);
+    sc_to_bytes(q, z1, t);
+    sc_from_bytes(q, t, r);
+    fe_mul(q, t, t, v);
+    fe_neg(q, t, t);
+    sc_to_bytes(q, z2, t);
+}
+
+/* Loads affine point from little-endian coordinates to internal form */
+static void point_from_bytes(const GOST_EC_CURVE *c, GOST_EC_POINT *r,
+                             const unsigned char *x, const unsigned char *y)
+{
+    const GOST_EC_MOD *p = &c->p;
+
+    limbs_from_bytes(r->X, p->n, x);
+    limbs_from_bytes(r->Y, p->n, y);
+    fe_to_mod(p, r->X, r->X);
+    fe_to_mod(p, r->Y, r->Y);
+    fe_copy(p, r->Z, p->one);
+}
+
+/*
+ * n*G + m*Q with Q given either by its coordinates or by its comb table,
+ * left in acc or in eacc on Edwards curves.
+ */
+static void curve_mul_proj(const GOST_EC_CURVE *curve, GOST_EC_POINT *acc,
+                           GOST_EC_EPOINT *eacc, const unsigned char *n,
+                           const unsigned char *qx, const unsigned char *qy,
+                           const gost_limb *qcomb, const unsigned char *m)
+{
+    const GOST_EC_MOD *p = &curve->p;
+    GOST_EC_POINT Q;
+    GOST_EC_EPOINT EQ;
+    gost_limb k[MAXL], l[MAXL];
+    int has_q = ((qx != NULL && qy != NULL) || qcomb != NULL) && m != NULL;
+
+    memset(acc, 0, sizeof(*acc));
+    memset(k, 0, sizeof(k));
+    memset(l, 0, sizeof(l));
+    if (n != NULL)
+        limbs_from_bytes(k, p->n, n);
+    if (has_q) {
+        if (qcomb == NULL)
+            point_from_bytes(curve, &Q, qx, qy);
+        limbs_from_bytes(l, p->n, m);
+    }
+
+    if (curve->edwards) {
+        if (has_q && qcomb != NULL)
+            ed_mul_comb(curve, &EQ, qcomb, l);
+        else if (has_q)
+            ed_from_affine(curve, &EQ, Q.X, Q.Y);
+        if (n != NULL && curve->comb != NULL) {
+            ed_mul_comb(curve, eacc, curve->comb, k);
+            if (has_q) {
+                if (qcomb == NULL)
+                    ed_mul2(curve, &EQ, NULL, NULL, &EQ, l);
+                ed_add(curve, eacc, eacc, &EQ);
+            }
+        } else if (has_q && qcomb != NULL) {
+            ed_mul2(curve, eacc, n != NULL ? &curve->EG : NULL, k,
+                    NULL, NULL);
+            ed_add(curve, eacc, eacc, &EQ);
+        } else {
+            ed_mul2(curve, eacc, n != NULL ? &curve->EG : NULL, k,
+                    has_q ? &EQ : NULL, l);
+        }
+    } else {
+        if (has_q && qcomb != NULL) {
+            point_mul_comb(curve, &Q, qcomb, l);
+            if (n == NULL)
+                *acc = Q;
+            else if (curve->comb != NULL)
+                point_mul_comb(curve, acc, curve->comb, k);
+            else
+                point_mul(curve, acc, &curve->G, k);
+            if (n != NULL)
+                point_add(curve, acc, acc, &Q);
+        } else if (n != NULL && curve->comb != NULL) {
+            point_mul_comb(curve, acc, curve->comb, k);
+            if (has_q) {
+                point_mul(curve, &Q, &Q, l);
+                point_add(curve, acc, acc, &Q);
+            }
+        } else if (has_q && n != NULL) {
+            point_mul2(curve, acc, &curve->G, k, &Q, l);
+        } else if (has_q) {
+            point_mul(curve, acc, &Q, l);
+        } else if (n != NULL) {
+            point_mul(curve, acc, &curve->G, k);
+        }
+    }
+    OPENSSL_cleanse(k, sizeof(k));
+    OPENSSL_cleanse(l, sizeof(l));
+}
+
+/* Same with the result in canonical affine form */
+static int curve_mul(const GOST_EC_CURVE *curve,
+                     unsigned char *x, unsigned char *y,
+                     const unsigned char *n,
+                     const unsigned char *qx, const unsigned char *qy,
+                     const gost_limb *qcomb, const unsigned char *m)
+{
+    const GOST_EC_MOD *p = &curve->p;
+    GOST_EC_POINT acc;
+    GOST_EC_EPOINT eacc;
+    gost_limb ax[MAXL], ay[MAXL];
+    int ret;
+
+    memset(ax, 0, sizeof(ax));
+    memset(ay, 0, sizeof(ay));
+    curve_mul_proj(curve, &acc, &eacc, n, qx, qy, qcomb, m);
+    if (curve->edwards)
+        ret = ed_get_affine(curve, ax, ay, &eacc);
+    else
+        ret = point_get_affine(curve, ax, ay, &acc);
+    OPENSSL_cleanse(&acc, sizeof(acc));
+    OPENSSL_cleanse(&eacc, sizeof(eacc));
+
+    if (ret) {
+        limbs_to_bytes(x, p->n, ax);
+        if (y != NULL)
+            limbs_to_bytes(y, p->n, ay);
+    }
+    return ret;
+}
+
+/*
+ * (x, y) = n*G + m*Q. All the numbers are little-endian of
+ * gost_ec_curve_size() bytes, coordinates of Q must be below p, n and m
+ * below the order of G and Q.
+ * Either n or Q with m can be NULL. Returns 0 if the result is the point
+ * at infinity.
+ */
+int gost_ec_curve_mul(const GOST_EC_CURVE *curve,
+                      unsigned char *x, unsigned char *y,
+                      const unsigned char *n,
+                      const unsigned char *qx, const unsigned char *qy,
+                      const unsigned char *m)
+{
+    return curve_mul(curve, x, y, n, qx, qy, NULL, m);
+}
+
+/*
+ * Computes the comb table of Q for gost_ec_curve_mul_comb() into out of
+ * gost_ec_curve_comb_size() limbs. Q must be on the curve. Returns 0 if
+ * Q is of small order.
+ */
+int gost_ec_curve_comb_point(const GOST_EC_CURVE *curve, gost_limb *out,
+                             const unsigned char *qx,
+                             const unsigned char *qy)
+{
+    GOST_EC_POINT Q;
+    GOST_EC_EPOINT EQ;
+
+    point_from_bytes(curve, &Q, qx, qy);
+    if (curve->edwards)
+        ed_from_affine(curve, &EQ, Q.X, Q.Y);
+    return comb_build(curve, out, &Q, &EQ);
+}
+
+/* Same as gost_ec_curve_mul() with Q given by its comb table */
+int gost_ec_curve_mul_comb(const GOST_EC_CURVE *curve,
+                           unsigned char *x, unsigned char *y,
+                           const unsigned char *n, const gost_limb *qcomb,
+                           const unsigned char *m)
+{
+    return curve_mul(curve, x, y, n, NULL, NULL, qcomb, m);
+}
+
+/*
+ * Coordinates of n_i*G + m_i*Q_i for count items at once, converting
+ * them to affine form with a single inversion. n, qx, qy, m, x and y
+ * are arrays of count numbers of gost_ec_curve_size() bytes, y can be
+ * NULL. Either n or Q with m can be NULL as in gost_ec_curve_mul(), Q_i
+ * is taken from qcomb[i] when qcomb is not NULL. ok[i] is set to 0 if
+ * item i is the point at infinity, 1 otherwise. Returns 0 on allocation
+ * failure.
+ */
+int gost_ec_curve_mul_batch(const GOST_EC_CURVE *curve, size_t count,
+                            unsigned char *x, unsigned char *y,
+                            const unsigned char *n,
+                            const unsigned char *qx, const unsigned char *qy,
+                            const gost_limb *const *qcomb,
+                            const unsigned char *m, int *ok)
+{
+    const GOST_EC_MOD *p = &curve->p;
+    size_t len = gost_ec_curve_size(curve), i;
+    GOST_EC_POINT *acc;
+    GOST_EC_EPOINT *eacc;
+    gost_limb (*den)[MAXL], (*pre)[MAXL], *zero;
+    gost_limb inv[MAXL], di[MAXL], t[MAXL], w[MAXL];
+
+    if (count == 0)
+        return 1;
+    acc = OPENSSL_malloc(count * sizeof(*acc));
+    eacc = OPENSSL_malloc(count * sizeof(*eacc));
+    den = OPENSSL_malloc(count * sizeof(*den));
+    pre = OPENSSL_malloc(count * sizeof(*pre));
+    zero = OPENSSL_malloc(count * sizeof(*zero));
+    if (acc == NULL || eacc == NULL || den == NULL || pre == NULL
+        || zero == NULL) {
+        OPENSSL_free(acc);
+        OPENSSL_free(eacc);
+        OPENSSL_free(den);
+        OPENSSL_free(pre);
+        OPENSSL_free(zero);
+        return 0;
+    }
+
+    /*
+     * Denominators are Z, or (Z - Y)X for Edwards curves as in
+     * ed_get_affine(), zero ones are replaced by one for the product.
+     */
+    for (i = 0; i < count; i++) {
+        curve_mul_proj(curve, &acc[i], &eacc[i], n ? n + i * len : NULL,
+                       qx ? qx + i * len : NULL, qy ? qy + i * len : NULL,
+                       qcomb ? qcomb[i] : NULL, m ? m + i * len : NULL);
+        if (curve->edwards) {
+            fe_sub(p, w, eacc[i].Z, eacc[i].Y);
+            ok[i] = !(fe_is_zero(p, eacc[i].X) & fe_is_zero(p, w));
+            fe_mul(p, den[i], w, eacc[i].X);
+        } else {
+            ok[i] = !fe_is_zero(p, acc[i].Z);
+            fe_copy(p, den[i], acc[i].Z);
+        }
+        zero[i] = fe_is_zero(p, den[i]);
+        fe_cmov(p, den[i], p->one, zero[i]);
+        if (i == 0)
+            fe_copy(p, pre[i], den[i]);
+        else
+            fe_mul(p, pre[i], pre[i - 1], den[i]);
+    }
+
+    fe_inv(p, inv, pre[count - 1]);
+    memset(t, 0, sizeof(t));
+    for (i = count; i-- > 0;) {
+        if (i == 0)
+            fe_copy(p, di, inv);
+        else
+            fe_mul(p, di, inv, pre[i - 1]);
+        fe_mul(p, inv, inv, den[i]);
+        memset(w, 0, sizeof(w));
+        fe_cmov(p, di, w, zero[i]);
+        if (curve->edwards) {
+            fe_add(p, w, eacc[i].Z, eacc[i].Y);
+            fe_mul(p, w, w, curve->s);
+            fe_mul(p, di, w, di);
+            fe_mul(p, w, di, eacc[i].X);
+            fe_add(p, w, w, curve->t);
+            if (y != NULL)
+                fe_mul(p, di, di, eacc[i].Z);
+        } else {
+            fe_sqr(p, t, di);
+            fe_mul(p, w, acc[i].X, t);
+            if (y != NULL) {
+                fe_mul(p, t, t, di);
+                fe_mul(p, di, acc[i].Y, t);
+            }
+        }
+        fe_from_mod(p, t, w);
+        limbs_to_bytes(x + i * len, p->n, t);
+        if (y != NULL) {
+            fe_from_mod(p, t, di);
+            limbs_to_bytes(y + i * len, p->n, t);
+        }
+    }
+    OPENSSL_cleanse(inv, sizeof(inv));
+    OPENSSL_cleanse(di, sizeof(di));
+    OPENSSL_cleanse(w, sizeof(w));
+    OPENSSL_cleanse(t, sizeof(t));
+
+    OPENSSL_clear_free(acc, count * sizeof(*acc));
+    OPENSSL_clear_free(eacc, count * sizeof(*eacc));
+    OPENSSL_clear_free(den, count * sizeof(*den));
+    OPENSSL_clear_free(pre, count * sizeof(*pre));
+    OPENSSL_free(zero);
+    return 1;
+}
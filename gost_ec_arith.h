@@ -0,0 +1,112 @@
+/**********************************************************************
+ *                        gost_ec_arith.h                             *
+ *         This file is distributed under the same license as OpenSSL *
+ *                                                                    *
+ *     Fixed width constant time arithmetic for GOST R 34.10 curves   *
+ **********************************************************************/
+#ifndef GOST_EC_ARITH_H
+# define GOST_EC_ARITH_H
+
+# include <stdint.h>
+# include <stddef.h>
+# include "gost_lcl.h"
+
+# define GOST_EC_MAX_LIMBS 8
+
+typedef uint64_t gost_limb;
+
+/*
+ * Prime modulus. Residues are kept in Montgomery form, except for moduli
+ * of the form 2^(64n) - c or 2^(64n - 1) + e/2 with small c or e which
+ * are reduced directly.
+ */
+typedef struct gost_ec_mod {
+    unsigned int n;                      /* size in 64-bit limbs */
+    gost_limb m[GOST_EC_MAX_LIMBS];      /* modulus */
+    gost_limb c;                         /* m = 2^(64n) - c, 0 if not */
+    gost_limb e;                         /* m = 2^(64n - 1) + e/2, or 0 */
+    gost_limb m0;                        /* -m^-1 mod 2^64 */
+    gost_limb one[GOST_EC_MAX_LIMBS];    /* 1 in internal form */
+    gost_limb rr[GOST_EC_MAX_LIMBS];     /* 2^(128n) mod m */
+} GOST_EC_MOD;
+
+/* Jacobian coordinates, Z == 0 is the point at infinity */
+typedef struct gost_ec_point {
+    gost_limb X[GOST_EC_MAX_LIMBS];
+    gost_limb Y[GOST_EC_MAX_LIMBS];
+    gost_limb Z[GOST_EC_MAX_LIMBS];
+} GOST_EC_POINT;
+
+/* Extended twisted Edwards coordinates, u = X/Z, v = Y/Z, uv = T/Z */
+typedef struct gost_ec_epoint {
+    gost_limb X[GOST_EC_MAX_LIMBS];
+    gost_limb Y[GOST_EC_MAX_LIMBS];
+    gost_limb Z[GOST_EC_MAX_LIMBS];
+    gost_limb T[GOST_EC_MAX_LIMBS];
+} GOST_EC_EPOINT;
+
+/*
+ * Short Weierstrass curve y^2 = x^3 + ax + b over GF(p). Curves with
+ * an equivalent twisted Edwards form u^2 + v^2 = 1 + du^2v^2 do their
+ * arithmetic there, x = s(1 + v)/(1 - v) + t, y = s(1 + v)/((1 - v)u).
+ */
+typedef struct gost_ec_curve {
+    int nid;
+    int a_is_minus3;
+    int edwards;
+    GOST_EC_MOD p;
+    GOST_EC_MOD q;                       /* group order, Montgomery form */
+    gost_limb a[GOST_EC_MAX_LIMBS];
+    gost_limb b[GOST_EC_MAX_LIMBS];
+    GOST_EC_POINT G;
+    gost_limb d[GOST_EC_MAX_LIMBS];
+    gost_limb s[GOST_EC_MAX_LIMBS];
+    gost_limb t[GOST_EC_MAX_LIMBS];
+    GOST_EC_EPOINT EG;
+    const gost_limb *comb;               /* fixed-base table, or NULL */
+} GOST_EC_CURVE;
+
+/*
+ * Fixed-base table layout: the scalar is recoded into signed 4-bit
+ * digits, digit i goes to row i / GOST_EC_COMB_SPACING, and each row
+ * holds 1..8 times 2^(4 * GOST_EC_COMB_SPACING * row) * G in affine
+ * internal form, (x, y) or (u, v, duv) for Edwards curves.
+ */
+# define GOST_EC_COMB_SPACING 4
+# define GOST_EC_COMB_ENTRIES 8
+
+int gost_ec_curve_init(GOST_EC_CURVE *curve, const R3410_ec_params *params);
+size_t gost_ec_curve_size(const GOST_EC_CURVE *curve);
+void gost_ec_curve_sign_scalar(const GOST_EC_CURVE *curve, unsigned char *s,
+                               const unsigned char *d, const unsigned char *k,
+                               const unsigned char *r, const unsigned char *e);
+void gost_ec_curve_verify_scalars(const GOST_EC_CURVE *curve,
+                                  unsigned char *z1, unsigned char *z2,
+                                  const unsigned char *r,
+                                  const unsigned char *s,
+                                  const unsigned char *e);
+int gost_ec_curve_mul(const GOST_EC_CURVE *curve,
+                      unsigned char *x, unsigned char *y,
+                      const unsigned char *n,
+                      const unsigned char *qx, const unsigned char *qy,
+                      const unsigned char *m);
+size_t gost_ec_curve_comb_size(const GOST_EC_CURVE *curve);
+void gost_ec_curve_comb(const GOST_EC_CURVE *curve, gost_limb *out);
+int gost_ec_curve_comb_point(const GOST_EC_CURVE *curve, gost_limb *out,
+                             const unsigned char *qx,
+                             const unsigned char *qy);
+int gost_ec_curve_mul_comb(const GOST_EC_CURVE *curve,
+                           unsigned char *x, unsigned char *y,
+                           const unsigned char *n, const gost_limb *qcomb,
+                           const unsigned char *m);
+int gost_ec_curve_mul_batch(const GOST_EC_CURVE *curve, size_t count,
+                            unsigned char *x, unsigned char *y,
+                            const unsigned char *n,
+                            const unsigned char *qx, const unsigned char *qy,
+                            const gost_limb *const *qcomb,
+                            const unsigned char *m, int *ok);
+
+/* Tables generated at build time by tools/gen_ec_tables.c */
+const gost_limb *gost_ec_precomputed(int nid);
+
+#endif
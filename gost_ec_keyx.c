@@ -13,95 +13,113 @@
 #include <string.h>
 #include <openssl/objects.h>
 #include "gost89.h"
+#include "gosthash.h"
+#include "gosthash2012.h"
 #include "e_gost_err.h"
 #include "gost_keywrap.h"
 #include "gost_lcl.h"
 
-/* Implementation of CryptoPro VKO 34.10-2001/2012 algorithm */
+/*
+ * Hashes the VKO point with the digest given by nid, calling the
+ * implementations directly. Returns the digest size, 0 for other digests.
+ */
+static int vko_hash(int nid, const unsigned char *in, size_t len,
+                    unsigned char *out)
+{
+    switch (nid) {
+    case NID_id_GostR3411_94:
+        {
+            gost_hash_ctx hctx;
+            gost_ctx cctx;
+
+            memset(&hctx, 0, sizeof(hctx));
+            gost_init(&cctx, &GostR3411_94_CryptoProParamSet);
+            hctx.cipher_ctx = &cctx;
+            start_hash(&hctx);
+            hash_block(&hctx, in, len);
+            finish_hash(&hctx, out);
+            gost_destroy(&cctx);
+            OPENSSL_cleanse(&hctx, sizeof(hctx));
+            return 32;
+        }
+    case NID_id_GostR3411_2012_256:
+    case NID_id_GostR3411_2012_512:
+        {
+            gost2012_hash_ctx hctx;
+            unsigned int size = nid == NID_id_GostR3411_2012_256 ? 256 : 512;
+
+            init_gost2012_hash_ctx(&hctx, size);
+            gost2012_hash_block(&hctx, in, len);
+            gost2012_finish_hash(&hctx, out);
+            OPENSSL_cleanse(&hctx, sizeof(hctx));
+            return size / 8;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Implementation of CryptoPro VKO 34.10-2001/2012 algorithm. The scalar
+ * ukm * cofactor * key is reduced mod q once, the point comes little-endian
+ * x then y straight into the buffer which is hashed.
+ */
 int VKO_compute_key(unsigned char *shared_key,
                     const EC_POINT *pub_key, const EC_KEY *priv_key,
                     const unsigned char *ukm, const size_t ukm_size,
                     const int vko_dgst_nid)
 {
-    unsigned char *databuf = NULL;
-    BIGNUM *UKM = NULL, *p = NULL, *order = NULL, *X = NULL, *Y = NULL, *cofactor = NULL;
+    unsigned char databuf[128];
+    const EC_GROUP *group = EC_KEY_get0_group(priv_key);
     const BIGNUM *key = EC_KEY_get0_private_key(priv_key);
-    EC_POINT *pnt = EC_POINT_new(EC_KEY_get0_group(priv_key));
-    BN_CTX *ctx = BN_CTX_new();
-    EVP_MD_CTX *mdctx = NULL;
-    const EVP_MD *md = NULL;
-    int buf_len, half_len;
+    const BIGNUM *order, *cofactor;
+    BIGNUM *UKM = NULL, *p = NULL;
+    BN_CTX *ctx;
+    int half_len;
     int ret = 0;
 
-    if (!ctx) {
+    if (!group || !key || !(order = EC_GROUP_get0_order(group))
+        || !(cofactor = EC_GROUP_get0_cofactor(group))) {
+        GOSTerr(GOST_F_VKO_COMPUTE_KEY, ERR_R_INTERNAL_ERROR);
+        return 0;
+    }
+    half_len = BN_num_bytes(order);
+    if (2 * half_len > (int)sizeof(databuf)) {
+        GOSTerr(GOST_F_VKO_COMPUTE_KEY, ERR_R_INTERNAL_ERROR);
+        return 0;
+    }
+    if (!(ctx = gost_bn_ctx_secret())) {
         GOSTerr(GOST_F_VKO_COMPUTE_KEY, ERR_R_MALLOC_FAILURE);
         return 0;
     }
     BN_CTX_start(ctx);
 
-    md = EVP_get_digestbynid(vko_dgst_nid);
-    if (!md) {
-        GOSTerr(GOST_F_VKO_COMPUTE_KEY, GOST_R_INVALID_DIGEST_TYPE);
-        goto err;
-    }
-
-    UKM = hashsum2bn(ukm, ukm_size);
+    UKM = BN_CTX_get(ctx);
     p = BN_CTX_get(ctx);
-    order = BN_CTX_get(ctx);
-		cofactor = BN_CTX_get(ctx);
-    X = BN_CTX_get(ctx);
-    Y = BN_CTX_get(ctx);
-    EC_GROUP_get_order(EC_KEY_get0_group(priv_key), order, ctx);
-		EC_GROUP_get_cofactor(EC_KEY_get0_group(priv_key), cofactor, ctx);
-    BN_mod_mul(UKM, UKM, cofactor, order, ctx);
-    BN_mod_mul(p, key, UKM, order, ctx);
-    if (!EC_POINT_mul(EC_KEY_get0_group(priv_key), pnt, NULL, pub_key, p, ctx)) {
-        GOSTerr(GOST_F_VKO_COMPUTE_KEY, GOST_R_ERROR_POINT_MUL);
+    if (!p || !BN_lebin2bn(ukm, ukm_size, UKM)) {
+        GOSTerr(GOST_F_VKO_COMPUTE_KEY, ERR_R_MALLOC_FAILURE);
         goto err;
     }
-    if (!EC_POINT_get_affine_coordinates(EC_KEY_get0_group(priv_key),
-                                        pnt, X, Y, ctx)) {
-	GOSTerr(GOST_F_VKO_COMPUTE_KEY, ERR_R_EC_LIB);
-	goto err;
-    }
-
-    half_len = BN_num_bytes(order);
-    buf_len = 2 * half_len;
-    databuf = OPENSSL_zalloc(buf_len);
-    if (!databuf) {
-        GOSTerr(GOST_F_VKO_COMPUTE_KEY, ERR_R_MALLOC_FAILURE);
+    if (!BN_mod_mul(UKM, UKM, cofactor, order, ctx)
+        || !BN_mod_mul(p, key, UKM, order, ctx)) {
+        GOSTerr(GOST_F_VKO_COMPUTE_KEY, ERR_R_BN_LIB);
         goto err;
     }
-
-    /*
-     * Serialize elliptic curve point same way as we do it when saving key
-     */
-    store_bignum(Y, databuf, half_len);
-    store_bignum(X, databuf + half_len, half_len);
-    /* And reverse byte order of whole buffer */
-    BUF_reverse(databuf, NULL, buf_len);
-
-    mdctx = EVP_MD_CTX_new();
-    if (!mdctx) {
-        GOSTerr(GOST_F_VKO_COMPUTE_KEY, ERR_R_MALLOC_FAILURE);
+    if (!gost_ec_point_mul_le(group, databuf, half_len, pub_key, p, ctx)) {
+        GOSTerr(GOST_F_VKO_COMPUTE_KEY, GOST_R_ERROR_POINT_MUL);
         goto err;
     }
-    EVP_MD_CTX_init(mdctx);
-    EVP_DigestInit_ex(mdctx, md, NULL);
-    EVP_DigestUpdate(mdctx, databuf, buf_len);
-    EVP_DigestFinal_ex(mdctx, shared_key, NULL);
-    ret = (EVP_MD_size(md) > 0) ? EVP_MD_size(md) : 0;
+
+    ret = vko_hash(vko_dgst_nid, databuf, 2 * half_len, shared_key);
+    if (!ret)
+        GOSTerr(GOST_F_VKO_COMPUTE_KEY, GOST_R_INVALID_DIGEST_TYPE);
 
  err:
-    BN_free(UKM);
+    if (p)
+        BN_clear(p);
     BN_CTX_end(ctx);
-    BN_CTX_free(ctx);
-
-    EC_POINT_free(pnt);
+    gost_bn_ctx_put(ctx);
 
-    EVP_MD_CTX_free(mdctx);
-
-    OPENSSL_free(databuf);
+    OPENSSL_cleanse(databuf, sizeof(databuf));
 
     return ret;
 }
@@ -202,7 +220,7 @@ int pkey_gost_ec_derive(EVP_PKEY_CTX *ctx, unsigned char *key, size_t *keylen)
 
             *keylen =
                 VKO_compute_key(key,
-                                EC_KEY_get0_public_key(EVP_PKEY_get0(peer_key)),
+                                gost_ec_get0_public_key(EVP_PKEY_get0(peer_key)),
                                 (EC_KEY *)EVP_PKEY_get0(my_key),
                                 data->shared_ukm, 8, dgst_nid);
             return (*keylen) ? 1 : 0;
@@ -216,7 +234,7 @@ int pkey_gost_ec_derive(EVP_PKEY_CTX *ctx, unsigned char *key, size_t *keylen)
             }
 
             *keylen = gost_keg(data->shared_ukm, EVP_PKEY_id(my_key),
-                               EC_KEY_get0_public_key(EVP_PKEY_get0(peer_key)),
+                               gost_ec_get0_public_key(EVP_PKEY_get0(peer_key)),
                                (EC_KEY *)EVP_PKEY_get0(my_key), key);
             return (*keylen) ? 1 : 0;
         }
@@ -273,13 +291,16 @@ static int pkey_GOST_ECcp_encrypt(EVP_PKEY_CTX *pctx, unsigned char *out,
                     GOST_R_NO_PRIVATE_PART_OF_NON_EPHEMERAL_KEYPAIR);
             goto err;
         }
+    } else if (data->eph_key) {
+        key_is_ephemeral = 1;
+        sec_key = data->eph_key;
     } else {
         key_is_ephemeral = 1;
         if (out) {
             sec_key = EVP_PKEY_new();
             if (!EVP_PKEY_assign(sec_key, EVP_PKEY_base_id(pubk), EC_KEY_new())
                 || !EVP_PKEY_copy_parameters(sec_key, pubk)
-                || !gost_ec_keygen(EVP_PKEY_get0(sec_key))) {
+                || !gost_ec_keygen_ephemeral(EVP_PKEY_get0(sec_key))) {
                 GOSTerr(GOST_F_PKEY_GOST_ECCP_ENCRYPT,
                         GOST_R_ERROR_COMPUTING_SHARED_KEY);
                 goto err;
@@ -293,7 +314,7 @@ static int pkey_GOST_ECcp_encrypt(EVP_PKEY_CTX *pctx, unsigned char *out,
             dgst_nid = NID_id_GostR3411_2012_256;
 
         if (!VKO_compute_key(shared_key,
-                             EC_KEY_get0_public_key(EVP_PKEY_get0(pubk)),
+                             gost_ec_get0_public_key(EVP_PKEY_get0(pubk)),
                              EVP_PKEY_get0(sec_key), ukm, 8, dgst_nid)) {
             GOSTerr(GOST_F_PKEY_GOST_ECCP_ENCRYPT,
                     GOST_R_ERROR_COMPUTING_SHARED_KEY);
@@ -326,7 +347,7 @@ static int pkey_GOST_ECcp_encrypt(EVP_PKEY_CTX *pctx, unsigned char *out,
     }
     ASN1_OBJECT_free(gkt->key_agreement_info->cipher);
     gkt->key_agreement_info->cipher = OBJ_nid2obj(param->nid);
-    if (key_is_ephemeral)
+    if (key_is_ephemeral && sec_key != data->eph_key)
         EVP_PKEY_free(sec_key);
     if (!key_is_ephemeral) {
         /* Set control "public key from client certificate used" */
@@ -341,7 +362,7 @@ static int pkey_GOST_ECcp_encrypt(EVP_PKEY_CTX *pctx, unsigned char *out,
     GOST_KEY_TRANSPORT_free(gkt);
     return ret;
  err:
-    if (key_is_ephemeral)
+    if (key_is_ephemeral && sec_key != data->eph_key)
         EVP_PKEY_free(sec_key);
     GOST_KEY_TRANSPORT_free(gkt);
     return -1;
@@ -392,6 +413,8 @@ static int pkey_gost2018_encrypt(EVP_PKEY_CTX *pctx, unsigned char *out,
     }
 
     sec_key = EVP_PKEY_CTX_get0_peerkey(pctx);
+    if (!sec_key)
+        sec_key = data->eph_key;
     if (!sec_key)
     {
       sec_key = EVP_PKEY_new();
@@ -402,7 +425,7 @@ static int pkey_gost2018_encrypt(EVP_PKEY_CTX *pctx, unsigned char *out,
 
       if (!EVP_PKEY_assign(sec_key, EVP_PKEY_base_id(pubk), EC_KEY_new())
           || !EVP_PKEY_copy_parameters(sec_key, pubk)
-          || !gost_ec_keygen(EVP_PKEY_get0(sec_key))) {
+          || !gost_ec_keygen_ephemeral(EVP_PKEY_get0(sec_key))) {
         GOSTerr(GOST_F_PKEY_GOST2018_ENCRYPT,
             GOST_R_ERROR_COMPUTING_SHARED_KEY);
         goto err;
@@ -411,7 +434,7 @@ static int pkey_gost2018_encrypt(EVP_PKEY_CTX *pctx, unsigned char *out,
     }
 
     if (gost_keg(data->shared_ukm, pkey_nid,
-                 EC_KEY_get0_public_key(EVP_PKEY_get0(pubk)),
+                 gost_ec_get0_public_key(EVP_PKEY_get0(pubk)),
                  EVP_PKEY_get0(sec_key), expkeys) <= 0) {
         GOSTerr(GOST_F_PKEY_GOST2018_ENCRYPT,
                 GOST_R_ERROR_COMPUTING_EXPORT_KEYS);
@@ -456,14 +479,30 @@ int pkey_gost_encrypt(EVP_PKEY_CTX *pctx, unsigned char *out,
                       size_t *out_len, const unsigned char *key, size_t key_len)
 {
     struct gost_pmeth_data *data = EVP_PKEY_CTX_get_data(pctx);
+    /*
+     * A shared ephemeral key with an application UKM gives the same export
+     * keys on every call, so each message needs a new UKM
+     */
+    int check_ukm = out != NULL && data->eph_key != NULL
+        && data->shared_ukm != NULL
+        && EVP_PKEY_CTX_get0_peerkey(pctx) == NULL;
+    int ret;
+
+    if (check_ukm && data->ukm_used) {
+        GOSTerr(GOST_F_PKEY_GOST_ENCRYPT, GOST_R_UKM_REUSED);
+        return -1;
+    }
     if (data->shared_ukm == NULL || data->shared_ukm_size == 8)
-        return pkey_GOST_ECcp_encrypt(pctx, out, out_len, key, key_len);
+        ret = pkey_GOST_ECcp_encrypt(pctx, out, out_len, key, key_len);
     else if (data->shared_ukm_size == 32)
-        return pkey_gost2018_encrypt(pctx, out, out_len, key, key_len);
+        ret = pkey_gost2018_encrypt(pctx, out, out_len, key, key_len);
     else {
         GOSTerr(GOST_F_PKEY_GOST_ENCRYPT, ERR_R_INTERNAL_ERROR);
         return -1;
     }
+    if (check_ukm && ret > 0)
+        data->ukm_used = 1;
+    return ret;
 }
 
 /*
@@ -536,7 +575,7 @@ static int pkey_GOST_ECcp_decrypt(EVP_PKEY_CTX *pctx, unsigned char *key,
         dgst_nid = NID_id_GostR3411_2012_256;
 
     if (!VKO_compute_key(sharedKey,
-                         EC_KEY_get0_public_key(EVP_PKEY_get0(peerkey)),
+                         gost_ec_get0_public_key(EVP_PKEY_get0(peerkey)),
                          EVP_PKEY_get0(priv), wrappedKey, 8, dgst_nid)) {
         GOSTerr(GOST_F_PKEY_GOST_ECCP_DECRYPT,
                 GOST_R_ERROR_COMPUTING_SHARED_KEY);
@@ -613,7 +652,7 @@ static int pkey_gost2018_decrypt(EVP_PKEY_CTX *pctx, unsigned char *key,
    o  q * Q_eph is not equal to zero point.
 */
     if (gost_keg(data->shared_ukm, pkey_nid,
-                 EC_KEY_get0_public_key(EVP_PKEY_get0(eph_key)),
+                 gost_ec_get0_public_key(EVP_PKEY_get0(eph_key)),
                  EVP_PKEY_get0(priv), expkeys) <= 0) {
         GOSTerr(GOST_F_PKEY_GOST2018_DECRYPT,
                 GOST_R_ERROR_COMPUTING_EXPORT_KEYS);
@@ -11,7 +11,13 @@
 #include <openssl/rand.h>
 #include <openssl/ecdsa.h>
 #include <openssl/err.h>
+#include <openssl/buffer.h>
 #include "e_gost_err.h"
+#include "gost_ec_arith.h"
+#include "gosthash2012.h"
+#ifndef _WIN32
+# include <unistd.h>
+#endif
 #ifdef DEBUG_SIGN
 extern
 void dump_signature(const char *message, const unsigned char *buffer,
@@ -38,6 +44,144 @@ BIGNUM *hashsum2bn(const unsigned char *dgst, int len)
     return BN_bin2bn(buf, len, NULL);
 }
 
+/*
+ * Per-thread BN_CTX. BN_CTX keeps the BIGNUMs it has handed out between
+ * BN_CTX_start/BN_CTX_end frames, so reusing one per thread leaves the
+ * verification paths without heap traffic in steady state. Temporaries
+ * of OpenSSL routines stay in the context after the call, so it must
+ * never see a private value, see gost_bn_ctx_secret().
+ */
+typedef struct gost_bn_ctx_entry {
+    BN_CTX *ctx;
+    struct gost_bn_ctx_entry *prev, *next;
+} GOST_BN_CTX_ENTRY;
+
+/*
+ * Contexts of all threads are also listed, so that engine destruction
+ * frees the contexts of threads still running.
+ */
+static CRYPTO_THREAD_LOCAL gost_bn_ctx_key;
+static int gost_bn_ctx_key_ok = 0;
+static GOST_BN_CTX_ENTRY *gost_bn_ctx_list = NULL;
+static CRYPTO_RWLOCK *gost_bn_ctx_lock = NULL;
+static CRYPTO_ONCE gost_bn_ctx_once = CRYPTO_ONCE_STATIC_INIT;
+
+static void gost_bn_ctx_unlink(GOST_BN_CTX_ENTRY *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        gost_bn_ctx_list = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+}
+
+/* Called on thread exit */
+static void gost_bn_ctx_cleanup(void *arg)
+{
+    GOST_BN_CTX_ENTRY *e = arg;
+
+    if (e == NULL || !CRYPTO_THREAD_write_lock(gost_bn_ctx_lock))
+        return;
+    /* Already freed by gost_bn_ctx_free() */
+    if (!gost_bn_ctx_key_ok) {
+        CRYPTO_THREAD_unlock(gost_bn_ctx_lock);
+        return;
+    }
+    gost_bn_ctx_unlink(e);
+    CRYPTO_THREAD_unlock(gost_bn_ctx_lock);
+    BN_CTX_free(e->ctx);
+    OPENSSL_free(e);
+}
+
+static void gost_bn_ctx_init(void)
+{
+    if ((gost_bn_ctx_lock = CRYPTO_THREAD_lock_new()) == NULL)
+        return;
+    gost_bn_ctx_key_ok = CRYPTO_THREAD_init_local(&gost_bn_ctx_key,
+                                                  gost_bn_ctx_cleanup);
+}
+
+/*
+ * Returns the BN_CTX of the calling thread, or a new one if there is
+ * none available. The result is given back with gost_bn_ctx_put().
+ */
+BN_CTX *gost_bn_ctx_get(void)
+{
+    GOST_BN_CTX_ENTRY *e;
+
+    if (!CRYPTO_THREAD_run_once(&gost_bn_ctx_once, gost_bn_ctx_init)
+        || !gost_bn_ctx_key_ok)
+        return BN_CTX_new();
+    if ((e = CRYPTO_THREAD_get_local(&gost_bn_ctx_key)) != NULL)
+        return e->ctx;
+    if ((e = OPENSSL_zalloc(sizeof(*e))) == NULL
+        || (e->ctx = BN_CTX_new()) == NULL)
+        goto err;
+    if (!CRYPTO_THREAD_write_lock(gost_bn_ctx_lock))
+        goto err;
+    if (!CRYPTO_THREAD_set_local(&gost_bn_ctx_key, e)) {
+        CRYPTO_THREAD_unlock(gost_bn_ctx_lock);
+        goto err;
+    }
+    e->next = gost_bn_ctx_list;
+    if (e->next)
+        e->next->prev = e;
+    gost_bn_ctx_list = e;
+    CRYPTO_THREAD_unlock(gost_bn_ctx_lock);
+    return e->ctx;
+ err:
+    if (e != NULL)
+        BN_CTX_free(e->ctx);
+    OPENSSL_free(e);
+    return BN_CTX_new();
+}
+
+/*
+ * Returns a new context for operations on private keys and nonces, which
+ * gost_bn_ctx_put() frees, clearing every BIGNUM it has handed out
+ */
+BN_CTX *gost_bn_ctx_secret(void)
+{
+    return BN_CTX_secure_new();
+}
+
+void gost_bn_ctx_put(BN_CTX *ctx)
+{
+    GOST_BN_CTX_ENTRY *e = NULL;
+
+    if (ctx == NULL)
+        return;
+    if (CRYPTO_THREAD_run_once(&gost_bn_ctx_once, gost_bn_ctx_init)
+        && gost_bn_ctx_key_ok)
+        e = CRYPTO_THREAD_get_local(&gost_bn_ctx_key);
+    if (e == NULL || e->ctx != ctx)
+        BN_CTX_free(ctx);
+}
+
+/*
+ * Frees the contexts of all threads and the thread local key, called on
+ * engine destruction: the key destructor lives in the engine module, which
+ * can be unloaded afterwards. Every operation gets a fresh context then,
+ * the lock is kept.
+ */
+void gost_bn_ctx_free(void)
+{
+    GOST_BN_CTX_ENTRY *e;
+
+    if (!gost_bn_ctx_key_ok || !CRYPTO_THREAD_write_lock(gost_bn_ctx_lock))
+        return;
+    gost_bn_ctx_key_ok = 0;
+    while ((e = gost_bn_ctx_list) != NULL) {
+        gost_bn_ctx_list = e->next;
+        BN_CTX_free(e->ctx);
+        OPENSSL_free(e);
+    }
+    CRYPTO_THREAD_set_local(&gost_bn_ctx_key, NULL);
+    CRYPTO_THREAD_cleanup_local(&gost_bn_ctx_key);
+    CRYPTO_THREAD_unlock(gost_bn_ctx_lock);
+}
+
 static R3410_ec_params *gost_nid2params(int nid)
 {
     R3410_ec_params *params;
@@ -74,14 +218,10 @@ static R3410_ec_params *gost_nid2params(int nid)
 }
 
 /*
- * Fills EC_KEY structure hidden in the app_data field of DSA structure
- * with parameter information, extracted from parameter array in
- * params.c file.
- *
- * Also fils DSA->q field with copy of EC_GROUP order field to make
- * DSA_size function work
+ * Builds EC_GROUP for the parameter set from its description in params.c
+ * file, with the multiples of the generator precomputed.
  */
-int fill_GOST_EC_params(EC_KEY *eckey, int nid)
+static EC_GROUP *gost_ec_group_new(int nid)
 {
     R3410_ec_params *params = gost_nid2params(nid);
     EC_GROUP *grp = NULL;
@@ -91,14 +231,14 @@ int fill_GOST_EC_params(EC_KEY *eckey, int nid)
     BN_CTX *ctx;
     int ok = 0;
 
-    if (!eckey || !params) {
+    if (!params) {
         GOSTerr(GOST_F_FILL_GOST_EC_PARAMS, GOST_R_UNSUPPORTED_PARAMETER_SET);
-        return 0;
+        return NULL;
     }
 
     if (!(ctx = BN_CTX_new())) {
         GOSTerr(GOST_F_FILL_GOST_EC_PARAMS, ERR_R_MALLOC_FAILURE);
-        return 0;
+        return NULL;
     }
 
     BN_CTX_start(ctx);
@@ -147,198 +287,1777 @@ int fill_GOST_EC_params(EC_KEY *eckey, int nid)
         goto end;
     }
     EC_GROUP_set_curve_name(grp, nid);
-    if (!EC_KEY_set_group(eckey, grp)) {
-        GOSTerr(GOST_F_FILL_GOST_EC_PARAMS, ERR_R_INTERNAL_ERROR);
+    if (!EC_GROUP_precompute_mult(grp, ctx)) {
+        GOSTerr(GOST_F_FILL_GOST_EC_PARAMS, ERR_R_EC_LIB);
         goto end;
     }
     ok = 1;
  end:
     if (P)
         EC_POINT_free(P);
-    if (grp)
+    if (!ok && grp) {
         EC_GROUP_free(grp);
+        grp = NULL;
+    }
     BN_CTX_end(ctx);
     BN_CTX_free(ctx);
-    return ok;
+    return grp;
 }
 
+#define GOST_EC_GROUPS_MAX 16
+
 /*
- * Computes gost_ec signature as ECDSA_SIG structure
+ * Groups built so far, one per parameter set nid. They are never
+ * modified once here, so keys get copies of them which share the
+ * precomputed multiples of the generator.
+ */
+static struct {
+    int nid;
+    EC_GROUP *group;
+} gost_ec_groups[GOST_EC_GROUPS_MAX];
+static CRYPTO_RWLOCK *gost_ec_groups_lock = NULL;
+static CRYPTO_ONCE gost_ec_groups_once = CRYPTO_ONCE_STATIC_INIT;
+
+static void gost_ec_groups_init(void)
+{
+    gost_ec_groups_lock = CRYPTO_THREAD_lock_new();
+}
+
+/*
+ * Returns the cached group for nid, building it on first use. The
+ * result must not be freed. Sets *owned and returns a new group if the
+ * cache is not available.
+ */
+static EC_GROUP *gost_ec_group_get(int nid, int *owned)
+{
+    EC_GROUP *grp = NULL;
+    size_t i;
+
+    *owned = 0;
+    if (!CRYPTO_THREAD_run_once(&gost_ec_groups_once, gost_ec_groups_init)
+        || gost_ec_groups_lock == NULL
+        || !CRYPTO_THREAD_read_lock(gost_ec_groups_lock))
+        goto uncached;
+    for (i = 0; i < GOST_EC_GROUPS_MAX && gost_ec_groups[i].group; i++) {
+        if (gost_ec_groups[i].nid == nid) {
+            grp = gost_ec_groups[i].group;
+            break;
+        }
+    }
+    CRYPTO_THREAD_unlock(gost_ec_groups_lock);
+    if (grp)
+        return grp;
+
+    if (!(grp = gost_ec_group_new(nid)))
+        return NULL;
+    if (!CRYPTO_THREAD_write_lock(gost_ec_groups_lock)) {
+        *owned = 1;
+        return grp;
+    }
+    for (i = 0; i < GOST_EC_GROUPS_MAX && gost_ec_groups[i].group; i++) {
+        if (gost_ec_groups[i].nid == nid)
+            break;
+    }
+    if (i == GOST_EC_GROUPS_MAX) {
+        *owned = 1;
+    } else if (gost_ec_groups[i].group) {
+        /* Another thread got there first */
+        EC_GROUP_free(grp);
+        grp = gost_ec_groups[i].group;
+    } else {
+        gost_ec_groups[i].nid = nid;
+        gost_ec_groups[i].group = grp;
+    }
+    CRYPTO_THREAD_unlock(gost_ec_groups_lock);
+    return grp;
+
+ uncached:
+    *owned = 1;
+    return gost_ec_group_new(nid);
+}
+
+/*
+ * Frees the cached groups, called on engine destruction. The lock stays
+ * for the life of the process as its CRYPTO_ONCE can not run again when
+ * the engine is bound anew.
+ */
+void gost_ec_groups_free(void)
+{
+    size_t i;
+
+    if (gost_ec_groups_lock == NULL)
+        return;
+    CRYPTO_THREAD_write_lock(gost_ec_groups_lock);
+    for (i = 0; i < GOST_EC_GROUPS_MAX; i++) {
+        EC_GROUP_free(gost_ec_groups[i].group);
+        gost_ec_groups[i].group = NULL;
+    }
+    CRYPTO_THREAD_unlock(gost_ec_groups_lock);
+}
+
+/*
+ * Fills EC_KEY structure hidden in the app_data field of DSA structure
+ * with parameter information, extracted from parameter array in
+ * params.c file.
  *
+ * Also fils DSA->q field with copy of EC_GROUP order field to make
+ * DSA_size function work
  */
-ECDSA_SIG *gost_ec_sign(const unsigned char *dgst, int dlen, EC_KEY *eckey)
+int fill_GOST_EC_params(EC_KEY *eckey, int nid)
 {
-    ECDSA_SIG *newsig = NULL, *ret = NULL;
-    BIGNUM *md = NULL;
-    BIGNUM *order = NULL;
-    const EC_GROUP *group;
-    const BIGNUM *priv_key;
-    BIGNUM *r = NULL, *s = NULL, *X = NULL, *tmp = NULL, *tmp2 = NULL,
-        *k = NULL, *e = NULL;
+    EC_GROUP *grp;
+    int owned, ok = 0;
 
-    BIGNUM *new_r = NULL, *new_s = NULL;
+    if (!eckey) {
+        GOSTerr(GOST_F_FILL_GOST_EC_PARAMS, GOST_R_UNSUPPORTED_PARAMETER_SET);
+        return 0;
+    }
+    if (!(grp = gost_ec_group_get(nid, &owned)))
+        return 0;
 
-    EC_POINT *C = NULL;
-    BN_CTX *ctx;
+    if (!EC_KEY_set_group(eckey, grp)) {
+        GOSTerr(GOST_F_FILL_GOST_EC_PARAMS, ERR_R_INTERNAL_ERROR);
+        goto end;
+    }
+    ok = 1;
+ end:
+    if (owned)
+        EC_GROUP_free(grp);
+    return ok;
+}
 
-    OPENSSL_assert(dgst != NULL && eckey != NULL);
+#define GOST_EC_CURVES_MAX 16
 
-    if (!(ctx = BN_CTX_new())) {
-        GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_MALLOC_FAILURE);
+/* Dedicated arithmetic for every parameter set it supports */
+static GOST_EC_CURVE gost_ec_curves[GOST_EC_CURVES_MAX];
+static const R3410_ec_params *gost_ec_curves_params[GOST_EC_CURVES_MAX];
+static CRYPTO_ONCE gost_ec_curves_once = CRYPTO_ONCE_STATIC_INIT;
+
+static void gost_ec_curves_init(void)
+{
+    R3410_ec_params *tables[] = { R3410_2001_paramset,
+        R3410_2012_512_paramset
+    };
+    R3410_ec_params *params;
+    size_t i, n = 0;
+
+    for (i = 0; i < sizeof(tables) / sizeof(tables[0]); i++) {
+        for (params = tables[i]; params->nid != NID_undef; params++) {
+            if (n < GOST_EC_CURVES_MAX
+                && gost_ec_curve_init(&gost_ec_curves[n], params))
+                gost_ec_curves_params[n++] = params;
+        }
+    }
+}
+
+static const GOST_EC_CURVE *gost_ec_curve(const EC_GROUP *group)
+{
+    const R3410_ec_params *params =
+        gost_nid2params(EC_GROUP_get_curve_name(group));
+    size_t i;
+
+    if (params == NULL
+        || !CRYPTO_THREAD_run_once(&gost_ec_curves_once, gost_ec_curves_init))
         return NULL;
+
+    for (i = 0; i < GOST_EC_CURVES_MAX; i++) {
+        if (gost_ec_curves_params[i] == params)
+            return &gost_ec_curves[i];
     }
+    return NULL;
+}
 
-    BN_CTX_start(ctx);
-    OPENSSL_assert(dlen == 32 || dlen == 64);
-    md = hashsum2bn(dgst, dlen);
-    newsig = ECDSA_SIG_new();
-    if (!newsig || !md) {
-        GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_MALLOC_FAILURE);
-        goto err;
+/*
+ * Cache of comb tables for public keys signatures are verified against.
+ * A key gets its table the second time it is seen, so one-off keys only
+ * cost a list entry. Entries are chained into a hash table by the first
+ * bytes of Q and looked up under a read lock, eviction gives entries used
+ * since they were last passed another round.
+ */
+typedef struct gost_ec_vcache_entry {
+    struct gost_ec_vcache_entry *prev, *next, *hnext;
+    const GOST_EC_CURVE *curve;
+    unsigned char q[2 * 8 * GOST_EC_MAX_LIMBS];
+    gost_limb *comb;
+    int building;
+    int used;
+    int refs;                   /* list itself and users of comb */
+} GOST_EC_VCACHE_ENTRY;
+
+static struct {
+    GOST_EC_VCACHE_ENTRY *head, *tail;
+    GOST_EC_VCACHE_ENTRY **table;
+    size_t mask;                /* table size - 1, a power of two minus 1 */
+    long size, max;             /* max < 0 until read from engine param */
+    int hits, misses;
+    CRYPTO_RWLOCK *lock;
+    CRYPTO_RWLOCK *count_lock;  /* for CRYPTO_atomic_add without atomics */
+} gost_ec_vcache = { NULL, NULL, NULL, 0, 0, -1, 0, 0, NULL, NULL };
+static CRYPTO_ONCE gost_ec_vcache_once = CRYPTO_ONCE_STATIC_INIT;
+
+static void gost_ec_vcache_init(void)
+{
+    gost_ec_vcache.lock = CRYPTO_THREAD_lock_new();
+    gost_ec_vcache.count_lock = CRYPTO_THREAD_lock_new();
+}
+
+static int vcache_add(int *counter, int amount)
+{
+    int ret = 0;
+
+    CRYPTO_atomic_add(counter, amount, &ret, gost_ec_vcache.count_lock);
+    return ret;
+}
+
+static void vcache_unref(GOST_EC_VCACHE_ENTRY *e)
+{
+    if (vcache_add(&e->refs, -1) == 0) {
+        OPENSSL_free(e->comb);
+        OPENSSL_free(e);
     }
-    group = EC_KEY_get0_group(eckey);
-    if (!group) {
-        GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_INTERNAL_ERROR);
-        goto err;
+}
+
+/* Q is a random point, so its low bytes serve as the hash */
+static GOST_EC_VCACHE_ENTRY **vcache_bucket(const unsigned char *qx)
+{
+    size_t h = 0;
+    int i;
+
+    for (i = 0; i < (int)sizeof(h); i++)
+        h = (h << 8) | qx[i];
+    return &gost_ec_vcache.table[h & gost_ec_vcache.mask];
+}
+
+static void vcache_unlink(GOST_EC_VCACHE_ENTRY *e)
+{
+    GOST_EC_VCACHE_ENTRY **b = vcache_bucket(e->q);
+
+    while (*b != e)
+        b = &(*b)->hnext;
+    *b = e->hnext;
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        gost_ec_vcache.head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        gost_ec_vcache.tail = e->prev;
+    e->prev = e->next = e->hnext = NULL;
+    gost_ec_vcache.size--;
+}
+
+static void vcache_push_front(GOST_EC_VCACHE_ENTRY *e)
+{
+    GOST_EC_VCACHE_ENTRY **b = vcache_bucket(e->q);
+
+    e->hnext = *b;
+    *b = e;
+    e->prev = NULL;
+    e->next = gost_ec_vcache.head;
+    if (e->next)
+        e->next->prev = e;
+    else
+        gost_ec_vcache.tail = e;
+    gost_ec_vcache.head = e;
+    gost_ec_vcache.size++;
+}
+
+/* Called with the write lock held, so no reader touches used meanwhile */
+static void vcache_trim(long max)
+{
+    while (gost_ec_vcache.size > max) {
+        GOST_EC_VCACHE_ENTRY *e = gost_ec_vcache.tail;
+
+        vcache_unlink(e);
+        if (e->used && max > 0) {
+            e->used = 0;
+            vcache_push_front(e);
+            continue;
+        }
+        vcache_unref(e);
     }
-    order = BN_CTX_get(ctx);
-    if (!order || !EC_GROUP_get_order(group, order, ctx)) {
-        GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_INTERNAL_ERROR);
-        goto err;
+}
+
+/*
+ * Keeps at most max keys and resizes the table to hold them, on
+ * allocation failure the cache is disabled
+ */
+static void vcache_resize(long max)
+{
+    GOST_EC_VCACHE_ENTRY **table = NULL, *e;
+    size_t n = 1;
+
+    vcache_trim(max);
+    if (max > 0) {
+        while (n < (size_t)max && n < ((size_t)1 << 20))
+            n <<= 1;
+        if ((table = OPENSSL_zalloc(n * sizeof(*table))) == NULL) {
+            vcache_trim(0);
+            max = 0;
+        }
     }
-    priv_key = EC_KEY_get0_private_key(eckey);
-    if (!priv_key) {
-        GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_INTERNAL_ERROR);
-        goto err;
+    OPENSSL_free(gost_ec_vcache.table);
+    gost_ec_vcache.table = table;
+    gost_ec_vcache.mask = n - 1;
+    gost_ec_vcache.max = max;
+    for (e = gost_ec_vcache.tail; e; e = e->prev) {
+        GOST_EC_VCACHE_ENTRY **b = vcache_bucket(e->q);
+
+        e->hnext = *b;
+        *b = e;
     }
-    e = BN_CTX_get(ctx);
-    if (!e || !BN_mod(e, md, order, ctx)) {
-        GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_INTERNAL_ERROR);
-        goto err;
+}
+
+static int vcache_write_lock(void)
+{
+    const char *max;
+
+    if (!CRYPTO_THREAD_run_once(&gost_ec_vcache_once, gost_ec_vcache_init)
+        || gost_ec_vcache.lock == NULL || gost_ec_vcache.count_lock == NULL
+        || !CRYPTO_THREAD_write_lock(gost_ec_vcache.lock))
+        return 0;
+    if (gost_ec_vcache.max < 0) {
+        max = get_gost_engine_param(GOST_PARAM_VERIFY_CACHE);
+        vcache_resize(max && atol(max) > 0 ? atol(max) : 0);
     }
-#ifdef DEBUG_SIGN
-    fprintf(stderr, "digest as bignum=");
-    BN_print_fp(stderr, md);
-    fprintf(stderr, "\ndigest mod q=");
-    BN_print_fp(stderr, e);
-    fprintf(stderr, "\n");
-#endif
-    if (BN_is_zero(e)) {
-        BN_one(e);
+    return 1;
+}
+
+/* Falls back to the write lock until the size is read from the param */
+static int vcache_read_lock(void)
+{
+    if (!CRYPTO_THREAD_run_once(&gost_ec_vcache_once, gost_ec_vcache_init)
+        || gost_ec_vcache.lock == NULL || gost_ec_vcache.count_lock == NULL
+        || !CRYPTO_THREAD_read_lock(gost_ec_vcache.lock))
+        return 0;
+    if (gost_ec_vcache.max >= 0)
+        return 1;
+    CRYPTO_THREAD_unlock(gost_ec_vcache.lock);
+    return vcache_write_lock();
+}
+
+/* Releases an entry returned by vcache_get(), no lock needed */
+static void vcache_put(GOST_EC_VCACHE_ENTRY *e)
+{
+    vcache_unref(e);
+}
+
+static GOST_EC_VCACHE_ENTRY *vcache_find(const GOST_EC_CURVE *curve,
+                                         const unsigned char *qx,
+                                         const unsigned char *qy)
+{
+    GOST_EC_VCACHE_ENTRY *e;
+    size_t len = gost_ec_curve_size(curve);
+
+    for (e = *vcache_bucket(qx); e; e = e->hnext) {
+        if (e->curve == curve && memcmp(e->q, qx, len) == 0
+            && memcmp(e->q + len, qy, len) == 0)
+            break;
     }
-    k = BN_CTX_get(ctx);
-    C = EC_POINT_new(group);
-    if (!k || !C) {
-        GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_MALLOC_FAILURE);
-        goto err;
+    return e;
+}
+
+/*
+ * Finds the table for Q given by little-endian coordinates, building it
+ * if Q was seen before. Returns a referenced entry with the table to be
+ * released with vcache_put(), or NULL.
+ */
+static GOST_EC_VCACHE_ENTRY *vcache_get(const GOST_EC_CURVE *curve,
+                                        const unsigned char *qx,
+                                        const unsigned char *qy)
+{
+    GOST_EC_VCACHE_ENTRY *e;
+    size_t len = gost_ec_curve_size(curve);
+    gost_limb *comb;
+
+    /* Tables already built only need the read lock */
+    if (!vcache_read_lock())
+        return NULL;
+    if (gost_ec_vcache.max == 0) {
+        CRYPTO_THREAD_unlock(gost_ec_vcache.lock);
+        return NULL;
+    }
+    e = vcache_find(curve, qx, qy);
+    if (e && e->comb) {
+        vcache_add(&e->refs, 1);
+        vcache_add(&e->used, 1);
+        vcache_add(&gost_ec_vcache.hits, 1);
+        CRYPTO_THREAD_unlock(gost_ec_vcache.lock);
+        return e;
     }
+    CRYPTO_THREAD_unlock(gost_ec_vcache.lock);
 
-    do {
-        do {
-            if (!BN_rand_range(k, order)) {
-                GOSTerr(GOST_F_GOST_EC_SIGN, GOST_R_RNG_ERROR);
-                goto err;
-            }
-            /*
-             * To avoid timing information leaking the length of k,
-             * compute C*k using an equivalent scalar of fixed bit-length */
-            if (!BN_add(k, k, order)
-                || (BN_num_bits(k) <= BN_num_bits(order)
-                    && !BN_add(k, k, order))) {
-                goto err;
-            }
-            if (!EC_POINT_mul(group, C, k, NULL, NULL, ctx)) {
-                GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_EC_LIB);
-                goto err;
-            }
-            if (!X)
-                X = BN_CTX_get(ctx);
-            if (!r)
-                r = BN_CTX_get(ctx);
-            if (!X || !r) {
-                GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_MALLOC_FAILURE);
-                goto err;
-            }
-            if (!EC_POINT_get_affine_coordinates(group, C, X, NULL, ctx)) {
-                GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_EC_LIB);
-                goto err;
-            }
+    if (!vcache_write_lock())
+        return NULL;
+    if (gost_ec_vcache.max == 0)
+        goto miss;
+    e = vcache_find(curve, qx, qy);
+    if (e == NULL) {
+        /* First sight, remember the key only */
+        if ((e = OPENSSL_zalloc(sizeof(*e))) == NULL)
+            goto miss;
+        e->curve = curve;
+        memcpy(e->q, qx, len);
+        memcpy(e->q + len, qy, len);
+        e->refs = 1;
+        vcache_trim(gost_ec_vcache.max - 1);
+        vcache_push_front(e);
+        goto miss;
+    }
+    /* References are dropped by vcache_put() without the lock */
+    e->used = 1;
+    if (e->comb) {
+        /* Built by another thread meanwhile */
+        vcache_add(&e->refs, 1);
+        vcache_add(&gost_ec_vcache.hits, 1);
+        CRYPTO_THREAD_unlock(gost_ec_vcache.lock);
+        return e;
+    }
+    if (e->building)
+        goto miss;
 
-            if (!BN_nnmod(r, X, order, ctx)) {
-                GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_INTERNAL_ERROR);
-                goto err;
-            }
-        }
-        while (BN_is_zero(r));
-        /* s =  (r*priv_key+k*e) mod order */
-        if (!tmp)
-            tmp = BN_CTX_get(ctx);
-        if (!tmp2)
-            tmp2 = BN_CTX_get(ctx);
-        if (!s)
-            s = BN_CTX_get(ctx);
-        if (!tmp || !tmp2 || !s) {
-            GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_MALLOC_FAILURE);
-            goto err;
+    /* Seen before, build the table outside of the lock */
+    e->building = 1;
+    vcache_add(&e->refs, 1);
+    vcache_add(&gost_ec_vcache.misses, 1);
+    CRYPTO_THREAD_unlock(gost_ec_vcache.lock);
+
+    comb = OPENSSL_malloc(gost_ec_curve_comb_size(curve) * sizeof(gost_limb));
+    if (comb && !gost_ec_curve_comb_point(curve, comb, qx, qy)) {
+        OPENSSL_free(comb);
+        comb = NULL;
+    }
+
+    CRYPTO_THREAD_write_lock(gost_ec_vcache.lock);
+    e->comb = comb;
+    e->building = 0;
+    CRYPTO_THREAD_unlock(gost_ec_vcache.lock);
+    if (comb == NULL) {
+        vcache_unref(e);
+        e = NULL;
+    }
+    return e;
+
+ miss:
+    vcache_add(&gost_ec_vcache.misses, 1);
+    CRYPTO_THREAD_unlock(gost_ec_vcache.lock);
+    return NULL;
+}
+
+/* Sets the number of keys to keep, 0 disables the cache */
+int gost_ec_verify_cache_set_size(long max)
+{
+    if (max < 0 || !vcache_write_lock())
+        return 0;
+    vcache_resize(max);
+    CRYPTO_THREAD_unlock(gost_ec_vcache.lock);
+    return gost_ec_vcache.max == max;
+}
+
+/* Fills stats with hits, misses and the number of keys in the cache */
+int gost_ec_verify_cache_stats(unsigned long *stats)
+{
+    if (stats == NULL || !vcache_write_lock())
+        return 0;
+    stats[0] = (unsigned int)gost_ec_vcache.hits;
+    stats[1] = (unsigned int)gost_ec_vcache.misses;
+    stats[2] = gost_ec_vcache.size;
+    CRYPTO_THREAD_unlock(gost_ec_vcache.lock);
+    return 1;
+}
+
+/*
+ * Empties the cache and clears its counters, called on engine destruction.
+ * The size is read from the engine param again on next use, the locks
+ * are kept.
+ */
+void gost_ec_verify_cache_free(void)
+{
+    if (gost_ec_vcache.lock == NULL)
+        return;
+    CRYPTO_THREAD_write_lock(gost_ec_vcache.lock);
+    vcache_resize(0);
+    gost_ec_vcache.max = -1;
+    gost_ec_vcache.hits = gost_ec_vcache.misses = 0;
+    CRYPTO_THREAD_unlock(gost_ec_vcache.lock);
+}
+
+/*
+ * Cache of successful verifications, keyed by Streebog-256 of the curve,
+ * public key, digest and signature. Entries are chained into a hash table
+ * by the first bytes of the key so repeated checks, such as of
+ * intermediate certificates along chains, are looked up in constant time
+ * under a read lock. Eviction gives entries used since they were last
+ * passed another round. Failed verifications are never stored.
+ */
+#define GOST_EC_VRESULT_KEY 32
+
+typedef struct gost_ec_vresult {
+    struct gost_ec_vresult *prev, *next, *hnext;
+    unsigned char key[GOST_EC_VRESULT_KEY];
+    int used;
+} GOST_EC_VRESULT;
+
+static struct {
+    GOST_EC_VRESULT *head, *tail;
+    GOST_EC_VRESULT **table;
+    size_t mask;                /* table size - 1, a power of two minus 1 */
+    long size, max;             /* max < 0 until read from engine param */
+    int hits, misses;
+    CRYPTO_RWLOCK *lock;
+    CRYPTO_RWLOCK *count_lock;  /* for CRYPTO_atomic_add without atomics */
+} gost_ec_vresults = { NULL, NULL, NULL, 0, 0, -1, 0, 0, NULL, NULL };
+static CRYPTO_ONCE gost_ec_vresults_once = CRYPTO_ONCE_STATIC_INIT;
+
+static void gost_ec_vresults_init(void)
+{
+    gost_ec_vresults.lock = CRYPTO_THREAD_lock_new();
+    gost_ec_vresults.count_lock = CRYPTO_THREAD_lock_new();
+}
+
+static void vresults_count(int *counter)
+{
+    int tmp;
+
+    CRYPTO_atomic_add(counter, 1, &tmp, gost_ec_vresults.count_lock);
+}
+
+static GOST_EC_VRESULT **vresults_bucket(const unsigned char *key)
+{
+    size_t h = 0;
+    int i;
+
+    for (i = 0; i < (int)sizeof(h); i++)
+        h = (h << 8) | key[i];
+    return &gost_ec_vresults.table[h & gost_ec_vresults.mask];
+}
+
+static void vresults_unlink(GOST_EC_VRESULT *e)
+{
+    GOST_EC_VRESULT **b = vresults_bucket(e->key);
+
+    while (*b != e)
+        b = &(*b)->hnext;
+    *b = e->hnext;
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        gost_ec_vresults.head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        gost_ec_vresults.tail = e->prev;
+    gost_ec_vresults.size--;
+}
+
+static void vresults_push_front(GOST_EC_VRESULT *e)
+{
+    GOST_EC_VRESULT **b = vresults_bucket(e->key);
+
+    e->hnext = *b;
+    *b = e;
+    e->prev = NULL;
+    e->next = gost_ec_vresults.head;
+    if (e->next)
+        e->next->prev = e;
+    else
+        gost_ec_vresults.tail = e;
+    gost_ec_vresults.head = e;
+    gost_ec_vresults.size++;
+}
+
+/* Called with the write lock held, so no reader touches used meanwhile */
+static void vresults_trim(long max)
+{
+    while (gost_ec_vresults.size > max) {
+        GOST_EC_VRESULT *e = gost_ec_vresults.tail;
+
+        vresults_unlink(e);
+        if (e->used && max > 0) {
+            e->used = 0;
+            vresults_push_front(e);
+            continue;
+        }
+        OPENSSL_free(e);
+    }
+}
+
+/*
+ * Keeps at most max entries and resizes the table to hold them, on
+ * allocation failure the cache is disabled
+ */
+static void vresults_resize(long max)
+{
+    GOST_EC_VRESULT **table = NULL, *e;
+    size_t n = 1;
+
+    vresults_trim(max);
+    if (max > 0) {
+        while (n < (size_t)max && n < ((size_t)1 << 20))
+            n <<= 1;
+        if ((table = OPENSSL_zalloc(n * sizeof(*table))) == NULL) {
+            vresults_trim(0);
+            max = 0;
+        }
+    }
+    OPENSSL_free(gost_ec_vresults.table);
+    gost_ec_vresults.table = table;
+    gost_ec_vresults.mask = n - 1;
+    gost_ec_vresults.max = max;
+    for (e = gost_ec_vresults.tail; e; e = e->prev) {
+        GOST_EC_VRESULT **b = vresults_bucket(e->key);
+
+        e->hnext = *b;
+        *b = e;
+    }
+}
+
+static int vresults_write_lock(void)
+{
+    const char *max;
+
+    if (!CRYPTO_THREAD_run_once(&gost_ec_vresults_once,
+                                gost_ec_vresults_init)
+        || gost_ec_vresults.lock == NULL
+        || gost_ec_vresults.count_lock == NULL
+        || !CRYPTO_THREAD_write_lock(gost_ec_vresults.lock))
+        return 0;
+    if (gost_ec_vresults.max < 0) {
+        max = get_gost_engine_param(GOST_PARAM_VERIFY_RESULTS);
+        vresults_resize(max && atol(max) > 0 ? atol(max) : 0);
+    }
+    return 1;
+}
+
+/* Falls back to the write lock until the size is read from the param */
+static int vresults_read_lock(void)
+{
+    if (!CRYPTO_THREAD_run_once(&gost_ec_vresults_once,
+                                gost_ec_vresults_init)
+        || gost_ec_vresults.lock == NULL
+        || gost_ec_vresults.count_lock == NULL
+        || !CRYPTO_THREAD_read_lock(gost_ec_vresults.lock))
+        return 0;
+    if (gost_ec_vresults.max >= 0)
+        return 1;
+    CRYPTO_THREAD_unlock(gost_ec_vresults.lock);
+    return vresults_write_lock();
+}
+
+static int vresults_enabled(void)
+{
+    int on;
+
+    if (!vresults_read_lock())
+        return 0;
+    on = gost_ec_vresults.max > 0;
+    CRYPTO_THREAD_unlock(gost_ec_vresults.lock);
+    return on;
+}
+
+/*
+ * Hashes everything the outcome of a verification depends on. The public
+ * key enters uncompressed, so the same point always gives the same key.
+ */
+static int vresults_key(unsigned char *key, const EC_GROUP *group,
+                        const EC_POINT *pub_key,
+                        const unsigned char *dgst, int dgst_len,
+                        const BIGNUM *sig_r, const BIGNUM *sig_s,
+                        BN_CTX *ctx)
+{
+    gost2012_hash_ctx hctx;
+    unsigned char buf[2 * 64 + 1];
+    int nid = EC_GROUP_get_curve_name(group);
+    size_t len;
+
+    buf[0] = (unsigned char)(nid >> 24);
+    buf[1] = (unsigned char)(nid >> 16);
+    buf[2] = (unsigned char)(nid >> 8);
+    buf[3] = (unsigned char)nid;
+    buf[4] = (unsigned char)dgst_len;
+    init_gost2012_hash_ctx(&hctx, 256);
+    gost2012_hash_block(&hctx, buf, 5);
+    gost2012_hash_block(&hctx, dgst, dgst_len);
+    len = EC_POINT_point2oct(group, pub_key, POINT_CONVERSION_UNCOMPRESSED,
+                             buf, sizeof(buf), ctx);
+    if (len == 0)
+        return 0;
+    gost2012_hash_block(&hctx, buf, len);
+    len = (len - 1) / 2;
+    if (BN_bn2binpad(sig_r, buf, len) != (int)len
+        || BN_bn2binpad(sig_s, buf + len, len) != (int)len)
+        return 0;
+    gost2012_hash_block(&hctx, buf, 2 * len);
+    gost2012_finish_hash(&hctx, key);
+    OPENSSL_cleanse(&hctx, sizeof(hctx));
+    return 1;
+}
+
+static int vresults_find(const unsigned char *key)
+{
+    GOST_EC_VRESULT *e = NULL;
+
+    if (!vresults_read_lock())
+        return 0;
+    if (gost_ec_vresults.max > 0) {
+        for (e = *vresults_bucket(key); e; e = e->hnext)
+            if (memcmp(e->key, key, GOST_EC_VRESULT_KEY) == 0)
+                break;
+    }
+    if (e)
+        vresults_count(&e->used);
+    vresults_count(e ? &gost_ec_vresults.hits : &gost_ec_vresults.misses);
+    CRYPTO_THREAD_unlock(gost_ec_vresults.lock);
+    return e != NULL;
+}
+
+/* Must only be called once the signature has been checked in full */
+static void vresults_add(const unsigned char *key)
+{
+    GOST_EC_VRESULT *e;
+
+    if (!vresults_write_lock())
+        return;
+    if (gost_ec_vresults.max > 0) {
+        for (e = *vresults_bucket(key); e; e = e->hnext)
+            if (memcmp(e->key, key, GOST_EC_VRESULT_KEY) == 0)
+                break;
+        if (e == NULL && (e = OPENSSL_malloc(sizeof(*e))) != NULL) {
+            memcpy(e->key, key, GOST_EC_VRESULT_KEY);
+            e->used = 0;
+            vresults_trim(gost_ec_vresults.max - 1);
+            vresults_push_front(e);
+        }
+    }
+    CRYPTO_THREAD_unlock(gost_ec_vresults.lock);
+}
+
+/* Sets the number of verifications to keep, 0 disables the cache */
+int gost_ec_verify_results_set_size(long max)
+{
+    if (max < 0 || !vresults_write_lock())
+        return 0;
+    vresults_resize(max);
+    CRYPTO_THREAD_unlock(gost_ec_vresults.lock);
+    return gost_ec_vresults.max == max;
+}
+
+/* Fills stats with hits, misses and the number of cached verifications */
+int gost_ec_verify_results_stats(unsigned long *stats)
+{
+    if (stats == NULL || !vresults_write_lock())
+        return 0;
+    stats[0] = (unsigned int)gost_ec_vresults.hits;
+    stats[1] = (unsigned int)gost_ec_vresults.misses;
+    stats[2] = gost_ec_vresults.size;
+    CRYPTO_THREAD_unlock(gost_ec_vresults.lock);
+    return 1;
+}
+
+/*
+ * Empties the cache and clears its counters, called on engine destruction.
+ * The size is read from the engine param again on next use, the locks
+ * are kept.
+ */
+void gost_ec_verify_results_free(void)
+{
+    if (gost_ec_vresults.lock == NULL)
+        return;
+    CRYPTO_THREAD_write_lock(gost_ec_vresults.lock);
+    vresults_resize(0);
+    gost_ec_vresults.max = -1;
+    gost_ec_vresults.hits = gost_ec_vresults.misses = 0;
+    CRYPTO_THREAD_unlock(gost_ec_vresults.lock);
+}
+
+
+/*
+ * Picks a nonce in [1, order - 1] by reducing 64 random bits more than
+ * the order has, which keeps the bias negligible. Unlike BN_rand_range()
+ * it takes no buffer from the heap.
+ */
+static int ec_rand_nonce(BIGNUM *k, const BIGNUM *order, BN_CTX *ctx)
+{
+    unsigned char buf[8 * GOST_EC_MAX_LIMBS + 8];
+    int len = BN_num_bytes(order) + 8, ok = 0;
+    BIGNUM *t;
+
+    if (len > (int)sizeof(buf))
+        return 0;
+    BN_CTX_start(ctx);
+    t = BN_CTX_get(ctx);
+    if (t && RAND_priv_bytes(buf, len) > 0
+        && BN_bin2bn(buf, len, k)
+        && BN_sub(t, order, BN_value_one())
+        && BN_mod(k, k, t, ctx)
+        && BN_add_word(k, 1))
+        ok = 1;
+    OPENSSL_cleanse(buf, len);
+    BN_CTX_end(ctx);
+    return ok;
+}
+
+/*
+ * Nonce generation mode set by the NONCE engine parameter: RANDOM draws
+ * k from the RAND_priv_bytes() generator of the thread, DETERMINISTIC
+ * derives it from the private key and the digest as RFC 6979 does, with
+ * HMAC-Streebog-512, and HEDGED adds 32 random bytes to the derivation.
+ */
+#define GOST_NONCE_RANDOM        0
+#define GOST_NONCE_HEDGED        1
+#define GOST_NONCE_DETERMINISTIC 2
+
+static int gost_ec_nonce_mode = -1;
+
+static int nonce_mode_parse(const char *mode)
+{
+    if (mode == NULL || strcmp(mode, "RANDOM") == 0)
+        return GOST_NONCE_RANDOM;
+    if (strcmp(mode, "HEDGED") == 0)
+        return GOST_NONCE_HEDGED;
+    if (strcmp(mode, "DETERMINISTIC") == 0)
+        return GOST_NONCE_DETERMINISTIC;
+    return -1;
+}
+
+static int nonce_mode(void)
+{
+    int mode = gost_ec_nonce_mode;
+
+    if (mode < 0) {
+        mode = nonce_mode_parse(get_gost_engine_param(GOST_PARAM_NONCE));
+        if (mode < 0)
+            mode = GOST_NONCE_RANDOM;
+        gost_ec_nonce_mode = mode;
+    }
+    return mode;
+}
+
+int gost_ec_nonce_set_mode(const char *mode)
+{
+    int m = nonce_mode_parse(mode);
+
+    if (m < 0)
+        return 0;
+    gost_ec_nonce_mode = m;
+    return 1;
+}
+
+/* out = HMAC_key(v || sep || seed), or HMAC_key(v) if sep < 0 */
+static void nonce_hmac(gost2012_hmac_ctx *h, const unsigned char *key,
+                       unsigned char *out, const unsigned char *v,
+                       int sep, const unsigned char *seed, size_t seedlen)
+{
+    unsigned char b = (unsigned char)sep;
+
+    gost2012_hmac_init(h, 512, key, 64);
+    gost2012_hmac_update(h, v, 64);
+    if (sep >= 0) {
+        gost2012_hmac_update(h, &b, 1);
+        gost2012_hmac_update(h, seed, seedlen);
+    }
+    gost2012_hmac_final(h, out);
+}
+
+/*
+ * RFC 6979 nonce for the digest reduced modulo q, both it and the key
+ * enter the HMAC as big-endian numbers of the order size. Extra random
+ * bytes go last into the seed when hedged.
+ */
+static int ec_hmac_nonce(BIGNUM *k, const BIGNUM *order, const BIGNUM *priv,
+                         const BIGNUM *e, int hedged)
+{
+    gost2012_hmac_ctx h;
+    unsigned char K[64], V[64];
+    unsigned char seed[2 * 8 * GOST_EC_MAX_LIMBS + 32];
+    int qlen = BN_num_bytes(order), shift = qlen * 8 - BN_num_bits(order);
+    size_t seedlen = 2 * qlen;
+    int ok = 0;
+
+    memset(&h, 0, sizeof(h));
+    if (qlen > (int)sizeof(V)
+        || BN_bn2binpad(priv, seed, qlen) != qlen
+        || BN_bn2binpad(e, seed + qlen, qlen) != qlen)
+        goto err;
+    if (hedged) {
+        if (RAND_priv_bytes(seed + seedlen, 32) <= 0)
+            goto err;
+        seedlen += 32;
+    }
+
+    memset(V, 0x01, sizeof(V));
+    memset(K, 0x00, sizeof(K));
+    nonce_hmac(&h, K, K, V, 0x00, seed, seedlen);
+    nonce_hmac(&h, K, V, V, -1, NULL, 0);
+    nonce_hmac(&h, K, K, V, 0x01, seed, seedlen);
+    nonce_hmac(&h, K, V, V, -1, NULL, 0);
+    for (;;) {
+        /* The order is at most 512 bits, one block is enough */
+        nonce_hmac(&h, K, V, V, -1, NULL, 0);
+        if (!BN_bin2bn(V, qlen, k) || !BN_rshift(k, k, shift))
+            goto err;
+        if (!BN_is_zero(k) && BN_cmp(k, order) < 0)
+            break;
+        nonce_hmac(&h, K, K, V, 0x00, seed, 0);
+        nonce_hmac(&h, K, V, V, -1, NULL, 0);
+    }
+    ok = 1;
+ err:
+    gost2012_hmac_cleanup(&h);
+    OPENSSL_cleanse(K, sizeof(K));
+    OPENSSL_cleanse(V, sizeof(V));
+    OPENSSL_cleanse(seed, sizeof(seed));
+    return ok;
+}
+
+/* Keys generated together, sharing one field inversion */
+#define GOST_EC_KEYGEN_BATCH 32
+
+/*
+ * Draws count numbers k in [1, order - 1] and computes k*G for all of
+ * them with one inversion. Numbers are little-endian of the curve size,
+ * ok[i] is set to 0 if k_i*G is the point at infinity.
+ */
+static int ec_keygen_raw(const GOST_EC_CURVE *curve, const BIGNUM *order,
+                         size_t count, unsigned char *k, unsigned char *x,
+                         unsigned char *y, int *ok, BN_CTX *ctx)
+{
+    int len = (int)gost_ec_curve_size(curve), ret = 0;
+    BIGNUM *d;
+    size_t i;
+
+    BN_CTX_start(ctx);
+    d = BN_CTX_get(ctx);
+    if (d == NULL)
+        goto err;
+    for (i = 0; i < count; i++) {
+        if (!ec_rand_nonce(d, order, ctx)
+            || BN_bn2lebinpad(d, k + i * len, len) != len)
+            goto err;
+    }
+    ret = gost_ec_curve_mul_batch(curve, count, x, y, k, NULL, NULL, NULL,
+                                  NULL, ok);
+ err:
+    if (d)
+        BN_clear(d);
+    BN_CTX_end(ctx);
+    return ret;
+}
+
+/*
+ * Pools of precomputed pairs (k, k*G) per curve. Neither depends on the
+ * key or the message: a presignature gives the signing path k and
+ * r = x(k*G) mod q, leaving it with s = (r*d + k*e) mod q, and an
+ * ephemeral key for VKO based key transport is such a pair as well.
+ * Every pair is handed out once and wiped, pools are dropped in a
+ * forked child.
+ */
+typedef struct gost_ec_prekey {
+    unsigned char k[8 * GOST_EC_MAX_LIMBS];     /* big-endian */
+    unsigned char x[8 * GOST_EC_MAX_LIMBS];
+    unsigned char y[8 * GOST_EC_MAX_LIMBS];
+} GOST_EC_PREKEY;
+
+typedef struct gost_ec_pool {
+    BIGNUM *order;              /* NULL until the curve is used first time */
+    GOST_EC_PREKEY *items;
+    size_t count, size;
+    long pid;
+} GOST_EC_POOL;
+
+#define GOST_EC_POOL_PRESIGN   0
+#define GOST_EC_POOL_EPHEMERAL 1
+#define GOST_EC_POOL_KINDS     2
+
+static GOST_EC_POOL gost_ec_pools[GOST_EC_POOL_KINDS][GOST_EC_CURVES_MAX];
+static long gost_ec_pool_max[GOST_EC_POOL_KINDS] = { -1, -1 };
+static const int gost_ec_pool_param[GOST_EC_POOL_KINDS] = {
+    GOST_PARAM_PRESIGN_POOL, GOST_PARAM_EPHEMERAL_POOL
+};
+static CRYPTO_RWLOCK *gost_ec_pool_lock = NULL;
+static CRYPTO_ONCE gost_ec_pool_once = CRYPTO_ONCE_STATIC_INIT;
+
+static void gost_ec_pool_init(void)
+{
+    gost_ec_pool_lock = CRYPTO_THREAD_lock_new();
+}
+
+static long pool_pid(void)
+{
+#ifdef _WIN32
+    return 0;
+#else
+    return (long)getpid();
+#endif
+}
+
+/* Reallocates pool for the current size limit of its kind, under lock */
+static void pool_resize(int kind, size_t i)
+{
+    GOST_EC_POOL *pool = &gost_ec_pools[kind][i];
+    GOST_EC_PREKEY *items = NULL;
+    size_t size = (size_t)gost_ec_pool_max[kind];
+
+    if (pool->pid != pool_pid())
+        pool->count = 0;
+    if (pool->order == NULL)
+        size = 0;
+    if (pool->size == size)
+        goto done;
+    if (size
+        && !(items = OPENSSL_secure_zalloc(size * sizeof(*items))))
+        size = 0;
+    if (pool->count > size)
+        pool->count = size;
+    if (items && pool->count)
+        memcpy(items, pool->items, pool->count * sizeof(*items));
+    OPENSSL_secure_clear_free(pool->items, pool->size * sizeof(*items));
+    pool->items = items;
+    pool->size = size;
+ done:
+    pool->pid = pool_pid();
+}
+
+static int pool_lock(void)
+{
+    const char *max;
+    int kind;
+
+    if (!CRYPTO_THREAD_run_once(&gost_ec_pool_once, gost_ec_pool_init)
+        || gost_ec_pool_lock == NULL
+        || !CRYPTO_THREAD_write_lock(gost_ec_pool_lock))
+        return 0;
+    for (kind = 0; kind < GOST_EC_POOL_KINDS; kind++) {
+        if (gost_ec_pool_max[kind] >= 0)
+            continue;
+        max = get_gost_engine_param(gost_ec_pool_param[kind]);
+        gost_ec_pool_max[kind] = max ? atol(max) : 0;
+        if (gost_ec_pool_max[kind] < 0)
+            gost_ec_pool_max[kind] = 0;
+    }
+    return 1;
+}
+
+/* Read lock on the pools, the write lock until the sizes are read */
+static int pool_read_lock(void)
+{
+    if (!CRYPTO_THREAD_run_once(&gost_ec_pool_once, gost_ec_pool_init)
+        || gost_ec_pool_lock == NULL
+        || !CRYPTO_THREAD_read_lock(gost_ec_pool_lock))
+        return 0;
+    if (gost_ec_pool_max[GOST_EC_POOL_PRESIGN] >= 0
+        && gost_ec_pool_max[GOST_EC_POOL_EPHEMERAL] >= 0)
+        return 1;
+    CRYPTO_THREAD_unlock(gost_ec_pool_lock);
+    return pool_lock();
+}
+
+/*
+ * Takes a pair for the curve of group into k and the coordinates x and
+ * y, which can be NULL. Returns 0 if the pool is empty or disabled, then
+ * the first use of the curve enables its pool for pool_fill(). A disabled
+ * or empty pool is seen under the read lock, the write lock is only taken
+ * to take a pair or to enable the pool.
+ */
+static int pool_take(int kind, const EC_GROUP *group,
+                     BIGNUM *k, BIGNUM *x, BIGNUM *y)
+{
+    const GOST_EC_CURVE *curve = gost_ec_curve(group);
+    GOST_EC_POOL *pool;
+    GOST_EC_PREKEY *item;
+    size_t len;
+    int ok = 0;
+
+    if (curve == NULL || !pool_read_lock())
+        return 0;
+    pool = &gost_ec_pools[kind][curve - gost_ec_curves];
+    ok = gost_ec_pool_max[kind] != 0
+        && (pool->order == NULL || pool->count != 0);
+    CRYPTO_THREAD_unlock(gost_ec_pool_lock);
+    if (!ok || !pool_lock())
+        return 0;
+    ok = 0;
+    len = gost_ec_curve_size(curve);
+    if (gost_ec_pool_max[kind] == 0)
+        goto end;
+    if (pool->order == NULL) {
+        pool->order = BN_dup(EC_GROUP_get0_order(group));
+        goto end;
+    }
+    if (pool->pid != pool_pid())
+        pool_resize(kind, curve - gost_ec_curves);
+    if (pool->count == 0)
+        goto end;
+    item = &pool->items[--pool->count];
+    ok = BN_bin2bn(item->k, len, k)
+        && (!x || BN_bin2bn(item->x, len, x))
+        && (!y || BN_bin2bn(item->y, len, y));
+    OPENSSL_cleanse(item, sizeof(*item));
+ end:
+    CRYPTO_THREAD_unlock(gost_ec_pool_lock);
+    return ok;
+}
+
+/*
+ * Fills the pools of a kind for the curves used so far up to the size
+ * limit. Meant to be called by the application when idle or from a
+ * thread of its own.
+ */
+static int pool_fill(int kind)
+{
+    unsigned char kb[GOST_EC_KEYGEN_BATCH * 8 * GOST_EC_MAX_LIMBS],
+        xb[GOST_EC_KEYGEN_BATCH * 8 * GOST_EC_MAX_LIMBS],
+        yb[GOST_EC_KEYGEN_BATCH * 8 * GOST_EC_MAX_LIMBS];
+    int valid[GOST_EC_KEYGEN_BATCH];
+    GOST_EC_PREKEY item;
+    BIGNUM *order = NULL, *x;
+    BN_CTX *ctx;
+    size_t i, j, len, want;
+    int ok = 0;
+
+    if (!(ctx = gost_bn_ctx_secret()))
+        return 0;
+    BN_CTX_start(ctx);
+    x = BN_CTX_get(ctx);
+    if (!x)
+        goto err;
+
+    for (i = 0; i < GOST_EC_CURVES_MAX; i++) {
+        const GOST_EC_CURVE *curve = &gost_ec_curves[i];
+        GOST_EC_POOL *pool = &gost_ec_pools[kind][i];
+
+        len = gost_ec_curve_size(curve);
+        for (;;) {
+            if (!pool_lock())
+                goto err;
+            pool_resize(kind, i);
+            want = pool->order != NULL ? pool->size - pool->count : 0;
+            if (want && order == NULL)
+                order = BN_dup(pool->order);
+            CRYPTO_THREAD_unlock(gost_ec_pool_lock);
+            if (!want)
+                break;
+            if (order == NULL)
+                goto err;
+
+            /* k*G is computed outside of the lock, a batch at a time */
+            if (want > GOST_EC_KEYGEN_BATCH)
+                want = GOST_EC_KEYGEN_BATCH;
+            if (!ec_keygen_raw(curve, order, want, kb, xb, yb, valid, ctx))
+                goto err;
+            for (j = 0; j < want; j++) {
+                if (valid[j]
+                    && (!BN_lebin2bn(xb + j * len, len, x)
+                        || !BN_nnmod(x, x, order, ctx)))
+                    goto err;
+                valid[j] = valid[j] && !BN_is_zero(x);
+            }
+
+            if (!pool_lock())
+                goto err;
+            for (j = 0; j < want; j++) {
+                if (pool->count >= pool->size || pool->pid != pool_pid())
+                    break;
+                if (!valid[j])
+                    continue;
+                BUF_reverse(item.k, kb + j * len, len);
+                BUF_reverse(item.x, xb + j * len, len);
+                BUF_reverse(item.y, yb + j * len, len);
+                pool->items[pool->count++] = item;
+            }
+            CRYPTO_THREAD_unlock(gost_ec_pool_lock);
+            OPENSSL_cleanse(&item, sizeof(item));
+        }
+        BN_free(order);
+        order = NULL;
+    }
+    ok = 1;
+ err:
+    OPENSSL_cleanse(kb, sizeof(kb));
+    OPENSSL_cleanse(&item, sizeof(item));
+    BN_free(order);
+    BN_CTX_end(ctx);
+    gost_bn_ctx_put(ctx);
+    return ok;
+}
+
+/* Sets the number of pairs kept per curve for a kind, 0 disables pools */
+static int pool_set_size(int kind, long max)
+{
+    size_t i;
+
+    if (max < 0 || !pool_lock())
+        return 0;
+    gost_ec_pool_max[kind] = max;
+    for (i = 0; i < GOST_EC_CURVES_MAX; i++)
+        pool_resize(kind, i);
+    CRYPTO_THREAD_unlock(gost_ec_pool_lock);
+    return 1;
+}
+
+int gost_ec_presign_fill(void)
+{
+    return pool_fill(GOST_EC_POOL_PRESIGN);
+}
+
+int gost_ec_presign_set_size(long max)
+{
+    return pool_set_size(GOST_EC_POOL_PRESIGN, max);
+}
+
+int gost_ec_ephemeral_fill(void)
+{
+    return pool_fill(GOST_EC_POOL_EPHEMERAL);
+}
+
+int gost_ec_ephemeral_set_size(long max)
+{
+    return pool_set_size(GOST_EC_POOL_EPHEMERAL, max);
+}
+
+/*
+ * Wipes the pools, called on engine destruction. The sizes are read from
+ * the engine params again on next use, the lock is kept.
+ */
+void gost_ec_pools_free(void)
+{
+    size_t i;
+    int kind;
+
+    if (gost_ec_pool_lock == NULL)
+        return;
+    CRYPTO_THREAD_write_lock(gost_ec_pool_lock);
+    for (kind = 0; kind < GOST_EC_POOL_KINDS; kind++) {
+        for (i = 0; i < GOST_EC_CURVES_MAX; i++) {
+            GOST_EC_POOL *pool = &gost_ec_pools[kind][i];
+
+            OPENSSL_secure_clear_free(pool->items,
+                                      pool->size * sizeof(GOST_EC_PREKEY));
+            BN_free(pool->order);
+            memset(pool, 0, sizeof(*pool));
+        }
+        gost_ec_pool_max[kind] = -1;
+    }
+    CRYPTO_THREAD_unlock(gost_ec_pool_lock);
+}
+
+/*
+ * Computes affine coordinates (x, y) of n*G + m*Q, where any of n and
+ * (Q, m) can be NULL, and so can y.
+ * Curves with dedicated arithmetic go through it, others through
+ * EC_POINT_mul. With cached set Q is looked up in the verification
+ * cache.
+ */
+static int ec_point_mul(const EC_GROUP *group, BIGNUM *x, BIGNUM *y,
+                        const BIGNUM *n, const EC_POINT *q, const BIGNUM *m,
+                        BN_CTX *ctx, int cached)
+{
+    const GOST_EC_CURVE *curve = gost_ec_curve(group);
+    GOST_EC_VCACHE_ENTRY *entry = NULL;
+    unsigned char bn[8 * GOST_EC_MAX_LIMBS], bm[8 * GOST_EC_MAX_LIMBS],
+        bqx[8 * GOST_EC_MAX_LIMBS], bqy[8 * GOST_EC_MAX_LIMBS],
+        bx[8 * GOST_EC_MAX_LIMBS], by[8 * GOST_EC_MAX_LIMBS];
+    const BIGNUM *order = EC_GROUP_get0_order(group);
+    BIGNUM *qx, *qy, *k, *l;
+    EC_POINT *C = NULL;
+    int len, res, ok = 0;
+
+    BN_CTX_start(ctx);
+    qx = BN_CTX_get(ctx);
+    qy = BN_CTX_get(ctx);
+    k = BN_CTX_get(ctx);
+    l = BN_CTX_get(ctx);
+    if (!qx || !qy || !l) {
+        GOSTerr(GOST_F_GOST_EC_POINT_MUL, ERR_R_MALLOC_FAILURE);
+        goto err;
+    }
+
+    if (curve != NULL) {
+        /* Dedicated arithmetic wants scalars below the order */
+        if (n && (BN_is_negative(n) || BN_cmp(n, order) >= 0)) {
+            if (!BN_nnmod(k, n, order, ctx)) {
+                GOSTerr(GOST_F_GOST_EC_POINT_MUL, ERR_R_BN_LIB);
+                goto err;
+            }
+            n = k;
+        }
+        if (m && (BN_is_negative(m) || BN_cmp(m, order) >= 0)) {
+            if (!BN_nnmod(l, m, order, ctx)) {
+                GOSTerr(GOST_F_GOST_EC_POINT_MUL, ERR_R_BN_LIB);
+                goto err;
+            }
+            m = l;
+        }
+        len = gost_ec_curve_size(curve);
+        if ((n && BN_bn2lebinpad(n, bn, len) != len)
+            || (m && BN_bn2lebinpad(m, bm, len) != len))
+            goto generic;
+        if (q) {
+            if (!EC_POINT_get_affine_coordinates(group, q, qx, qy, ctx)
+                || BN_bn2lebinpad(qx, bqx, len) != len
+                || BN_bn2lebinpad(qy, bqy, len) != len) {
+                GOSTerr(GOST_F_GOST_EC_POINT_MUL, ERR_R_EC_LIB);
+                goto err;
+            }
+        }
+        if (q && m && cached)
+            entry = vcache_get(curve, bqx, bqy);
+        if (entry) {
+            res = gost_ec_curve_mul_comb(curve, bx, by, n ? bn : NULL,
+                                         entry->comb, bm);
+            vcache_put(entry);
+        } else {
+            res = gost_ec_curve_mul(curve, bx, by, n ? bn : NULL,
+                                    q ? bqx : NULL, q ? bqy : NULL,
+                                    m ? bm : NULL);
+        }
+        if (!res) {
+            GOSTerr(GOST_F_GOST_EC_POINT_MUL, GOST_R_ERROR_POINT_MUL);
+            goto err;
+        }
+        if (!BN_lebin2bn(bx, len, x) || (y && !BN_lebin2bn(by, len, y))) {
+            GOSTerr(GOST_F_GOST_EC_POINT_MUL, ERR_R_BN_LIB);
+            goto err;
+        }
+        ok = 1;
+        goto err;
+    }
+
+ generic:
+    C = EC_POINT_new(group);
+    if (!C) {
+        GOSTerr(GOST_F_GOST_EC_POINT_MUL, ERR_R_MALLOC_FAILURE);
+        goto err;
+    }
+    /*
+     * To avoid timing information leaking the length of a secret n,
+     * compute C*n using an equivalent scalar of fixed bit-length
+     */
+    if (n && !q) {
+        if (!BN_add(k, n, order)
+            || (BN_num_bits(k) <= BN_num_bits(order)
+                && !BN_add(k, k, order))) {
+            GOSTerr(GOST_F_GOST_EC_POINT_MUL, ERR_R_BN_LIB);
+            goto err;
+        }
+        n = k;
+    }
+    if (!EC_POINT_mul(group, C, n, q, m, ctx)) {
+        GOSTerr(GOST_F_GOST_EC_POINT_MUL, GOST_R_ERROR_POINT_MUL);
+        goto err;
+    }
+    if (!EC_POINT_get_affine_coordinates(group, C, x, y, ctx)) {
+        GOSTerr(GOST_F_GOST_EC_POINT_MUL, ERR_R_EC_LIB);
+        goto err;
+    }
+    ok = 1;
+ err:
+    OPENSSL_cleanse(bn, sizeof(bn));
+    OPENSSL_cleanse(bm, sizeof(bm));
+    OPENSSL_cleanse(bx, sizeof(bx));
+    OPENSSL_cleanse(by, sizeof(by));
+    EC_POINT_free(C);
+    BN_CTX_end(ctx);
+    return ok;
+}
+
+int gost_ec_point_mul(const EC_GROUP *group, BIGNUM *x, BIGNUM *y,
+                      const BIGNUM *n, const EC_POINT *q, const BIGNUM *m,
+                      BN_CTX *ctx)
+{
+    return ec_point_mul(group, x, y, n, q, m, ctx, 0);
+}
+
+/*
+ * Computes m*Q and writes its x and y coordinates little-endian, len
+ * bytes each, one after another into out. Curves with dedicated
+ * arithmetic write straight from it without going through BIGNUMs.
+ */
+int gost_ec_point_mul_le(const EC_GROUP *group, unsigned char *out, int len,
+                         const EC_POINT *q, const BIGNUM *m, BN_CTX *ctx)
+{
+    const GOST_EC_CURVE *curve = gost_ec_curve(group);
+    const BIGNUM *order = EC_GROUP_get0_order(group);
+    unsigned char bm[8 * GOST_EC_MAX_LIMBS], bqx[8 * GOST_EC_MAX_LIMBS],
+        bqy[8 * GOST_EC_MAX_LIMBS];
+    BIGNUM *x, *y;
+    int ok = 0;
+
+    BN_CTX_start(ctx);
+    x = BN_CTX_get(ctx);
+    y = BN_CTX_get(ctx);
+    if (!y) {
+        GOSTerr(GOST_F_GOST_EC_POINT_MUL, ERR_R_MALLOC_FAILURE);
+        goto err;
+    }
+    if (curve == NULL || gost_ec_curve_size(curve) != (size_t)len
+        || BN_is_negative(m) || BN_cmp(m, order) >= 0
+        || BN_bn2lebinpad(m, bm, len) != len) {
+        ok = gost_ec_point_mul(group, x, y, NULL, q, m, ctx)
+            && BN_bn2lebinpad(x, out, len) == len
+            && BN_bn2lebinpad(y, out + len, len) == len;
+        goto err;
+    }
+    if (!EC_POINT_get_affine_coordinates(group, q, x, y, ctx)
+        || BN_bn2lebinpad(x, bqx, len) != len
+        || BN_bn2lebinpad(y, bqy, len) != len) {
+        GOSTerr(GOST_F_GOST_EC_POINT_MUL, ERR_R_EC_LIB);
+        goto err;
+    }
+    if (!gost_ec_curve_mul(curve, out, out + len, NULL, bqx, bqy, bm)) {
+        GOSTerr(GOST_F_GOST_EC_POINT_MUL, GOST_R_ERROR_POINT_MUL);
+        goto err;
+    }
+    ok = 1;
+ err:
+    OPENSSL_cleanse(bm, sizeof(bm));
+    BN_CTX_end(ctx);
+    return ok;
+}
+
+/*
+ * Computes gost_ec signature (r, s) of the digest into BIGNUMs owned by
+ * the caller, using only ctx for temporaries
+ */
+static int ec_sign(const unsigned char *dgst, int dlen, EC_KEY *eckey,
+                   BIGNUM *r, BIGNUM *s, BN_CTX *ctx)
+{
+    const EC_GROUP *group;
+    const GOST_EC_CURVE *curve;
+    const BIGNUM *order;
+    const BIGNUM *priv_key;
+    BIGNUM *md, *X, *tmp, *tmp2, *k, *e;
+    unsigned char bd[64], bk[64], br[64], bs[64];
+    int mode = nonce_mode();
+    int ret = 0;
+
+    BN_CTX_start(ctx);
+    OPENSSL_assert(dlen == 32 || dlen == 64);
+    md = BN_CTX_get(ctx);
+    e = BN_CTX_get(ctx);
+    k = BN_CTX_get(ctx);
+    X = BN_CTX_get(ctx);
+    tmp = BN_CTX_get(ctx);
+    tmp2 = BN_CTX_get(ctx);
+    if (!tmp2 || !BN_lebin2bn(dgst, dlen, md)) {
+        GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_MALLOC_FAILURE);
+        goto err;
+    }
+    group = EC_KEY_get0_group(eckey);
+    if (!group) {
+        GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_INTERNAL_ERROR);
+        goto err;
+    }
+    order = EC_GROUP_get0_order(group);
+    if (!order) {
+        GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_INTERNAL_ERROR);
+        goto err;
+    }
+    priv_key = EC_KEY_get0_private_key(eckey);
+    if (!priv_key) {
+        GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_INTERNAL_ERROR);
+        goto err;
+    }
+    /* Scalars of curves with dedicated arithmetic are done modulo q there */
+    curve = gost_ec_curve(group);
+    if (curve != NULL && (gost_ec_curve_size(curve) != (size_t)dlen
+                          || BN_bn2lebinpad(priv_key, bd, dlen) != dlen))
+        curve = NULL;
+    if ((curve == NULL || mode != GOST_NONCE_RANDOM)
+        && !BN_mod(e, md, order, ctx)) {
+        GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_INTERNAL_ERROR);
+        goto err;
+    }
+#ifdef DEBUG_SIGN
+    fprintf(stderr, "digest as bignum=");
+    BN_print_fp(stderr, md);
+    fprintf(stderr, "\ndigest mod q=");
+    BN_print_fp(stderr, e);
+    fprintf(stderr, "\n");
+#endif
+    if (BN_is_zero(e)) {
+        BN_one(e);
+    }
+
+    do {
+        do {
+            if (mode != GOST_NONCE_RANDOM) {
+                /*
+                 * A deterministic nonce is the same in every round, r or s
+                 * being zero has negligible probability
+                 */
+                if (!ec_hmac_nonce(k, order, priv_key, e,
+                                   mode == GOST_NONCE_HEDGED)) {
+                    GOSTerr(GOST_F_GOST_EC_SIGN, GOST_R_RNG_ERROR);
+                    goto err;
+                }
+            } else if (pool_take(GOST_EC_POOL_PRESIGN, group, k, X, NULL)) {
+                if (!BN_nnmod(r, X, order, ctx)) {
+                    GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_INTERNAL_ERROR);
+                    goto err;
+                }
+                break;
+            } else if (!ec_rand_nonce(k, order, ctx)) {
+                GOSTerr(GOST_F_GOST_EC_SIGN, GOST_R_RNG_ERROR);
+                goto err;
+            }
+            if (!gost_ec_point_mul(group, X, NULL, k, NULL, NULL, ctx)) {
+                GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_EC_LIB);
+                goto err;
+            }
+
+            if (!BN_nnmod(r, X, order, ctx)) {
+                GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_INTERNAL_ERROR);
+                goto err;
+            }
+        }
+        while (BN_is_zero(r));
+        if (curve != NULL) {
+            if (BN_bn2lebinpad(k, bk, dlen) != dlen
+                || BN_bn2lebinpad(r, br, dlen) != dlen) {
+                GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_INTERNAL_ERROR);
+                goto err;
+            }
+            gost_ec_curve_sign_scalar(curve, bs, bd, bk, br, dgst);
+            if (!BN_lebin2bn(bs, dlen, s)) {
+                GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_INTERNAL_ERROR);
+                goto err;
+            }
+            continue;
+        }
+        /* s =  (r*priv_key+k*e) mod order */
+        if (!BN_mod_mul(tmp, priv_key, r, order, ctx)
+            || !BN_mod_mul(tmp2, k, e, order, ctx)
+            || !BN_mod_add(s, tmp, tmp2, order, ctx)) {
+            GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_INTERNAL_ERROR);
+            goto err;
         }
+    }
+    while (BN_is_zero(s));
+    ret = 1;
+
+ err:
+    OPENSSL_cleanse(bd, sizeof(bd));
+    OPENSSL_cleanse(bk, sizeof(bk));
+    OPENSSL_cleanse(bs, sizeof(bs));
+    if (tmp2) {
+        BN_clear(k);
+        BN_clear(X);
+        BN_clear(tmp);
+        BN_clear(tmp2);
+    }
+    BN_CTX_end(ctx);
+    return ret;
+}
+
+/*
+ * Computes gost_ec signature as ECDSA_SIG structure
+ *
+ */
+ECDSA_SIG *gost_ec_sign(const unsigned char *dgst, int dlen, EC_KEY *eckey)
+{
+    ECDSA_SIG *newsig = NULL;
+    BIGNUM *r, *s, *new_r = NULL, *new_s = NULL;
+    BN_CTX *ctx;
+
+    OPENSSL_assert(dgst != NULL && eckey != NULL);
+
+    if (!(ctx = gost_bn_ctx_secret())) {
+        GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_MALLOC_FAILURE);
+        return NULL;
+    }
+    BN_CTX_start(ctx);
+    r = BN_CTX_get(ctx);
+    s = BN_CTX_get(ctx);
+    if (!s) {
+        GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_MALLOC_FAILURE);
+        goto err;
+    }
+    if (!ec_sign(dgst, dlen, eckey, r, s, ctx))
+        goto err;
+
+    newsig = ECDSA_SIG_new();
+    new_s = BN_dup(s);
+    new_r = BN_dup(r);
+    if (!newsig || !new_s || !new_r) {
+        GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_MALLOC_FAILURE);
+        ECDSA_SIG_free(newsig);
+        BN_free(new_r);
+        BN_free(new_s);
+        newsig = NULL;
+        goto err;
+    }
+    ECDSA_SIG_set0(newsig, new_r, new_s);
+ err:
+    BN_CTX_end(ctx);
+    gost_bn_ctx_put(ctx);
+    return newsig;
+}
+
+/*
+ * Computes gost_ec signature packed according to CryptoPro rules, s
+ * followed by r, order bytes each. Unlike gost_ec_sign() followed by
+ * pack_sign_cp() it makes no heap allocations in steady state.
+ */
+int gost_ec_sign_cp(const unsigned char *dgst, int dlen, EC_KEY *eckey,
+                    unsigned char *sig, int order)
+{
+    BIGNUM *r, *s;
+    BN_CTX *ctx;
+    int ok = 0;
+
+    OPENSSL_assert(dgst != NULL && eckey != NULL);
+
+    if (!(ctx = gost_bn_ctx_secret())) {
+        GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_MALLOC_FAILURE);
+        return 0;
+    }
+    BN_CTX_start(ctx);
+    r = BN_CTX_get(ctx);
+    s = BN_CTX_get(ctx);
+    if (!s) {
+        GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_MALLOC_FAILURE);
+        goto err;
+    }
+    if (!ec_sign(dgst, dlen, eckey, r, s, ctx))
+        goto err;
+    ok = BN_bn2binpad(s, sig, order) == order
+        && BN_bn2binpad(r, sig + order, order) == order;
+ err:
+    BN_CTX_end(ctx);
+    gost_bn_ctx_put(ctx);
+    return ok;
+}
 
-        if (!BN_mod_mul(tmp, priv_key, r, order, ctx)
-            || !BN_mod_mul(tmp2, k, e, order, ctx)
-            || !BN_mod_add(s, tmp, tmp2, order, ctx)) {
-            GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_INTERNAL_ERROR);
-            goto err;
+/*
+ * Signs count digests with one key. The nonces of a batch are drawn
+ * together and their k*G converted to affine form with one inversion.
+ * sig[i] receives a new ECDSA_SIG for dgst[i]. Returns 0 and leaves no
+ * signatures allocated on failure.
+ */
+int gost_ec_sign_batch(const unsigned char *const *dgst, int dlen,
+                       EC_KEY *eckey, ECDSA_SIG **sig, size_t count)
+{
+    unsigned char kb[GOST_EC_KEYGEN_BATCH * 8 * GOST_EC_MAX_LIMBS],
+        xb[GOST_EC_KEYGEN_BATCH * 8 * GOST_EC_MAX_LIMBS];
+    unsigned char bd[64], br[64], bs[64];
+    int valid[GOST_EC_KEYGEN_BATCH];
+    const EC_GROUP *group = EC_KEY_get0_group(eckey);
+    const GOST_EC_CURVE *curve = group ? gost_ec_curve(group) : NULL;
+    const BIGNUM *order = group ? EC_GROUP_get0_order(group) : NULL;
+    const BIGNUM *priv_key = EC_KEY_get0_private_key(eckey);
+    BIGNUM *r, *s, *new_r, *new_s;
+    BN_CTX *ctx;
+    size_t i, j, n;
+    int ok = 0;
+
+    for (i = 0; i < count; i++)
+        sig[i] = NULL;
+    if (!order || !priv_key) {
+        GOSTerr(GOST_F_GOST_EC_SIGN_BATCH, ERR_R_INTERNAL_ERROR);
+        return 0;
+    }
+    /* Deterministic nonces and other curves are done one by one */
+    if (curve == NULL || gost_ec_curve_size(curve) != (size_t)dlen
+        || nonce_mode() != GOST_NONCE_RANDOM) {
+        for (i = 0; i < count; i++) {
+            if (!(sig[i] = gost_ec_sign(dgst[i], dlen, eckey)))
+                goto fail;
         }
+        return 1;
     }
-    while (BN_is_zero(s));
 
-    new_s = BN_dup(s);
-    new_r = BN_dup(r);
-    if (!new_s || !new_r) {
-        GOSTerr(GOST_F_GOST_EC_SIGN, ERR_R_MALLOC_FAILURE);
+    if (!(ctx = gost_bn_ctx_secret())) {
+        GOSTerr(GOST_F_GOST_EC_SIGN_BATCH, ERR_R_MALLOC_FAILURE);
+        return 0;
+    }
+    BN_CTX_start(ctx);
+    r = BN_CTX_get(ctx);
+    s = BN_CTX_get(ctx);
+    if (!s || BN_bn2lebinpad(priv_key, bd, dlen) != dlen) {
+        GOSTerr(GOST_F_GOST_EC_SIGN_BATCH, ERR_R_MALLOC_FAILURE);
         goto err;
     }
-    ECDSA_SIG_set0(newsig, new_r, new_s);
-
-    ret = newsig;
+    for (i = 0; i < count; i += n) {
+        n = count - i < GOST_EC_KEYGEN_BATCH ? count - i : GOST_EC_KEYGEN_BATCH;
+        if (!ec_keygen_raw(curve, order, n, kb, xb, NULL, valid, ctx)) {
+            GOSTerr(GOST_F_GOST_EC_SIGN_BATCH, GOST_R_RNG_ERROR);
+            goto err;
+        }
+        for (j = 0; j < n; j++) {
+            /* s = (r*d + k*e) mod q, the rare r or s of zero start over */
+            if (!valid[j]
+                || !BN_lebin2bn(xb + j * dlen, dlen, r)
+                || !BN_nnmod(r, r, order, ctx)
+                || BN_is_zero(r)
+                || BN_bn2lebinpad(r, br, dlen) != dlen) {
+                sig[i + j] = gost_ec_sign(dgst[i + j], dlen, eckey);
+            } else {
+                gost_ec_curve_sign_scalar(curve, bs, bd, kb + j * dlen, br,
+                                          dgst[i + j]);
+                if (!BN_lebin2bn(bs, dlen, s))
+                    goto err;
+                if (BN_is_zero(s)) {
+                    sig[i + j] = gost_ec_sign(dgst[i + j], dlen, eckey);
+                } else {
+                    sig[i + j] = ECDSA_SIG_new();
+                    new_r = BN_dup(r);
+                    new_s = BN_dup(s);
+                    if (!sig[i + j] || !new_r || !new_s) {
+                        BN_free(new_r);
+                        BN_free(new_s);
+                        GOSTerr(GOST_F_GOST_EC_SIGN_BATCH,
+                                ERR_R_MALLOC_FAILURE);
+                        goto err;
+                    }
+                    ECDSA_SIG_set0(sig[i + j], new_r, new_s);
+                }
+            }
+            if (sig[i + j] == NULL)
+                goto err;
+        }
+    }
+    ok = 1;
  err:
+    OPENSSL_cleanse(kb, sizeof(kb));
+    OPENSSL_cleanse(bd, sizeof(bd));
+    OPENSSL_cleanse(bs, sizeof(bs));
     BN_CTX_end(ctx);
-    BN_CTX_free(ctx);
-    if (C)
-        EC_POINT_free(C);
-    if (md)
-        BN_free(md);
-    if (!ret && newsig) {
-        ECDSA_SIG_free(newsig);
+    gost_bn_ctx_put(ctx);
+    if (ok)
+        return 1;
+ fail:
+    for (i = 0; i < count; i++) {
+        ECDSA_SIG_free(sig[i]);
+        sig[i] = NULL;
     }
-    return ret;
+    return 0;
 }
 
 /*
- * Verifies gost ec signature
- *
+ * Verifies gost ec signature (sig_r, sig_s) using only ctx for
+ * temporaries
  */
-int gost_ec_verify(const unsigned char *dgst, int dgst_len,
-                   ECDSA_SIG *sig, EC_KEY *ec)
+static int ec_verify(const unsigned char *dgst, int dgst_len,
+                     const BIGNUM *sig_r, const BIGNUM *sig_s, EC_KEY *ec,
+                     BN_CTX *ctx)
 {
-    BN_CTX *ctx;
     const EC_GROUP *group = (ec) ? EC_KEY_get0_group(ec) : NULL;
-    BIGNUM *order;
-    BIGNUM *md = NULL, *e = NULL, *R = NULL, *v = NULL, *z1 = NULL, *z2 = NULL;
-    const BIGNUM *sig_s = NULL, *sig_r = NULL;
-    BIGNUM *X = NULL, *tmp = NULL;
-    EC_POINT *C = NULL;
+    const GOST_EC_CURVE *curve;
+    const BIGNUM *order;
+    BIGNUM *md, *e, *R, *v, *z1, *z2;
+    BIGNUM *X, *tmp;
     const EC_POINT *pub_key = NULL;
-    int ok = 0;
-
-    OPENSSL_assert(dgst != NULL && sig != NULL && group != NULL);
+    unsigned char br[64], bs[64], bz1[64], bz2[64];
+    unsigned char key[GOST_EC_VRESULT_KEY];
+    int ok = 0, cache;
 
-    if (!(ctx = BN_CTX_new())) {
-        GOSTerr(GOST_F_GOST_EC_VERIFY, ERR_R_MALLOC_FAILURE);
-        return 0;
-    }
+    OPENSSL_assert(dgst != NULL && sig_r != NULL && sig_s != NULL
+                   && group != NULL);
 
     BN_CTX_start(ctx);
-    order = BN_CTX_get(ctx);
+    md = BN_CTX_get(ctx);
     e = BN_CTX_get(ctx);
     z1 = BN_CTX_get(ctx);
     z2 = BN_CTX_get(ctx);
@@ -346,29 +2065,49 @@ int gost_ec_verify(const unsigned char *dgst, int dgst_len,
     X = BN_CTX_get(ctx);
     R = BN_CTX_get(ctx);
     v = BN_CTX_get(ctx);
-    if (!order || !e || !z1 || !z2 || !tmp || !X || !R || !v) {
+    if (!md || !e || !z1 || !z2 || !tmp || !X || !R || !v) {
         GOSTerr(GOST_F_GOST_EC_VERIFY, ERR_R_MALLOC_FAILURE);
         goto err;
     }
 
-    pub_key = EC_KEY_get0_public_key(ec);
-    if (!pub_key || !EC_GROUP_get_order(group, order, ctx)) {
+    pub_key = gost_ec_get0_public_key(ec);
+    order = EC_GROUP_get0_order(group);
+    if (!pub_key || !order) {
         GOSTerr(GOST_F_GOST_EC_VERIFY, ERR_R_INTERNAL_ERROR);
         goto err;
     }
 
-    ECDSA_SIG_get0(sig, &sig_r, &sig_s);
-
+    /* The result cache keys on the magnitudes, so check the sign too */
     if (BN_is_zero(sig_s) || BN_is_zero(sig_r) ||
+        BN_is_negative(sig_s) || BN_is_negative(sig_r) ||
         (BN_cmp(sig_s, order) >= 1) || (BN_cmp(sig_r, order) >= 1)) {
         GOSTerr(GOST_F_GOST_EC_VERIFY, GOST_R_SIGNATURE_PARTS_GREATER_THAN_Q);
         goto err;
 
     }
 
+    cache = vresults_enabled()
+        && vresults_key(key, group, pub_key, dgst, dgst_len, sig_r, sig_s,
+                        ctx);
+    if (cache && vresults_find(key)) {
+        ok = 1;
+        goto err;
+    }
+
     OPENSSL_assert(dgst_len == 32 || dgst_len == 64);
-    md = hashsum2bn(dgst, dgst_len);
-    if (!md || !BN_mod(e, md, order, ctx)) {
+    curve = gost_ec_curve(group);
+    if (curve != NULL && gost_ec_curve_size(curve) == (size_t)dgst_len
+        && BN_bn2lebinpad(sig_r, br, dgst_len) == dgst_len
+        && BN_bn2lebinpad(sig_s, bs, dgst_len) == dgst_len) {
+        gost_ec_curve_verify_scalars(curve, bz1, bz2, br, bs, dgst);
+        if (!BN_lebin2bn(bz1, dgst_len, z1)
+            || !BN_lebin2bn(bz2, dgst_len, z2)) {
+            GOSTerr(GOST_F_GOST_EC_VERIFY, ERR_R_INTERNAL_ERROR);
+            goto err;
+        }
+        goto mul;
+    }
+    if (!BN_lebin2bn(dgst, dgst_len, md) || !BN_mod(e, md, order, ctx)) {
         GOSTerr(GOST_F_GOST_EC_VERIFY, ERR_R_INTERNAL_ERROR);
         goto err;
     }
@@ -397,16 +2136,8 @@ int gost_ec_verify(const unsigned char *dgst, int dgst_len,
     fprintf(stderr, "\nz2: ");
     BN_print_fp(stderr, z2);
 #endif
-    C = EC_POINT_new(group);
-    if (!C) {
-        GOSTerr(GOST_F_GOST_EC_VERIFY, ERR_R_MALLOC_FAILURE);
-        goto err;
-    }
-    if (!EC_POINT_mul(group, C, z1, pub_key, z2, ctx)) {
-        GOSTerr(GOST_F_GOST_EC_VERIFY, ERR_R_EC_LIB);
-        goto err;
-    }
-    if (!EC_POINT_get_affine_coordinates(group, C, X, NULL, ctx)) {
+ mul:
+    if (!ec_point_mul(group, X, NULL, z1, pub_key, z2, ctx, 1)) {
         GOSTerr(GOST_F_GOST_EC_VERIFY, ERR_R_EC_LIB);
         goto err;
     }
@@ -425,39 +2156,255 @@ int gost_ec_verify(const unsigned char *dgst, int dgst_len,
         GOSTerr(GOST_F_GOST_EC_VERIFY, GOST_R_SIGNATURE_MISMATCH);
     } else {
         ok = 1;
+        if (cache)
+            vresults_add(key);
     }
  err:
-    if (C)
-        EC_POINT_free(C);
     BN_CTX_end(ctx);
-    BN_CTX_free(ctx);
-    if (md)
-        BN_free(md);
     return ok;
 }
 
 /*
- * Computes GOST R 34.10-2001 public key
- * or GOST R 34.10-2012 public key
+ * Verifies gost ec signature
  *
  */
-int gost_ec_compute_public(EC_KEY *ec)
+int gost_ec_verify(const unsigned char *dgst, int dgst_len,
+                   ECDSA_SIG *sig, EC_KEY *ec)
+{
+    const BIGNUM *sig_s = NULL, *sig_r = NULL;
+    BN_CTX *ctx;
+    int ok;
+
+    OPENSSL_assert(sig != NULL);
+
+    if (!(ctx = gost_bn_ctx_get())) {
+        GOSTerr(GOST_F_GOST_EC_VERIFY, ERR_R_MALLOC_FAILURE);
+        return 0;
+    }
+    ECDSA_SIG_get0(sig, &sig_r, &sig_s);
+    ok = ec_verify(dgst, dgst_len, sig_r, sig_s, ec, ctx);
+    gost_bn_ctx_put(ctx);
+    return ok;
+}
+
+/*
+ * Verifies gost ec signature packed according to CryptoPro rules
+ * without building an ECDSA_SIG
+ */
+int gost_ec_verify_cp(const unsigned char *dgst, int dgst_len,
+                      const unsigned char *sigbuf, size_t siglen, EC_KEY *ec)
+{
+    BIGNUM *r, *s;
+    BN_CTX *ctx;
+    int ok = 0;
+
+    if (!(ctx = gost_bn_ctx_get())) {
+        GOSTerr(GOST_F_GOST_EC_VERIFY, ERR_R_MALLOC_FAILURE);
+        return 0;
+    }
+    BN_CTX_start(ctx);
+    s = BN_CTX_get(ctx);
+    r = BN_CTX_get(ctx);
+    if (!r || !BN_bin2bn(sigbuf, siglen / 2, s)
+        || !BN_bin2bn(sigbuf + siglen / 2, siglen / 2, r)) {
+        GOSTerr(GOST_F_GOST_EC_VERIFY, ERR_R_MALLOC_FAILURE);
+        goto err;
+    }
+    ok = ec_verify(dgst, dgst_len, r, s, ec, ctx);
+ err:
+    BN_CTX_end(ctx);
+    gost_bn_ctx_put(ctx);
+    return ok;
+}
+
+/*
+ * Verifies count signatures on the same curve together. results[i] is
+ * set to 1 if signature sig[i] of digest dgst[i] is valid for key ec[i]
+ * and to 0 otherwise. The digests are inverted at once by Montgomery's
+ * trick, and the points are converted to affine form with one field
+ * inversion. Returns 1 if all signatures are valid.
+ */
+int gost_ec_verify_batch(const unsigned char *const *dgst, int dgst_len,
+                         ECDSA_SIG *const *sig, EC_KEY *const *ec,
+                         size_t count, int *results)
+{
+    const EC_GROUP *group;
+    const GOST_EC_CURVE *curve;
+    const BIGNUM *order, *sig_r, *sig_s;
+    const EC_POINT *pub_key;
+    BN_CTX *ctx = NULL;
+    BIGNUM **e = NULL, **pre = NULL, *md, *inv, *v, *x, *qx, *qy;
+    GOST_EC_VCACHE_ENTRY **entries = NULL;
+    const gost_limb **tables = NULL;
+    unsigned char *buf = NULL, *bn, *bm, *bqx, *bqy, *bx;
+    size_t *idx = NULL, i, j, valid = 0;
+    int len, ok = 0, all = 1;
+
+    if (count == 0)
+        return 1;
+    memset(results, 0, count * sizeof(*results));
+    group = EC_KEY_get0_group(ec[0]);
+    curve = group ? gost_ec_curve(group) : NULL;
+    for (i = 1; curve && i < count; i++) {
+        const EC_GROUP *g = EC_KEY_get0_group(ec[i]);
+
+        if (!g || EC_GROUP_get_curve_name(g) != EC_GROUP_get_curve_name(group))
+            curve = NULL;
+    }
+    if (curve == NULL) {
+        /* No dedicated arithmetic or mixed curves */
+        for (i = 0; i < count; i++) {
+            results[i] = gost_ec_verify(dgst[i], dgst_len, sig[i], ec[i]) == 1;
+            all &= results[i];
+        }
+        return all;
+    }
+
+    len = gost_ec_curve_size(curve);
+    order = EC_GROUP_get0_order(group);
+    if (!(ctx = gost_bn_ctx_get())
+        || !(e = OPENSSL_zalloc(count * sizeof(*e)))
+        || !(pre = OPENSSL_zalloc(count * sizeof(*pre)))
+        || !(entries = OPENSSL_zalloc(count * sizeof(*entries)))
+        || !(tables = OPENSSL_zalloc(count * sizeof(*tables)))
+        || !(idx = OPENSSL_malloc(count * sizeof(*idx)))
+        || !(buf = OPENSSL_zalloc(count * len * 5))) {
+        GOSTerr(GOST_F_GOST_EC_VERIFY_BATCH, ERR_R_MALLOC_FAILURE);
+        goto err;
+    }
+    bn = buf;
+    bm = bn + count * len;
+    bqx = bm + count * len;
+    bqy = bqx + count * len;
+    bx = bqy + count * len;
+
+    BN_CTX_start(ctx);
+    md = BN_CTX_get(ctx);
+    inv = BN_CTX_get(ctx);
+    v = BN_CTX_get(ctx);
+    x = BN_CTX_get(ctx);
+    qx = BN_CTX_get(ctx);
+    qy = BN_CTX_get(ctx);
+    if (!qy) {
+        GOSTerr(GOST_F_GOST_EC_VERIFY_BATCH, ERR_R_MALLOC_FAILURE);
+        goto end;
+    }
+
+    /* Digests mod q and their running products for valid looking items */
+    OPENSSL_assert(dgst_len == 32 || dgst_len == 64);
+    for (i = 0; i < count; i++) {
+        ECDSA_SIG_get0(sig[i], &sig_r, &sig_s);
+        if (BN_is_zero(sig_s) || BN_is_zero(sig_r)
+            || BN_is_negative(sig_s) || BN_is_negative(sig_r)
+            || BN_cmp(sig_s, order) >= 1 || BN_cmp(sig_r, order) >= 1
+            || !(pub_key = gost_ec_get0_public_key(ec[i])))
+            continue;
+        e[valid] = BN_new();
+        pre[valid] = BN_new();
+        if (!e[valid] || !pre[valid]
+            || !BN_lebin2bn(dgst[i], dgst_len, md)
+            || !BN_mod(e[valid], md, order, ctx)
+            || (BN_is_zero(e[valid]) && !BN_one(e[valid]))
+            || !(valid == 0 ? BN_copy(pre[valid], e[valid]) != NULL
+                 : BN_mod_mul(pre[valid], pre[valid - 1], e[valid], order,
+                              ctx))
+            || !EC_POINT_get_affine_coordinates(group, pub_key, qx, qy, ctx)
+            || BN_bn2lebinpad(qx, bqx + valid * len, len) != len
+            || BN_bn2lebinpad(qy, bqy + valid * len, len) != len) {
+            GOSTerr(GOST_F_GOST_EC_VERIFY_BATCH, ERR_R_INTERNAL_ERROR);
+            goto end;
+        }
+        idx[valid++] = i;
+    }
+
+    /* z1 = s/e, z2 = -r/e with a single inversion */
+    if (valid && !BN_mod_inverse(inv, pre[valid - 1], order, ctx)) {
+        GOSTerr(GOST_F_GOST_EC_VERIFY_BATCH, ERR_R_INTERNAL_ERROR);
+        goto end;
+    }
+    for (j = valid; j-- > 0;) {
+        ECDSA_SIG_get0(sig[idx[j]], &sig_r, &sig_s);
+        if ((j > 0 && !BN_mod_mul(v, inv, pre[j - 1], order, ctx))
+            || (j == 0 && !BN_copy(v, inv))
+            || !BN_mod_mul(inv, inv, e[j], order, ctx)
+            || !BN_mod_mul(x, sig_s, v, order, ctx)
+            || BN_bn2lebinpad(x, bn + j * len, len) != len
+            || !BN_sub(x, order, sig_r)
+            || !BN_mod_mul(x, x, v, order, ctx)
+            || BN_bn2lebinpad(x, bm + j * len, len) != len) {
+            GOSTerr(GOST_F_GOST_EC_VERIFY_BATCH, ERR_R_INTERNAL_ERROR);
+            goto end;
+        }
+        entries[j] = vcache_get(curve, bqx + j * len, bqy + j * len);
+        tables[j] = entries[j] ? entries[j]->comb : NULL;
+    }
+
+    if (!gost_ec_curve_mul_batch(curve, valid, bx, NULL, bn, bqx, bqy,
+                                 tables, bm, results)) {
+        GOSTerr(GOST_F_GOST_EC_VERIFY_BATCH, ERR_R_MALLOC_FAILURE);
+        goto end;
+    }
+
+    /* Results come for the valid items, spread them back */
+    for (j = valid; j-- > 0;) {
+        int res = results[j];
+
+        results[j] = 0;
+        ECDSA_SIG_get0(sig[idx[j]], &sig_r, &sig_s);
+        if (res && (!BN_lebin2bn(bx + j * len, len, x)
+                    || !BN_mod(x, x, order, ctx))) {
+            GOSTerr(GOST_F_GOST_EC_VERIFY_BATCH, ERR_R_BN_LIB);
+            goto end;
+        }
+        results[idx[j]] = res && BN_cmp(x, sig_r) == 0;
+    }
+    ok = 1;
+ end:
+    BN_CTX_end(ctx);
+ err:
+    if (!ok)
+        memset(results, 0, count * sizeof(*results));
+    for (i = 0; i < count; i++) {
+        all &= results[i];
+        if (entries && entries[i])
+            vcache_put(entries[i]);
+        if (e)
+            BN_free(e[i]);
+        if (pre)
+            BN_free(pre[i]);
+    }
+    gost_bn_ctx_put(ctx);
+    OPENSSL_free(e);
+    OPENSSL_free(pre);
+    OPENSSL_free(entries);
+    OPENSSL_free(tables);
+    OPENSSL_free(idx);
+    OPENSSL_free(buf);
+    return ok && all;
+}
+
+/*
+ * Computes the public point of ec from its private key into a new point,
+ * leaving ec itself untouched
+ */
+static EC_POINT *ec_public_point(const EC_KEY *ec)
 {
     const EC_GROUP *group = (ec) ? EC_KEY_get0_group(ec) : NULL;
     EC_POINT *pub_key = NULL;
     const BIGNUM *priv_key = NULL;
+    BIGNUM *X = NULL, *Y = NULL;
     BN_CTX *ctx = NULL;
     int ok = 0;
 
     if (!group) {
         GOSTerr(GOST_F_GOST_EC_COMPUTE_PUBLIC, GOST_R_KEY_IS_NOT_INITIALIZED);
-        return 0;
+        return NULL;
     }
 
-    ctx = BN_CTX_new();
+    ctx = gost_bn_ctx_secret();
     if (!ctx) {
         GOSTerr(GOST_F_GOST_EC_COMPUTE_PUBLIC, ERR_R_MALLOC_FAILURE);
-        return 0;
+        return NULL;
     }
 
     BN_CTX_start(ctx);
@@ -473,23 +2420,95 @@ int gost_ec_compute_public(EC_KEY *ec)
         goto err;
     }
 
-    if (!EC_POINT_mul(group, pub_key, priv_key, NULL, NULL, ctx)) {
-        GOSTerr(GOST_F_GOST_EC_COMPUTE_PUBLIC, ERR_R_EC_LIB);
+    X = BN_CTX_get(ctx);
+    Y = BN_CTX_get(ctx);
+    if (!X || !Y) {
+        GOSTerr(GOST_F_GOST_EC_COMPUTE_PUBLIC, ERR_R_MALLOC_FAILURE);
         goto err;
     }
-    if (!EC_KEY_set_public_key(ec, pub_key)) {
+
+    if (!gost_ec_point_mul(group, X, Y, priv_key, NULL, NULL, ctx)
+        || !EC_POINT_set_affine_coordinates(group, pub_key, X, Y, ctx)) {
         GOSTerr(GOST_F_GOST_EC_COMPUTE_PUBLIC, ERR_R_EC_LIB);
         goto err;
     }
     ok = 1;
  err:
-    if (pub_key)
+    if (!ok) {
         EC_POINT_free(pub_key);
+        pub_key = NULL;
+    }
     BN_CTX_end(ctx);
-    BN_CTX_free(ctx);
+    gost_bn_ctx_put(ctx);
+    return pub_key;
+}
+
+/*
+ * Computes GOST R 34.10-2001 public key
+ * or GOST R 34.10-2012 public key
+ *
+ */
+int gost_ec_compute_public(EC_KEY *ec)
+{
+    EC_POINT *pub_key = ec_public_point(ec);
+    int ok = pub_key != NULL && EC_KEY_set_public_key(ec, pub_key);
+
+    if (pub_key && !ok)
+        GOSTerr(GOST_F_GOST_EC_COMPUTE_PUBLIC, ERR_R_EC_LIB);
+    EC_POINT_free(pub_key);
     return ok;
 }
 
+/*
+ * Private keys are imported without the public key, it is computed when
+ * it is first needed and set under this lock. The lock is kept for the life
+ * of the process, its CRYPTO_ONCE can not run again if the engine is
+ * bound anew.
+ */
+static CRYPTO_RWLOCK *gost_ec_public_lock = NULL;
+static CRYPTO_ONCE gost_ec_public_once = CRYPTO_ONCE_STATIC_INIT;
+
+static void gost_ec_public_init(void)
+{
+    gost_ec_public_lock = CRYPTO_THREAD_lock_new();
+}
+
+/*
+ * Returns public key of ec, computing it from the private key if it is
+ * not set yet. NULL if there is neither.
+ */
+const EC_POINT *gost_ec_get0_public_key(const EC_KEY *ec)
+{
+    const EC_POINT *pub_key;
+    EC_POINT *point;
+
+    /* Without the lock the key is never modified */
+    if (!CRYPTO_THREAD_run_once(&gost_ec_public_once, gost_ec_public_init)
+        || gost_ec_public_lock == NULL)
+        return EC_KEY_get0_public_key(ec);
+    if (!CRYPTO_THREAD_read_lock(gost_ec_public_lock))
+        return NULL;
+    pub_key = EC_KEY_get0_public_key(ec);
+    CRYPTO_THREAD_unlock(gost_ec_public_lock);
+    if (pub_key != NULL || EC_KEY_get0_private_key(ec) == NULL)
+        return pub_key;
+
+    /* The scalar multiplication runs unlocked, only setting the point waits */
+    if ((point = ec_public_point(ec)) == NULL)
+        return NULL;
+    if (!CRYPTO_THREAD_write_lock(gost_ec_public_lock)) {
+        EC_POINT_free(point);
+        return NULL;
+    }
+    if (EC_KEY_get0_public_key(ec) == NULL
+        && !EC_KEY_set_public_key((EC_KEY *)ec, point))
+        GOSTerr(GOST_F_GOST_EC_COMPUTE_PUBLIC, ERR_R_EC_LIB);
+    pub_key = EC_KEY_get0_public_key(ec);
+    CRYPTO_THREAD_unlock(gost_ec_public_lock);
+    EC_POINT_free(point);
+    return pub_key;
+}
+
 /*
  *
  * Generates GOST R 34.10-2001
@@ -541,3 +2560,139 @@ int gost_ec_keygen(EC_KEY *ec)
 
     return (ok) ? gost_ec_compute_public(ec) : 0;
 }
+
+/*
+ * Generates key pairs into count keys with the same parameters. Curves
+ * with dedicated arithmetic get the public keys of a batch converted to
+ * affine form with one field inversion.
+ */
+int gost_ec_keygen_batch(EC_KEY *const *keys, size_t count)
+{
+    unsigned char kb[GOST_EC_KEYGEN_BATCH * 8 * GOST_EC_MAX_LIMBS],
+        xb[GOST_EC_KEYGEN_BATCH * 8 * GOST_EC_MAX_LIMBS],
+        yb[GOST_EC_KEYGEN_BATCH * 8 * GOST_EC_MAX_LIMBS];
+    int valid[GOST_EC_KEYGEN_BATCH];
+    const EC_GROUP *group = count ? EC_KEY_get0_group(keys[0]) : NULL;
+    const GOST_EC_CURVE *curve;
+    const BIGNUM *order;
+    BIGNUM *d, *x, *y;
+    EC_POINT *pub_key = NULL;
+    BN_CTX *ctx;
+    size_t i, j, n, len;
+    int ok = 0;
+
+    if (count == 0)
+        return 1;
+    for (i = 0; i < count; i++) {
+        const EC_GROUP *g = EC_KEY_get0_group(keys[i]);
+
+        if (group == NULL || g == NULL
+            || EC_GROUP_get_curve_name(g) != EC_GROUP_get_curve_name(group)) {
+            GOSTerr(GOST_F_GOST_EC_KEYGEN, ERR_R_PASSED_INVALID_ARGUMENT);
+            return 0;
+        }
+    }
+    curve = gost_ec_curve(group);
+    order = EC_GROUP_get0_order(group);
+    if (curve == NULL || order == NULL) {
+        for (i = 0; i < count; i++) {
+            if (!gost_ec_keygen(keys[i]))
+                return 0;
+        }
+        return 1;
+    }
+
+    if (!(ctx = gost_bn_ctx_secret())) {
+        GOSTerr(GOST_F_GOST_EC_KEYGEN, ERR_R_MALLOC_FAILURE);
+        return 0;
+    }
+    BN_CTX_start(ctx);
+    d = BN_CTX_get(ctx);
+    x = BN_CTX_get(ctx);
+    y = BN_CTX_get(ctx);
+    if (!y || !(pub_key = EC_POINT_new(group))) {
+        GOSTerr(GOST_F_GOST_EC_KEYGEN, ERR_R_MALLOC_FAILURE);
+        goto err;
+    }
+    len = gost_ec_curve_size(curve);
+    for (i = 0; i < count; i += n) {
+        n = count - i < GOST_EC_KEYGEN_BATCH ? count - i : GOST_EC_KEYGEN_BATCH;
+        if (!ec_keygen_raw(curve, order, n, kb, xb, yb, valid, ctx)) {
+            GOSTerr(GOST_F_GOST_EC_KEYGEN, GOST_R_RNG_ERROR);
+            goto err;
+        }
+        for (j = 0; j < n; j++) {
+            EC_KEY *ec = keys[i + j];
+
+            /* k*G can not be infinity for k below the order */
+            if (!valid[j]
+                || !BN_lebin2bn(kb + j * len, len, d)
+                || !BN_lebin2bn(xb + j * len, len, x)
+                || !BN_lebin2bn(yb + j * len, len, y)
+                || !EC_POINT_set_affine_coordinates(group, pub_key, x, y, ctx)
+                || !EC_KEY_set_private_key(ec, d)
+                || !EC_KEY_set_public_key(ec, pub_key)) {
+                GOSTerr(GOST_F_GOST_EC_KEYGEN, ERR_R_INTERNAL_ERROR);
+                goto err;
+            }
+        }
+    }
+    ok = 1;
+ err:
+    OPENSSL_cleanse(kb, sizeof(kb));
+    EC_POINT_free(pub_key);
+    if (y)
+        BN_clear(d);
+    BN_CTX_end(ctx);
+    gost_bn_ctx_put(ctx);
+    return ok;
+}
+
+/*
+ * Generates a single use key pair, taking it from the ephemeral key pool
+ * when there is one for the curve
+ */
+int gost_ec_keygen_ephemeral(EC_KEY *ec)
+{
+    const EC_GROUP *group = (ec) ? EC_KEY_get0_group(ec) : NULL;
+    EC_POINT *pub_key = NULL;
+    BIGNUM *d, *x, *y;
+    BN_CTX *ctx;
+    int ok = 0;
+
+    if (!group) {
+        GOSTerr(GOST_F_GOST_EC_KEYGEN, ERR_R_INTERNAL_ERROR);
+        return 0;
+    }
+    if (!(ctx = gost_bn_ctx_secret())) {
+        GOSTerr(GOST_F_GOST_EC_KEYGEN, ERR_R_MALLOC_FAILURE);
+        return 0;
+    }
+    BN_CTX_start(ctx);
+    d = BN_CTX_get(ctx);
+    x = BN_CTX_get(ctx);
+    y = BN_CTX_get(ctx);
+    if (!y || !pool_take(GOST_EC_POOL_EPHEMERAL, group, d, x, y)) {
+        BN_CTX_end(ctx);
+        gost_bn_ctx_put(ctx);
+        return gost_ec_keygen(ec);
+    }
+
+    if (!(pub_key = EC_POINT_new(group))) {
+        GOSTerr(GOST_F_GOST_EC_KEYGEN, ERR_R_MALLOC_FAILURE);
+        goto err;
+    }
+    if (!EC_POINT_set_affine_coordinates(group, pub_key, x, y, ctx)
+        || !EC_KEY_set_private_key(ec, d)
+        || !EC_KEY_set_public_key(ec, pub_key)) {
+        GOSTerr(GOST_F_GOST_EC_KEYGEN, ERR_R_EC_LIB);
+        goto err;
+    }
+    ok = 1;
+ err:
+    EC_POINT_free(pub_key);
+    BN_clear(d);
+    BN_CTX_end(ctx);
+    gost_bn_ctx_put(ctx);
+    return ok;
+}
@@ -138,6 +138,12 @@ static int gost_engine_destroy(ENGINE* e) {
     cipher_gost_grasshopper_destroy();
 
     gost_param_free();
+    gost_ec_groups_free();
+    gost_ec_verify_cache_free();
+    gost_ec_verify_results_free();
+    gost_ec_pools_free();
+    gost_bn_ctx_free();
+    gost_pubkey_cache_free();
 
     pmeth_GostR3410_2001 = NULL;
     pmeth_Gost28147_MAC = NULL;
@@ -0,0 +1,41 @@
+#ifndef GOST_ENGINE_H
+# define GOST_ENGINE_H
+/**********************************************************************
+ *                        gost_engine.h                               *
+ *       This file is distributed under the same license as OpenSSL   *
+ *                                                                    *
+ *         Engine controls available to applications                  *
+ **********************************************************************/
+# include <stddef.h>
+# include <openssl/engine.h>
+
+# ifdef  __cplusplus
+extern "C" {
+# endif
+
+/*
+ * PBKDF2 with HMAC-Streebog (R 50.1.111-2016), for example to derive the
+ * key of a PKCS#8 or PKCS#12 container:
+ *
+ *     ENGINE_ctrl(e, GOST_CTRL_PBKDF2, 0, &params, NULL)
+ *
+ * returns 1 with params.outlen bytes written to params.out.
+ */
+# define GOST_CTRL_PBKDF2 (ENGINE_CMD_BASE+0x105)
+
+/* Argument of GOST_CTRL_PBKDF2 */
+typedef struct gost_pbkdf2_params {
+    unsigned int digest_bits;           /* 256 or 512 */
+    const unsigned char *pass;
+    size_t passlen;
+    const unsigned char *salt;
+    size_t saltlen;
+    unsigned long iter;
+    unsigned char *out;
+    size_t outlen;
+} GOST_PBKDF2_PARAMS;
+
+# ifdef  __cplusplus
+}
+# endif
+#endif
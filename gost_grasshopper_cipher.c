@@ -119,21 +119,33 @@ static const unsigned char ACPKM_D_2018[] = {
     0x98, 0x99, 0x9a, 0x9b, 0x9c, 0x9d, 0x9e, 0x9f, /* 256 bit */
 };
 
-static void acpkm_next(gost_grasshopper_cipher_ctx * c)
+/*
+ * ACPKM key meshing: the next key is D encrypted under the current one.
+ * Works on encryption round keys only, for users without a cipher
+ * context such as OMAC-ACPKM.
+ */
+void gost_grasshopper_acpkm_key(grasshopper_round_keys_t * subkeys,
+                                uint8_t *newkey, grasshopper_w128_t * buffer)
 {
-    unsigned char newkey[GRASSHOPPER_KEY_SIZE];
     const int J = GRASSHOPPER_KEY_SIZE / GRASSHOPPER_BLOCK_SIZE;
     int n;
 
     for (n = 0; n < J; n++) {
         const unsigned char *D_n = &ACPKM_D_2018[n * GRASSHOPPER_BLOCK_SIZE];
 
-        grasshopper_encrypt_block(&c->encrypt_round_keys,
+        grasshopper_encrypt_block(subkeys,
                                   (grasshopper_w128_t *) D_n,
                                   (grasshopper_w128_t *) & newkey[n *
                                                                   GRASSHOPPER_BLOCK_SIZE],
-                                  &c->buffer);
+                                  buffer);
     }
+}
+
+static void acpkm_next(gost_grasshopper_cipher_ctx * c)
+{
+    unsigned char newkey[GRASSHOPPER_KEY_SIZE];
+
+    gost_grasshopper_acpkm_key(&c->encrypt_round_keys, newkey, &c->buffer);
     gost_grasshopper_cipher_key(c, newkey);
 }
 
@@ -196,6 +208,7 @@ gost_grasshopper_cipher_destroy_ctr(gost_grasshopper_cipher_ctx * c)
         (gost_grasshopper_cipher_ctx_ctr *) c;
 
     grasshopper_zero128(&ctx->partial_buffer);
+    OPENSSL_cleanse(&ctx->tree, sizeof(ctx->tree));
 }
 
 int gost_grasshopper_cipher_init(EVP_CIPHER_CTX *ctx,
@@ -276,6 +289,8 @@ GRASSHOPPER_INLINE int gost_grasshopper_cipher_init_ctr(EVP_CIPHER_CTX *ctx, con
     EVP_CIPHER_CTX_set_num(ctx, 0);
 
     grasshopper_zero128(&c->partial_buffer);
+    if (key)
+        c->tree.levels = 0;
 
     return gost_grasshopper_cipher_init(ctx, key, iv, enc);
 }
@@ -291,6 +306,8 @@ GRASSHOPPER_INLINE int gost_grasshopper_cipher_init_ctracpkm(EVP_CIPHER_CTX
     c->c.type = GRASSHOPPER_CIPHER_CTRACPKM;
     EVP_CIPHER_CTX_set_num(ctx, 0);
     c->section_size = 4096;
+    if (key)
+        c->tree.levels = 0;
 
     return gost_grasshopper_cipher_init(ctx, key, iv, enc);
 }
@@ -770,7 +787,7 @@ int gost_grasshopper_cipher_ctl(EVP_CIPHER_CTX *ctx, int type, int arg,
 
           unsigned char adjusted_iv[16];
           unsigned char seq[8];
-          int j, carry;
+          int j, carry, ret;
           if (mode != EVP_CIPH_CTR_MODE)
             return -1;
 
@@ -794,8 +811,10 @@ int gost_grasshopper_cipher_ctl(EVP_CIPHER_CTX *ctx, int type, int arg,
               }
             }
           }
-          if (gost_tlstree(NID_grasshopper_cbc, c->master_key.k.b, newkey,
-                (const unsigned char *)seq) > 0) {
+          ret = gost_tlstree_cached(&ctr_ctx->tree, NID_grasshopper_cbc,
+                                    c->master_key.k.b, newkey,
+                                    (const unsigned char *)seq);
+          if (ret > 0) {
             memset(adjusted_iv, 0, 16);
             memcpy(adjusted_iv, EVP_CIPHER_CTX_original_iv(ctx), 8);
             for(j=7,carry=0; j>=0; j--)
@@ -807,7 +826,10 @@ int gost_grasshopper_cipher_ctl(EVP_CIPHER_CTX *ctx, int type, int arg,
             EVP_CIPHER_CTX_set_num(ctx, 0);
             memcpy(EVP_CIPHER_CTX_iv_noconst(ctx), adjusted_iv, 16);
 
-            gost_grasshopper_cipher_key(c, newkey);
+            /* ACPKM sections may have meshed the key since it was set */
+            if (ret == 1 || CRYPTO_memcmp(c->key.k.b, newkey, 32) != 0)
+                gost_grasshopper_cipher_key(c, newkey);
+            OPENSSL_cleanse(newkey, sizeof(newkey));
             return 1;
           }
         }
@@ -11,6 +11,7 @@ extern "C" {
 #endif
 
 #include "gost_grasshopper_defines.h"
+#include "gost_lcl.h"
 
 #include <openssl/evp.h>
 
@@ -35,6 +36,7 @@ typedef struct {
     grasshopper_w128_t partial_buffer;
     unsigned int section_size;  /* After how much bytes mesh the key,
 				   if 0 never mesh and work like plain ctr. */
+    GOST_TLSTREE_CTX tree;
 } gost_grasshopper_cipher_ctx_ctr;
 
 typedef int (* grasshopper_init_cipher_func)(EVP_CIPHER_CTX* ctx, const unsigned char* key, const unsigned char* iv,
@@ -47,6 +49,8 @@ typedef void (* grasshopper_destroy_cipher_func)(gost_grasshopper_cipher_ctx* c)
 
 void gost_grasshopper_cipher_key(gost_grasshopper_cipher_ctx* c, const uint8_t* k);
 
+void gost_grasshopper_acpkm_key(grasshopper_round_keys_t* subkeys, uint8_t* newkey, grasshopper_w128_t* buffer);
+
 void gost_grasshopper_cipher_destroy(gost_grasshopper_cipher_ctx* c);
 
 int gost_grasshopper_cipher_init_ecb(EVP_CIPHER_CTX* ctx, const unsigned char* key, const unsigned char* iv, int enc);
@@ -5,9 +5,9 @@
 #endif
 #include <string.h>
 #include <openssl/evp.h>
-#include <openssl/hmac.h>
 
 #include "gost_lcl.h"
+#include "gosthash2012.h"
 #include "e_gost_err.h"
 
 int omac_imit_ctrl(EVP_MD_CTX *ctx, int type, int arg, void *ptr);
@@ -176,17 +176,11 @@ int gost_kdftree2012_256(unsigned char *keyout, size_t keyout_len,
     int iters, i = 0;
     unsigned char zero = 0;
     unsigned char *ptr = keyout;
-    HMAC_CTX *ctx = NULL;
+    gost2012_hmac_ctx ctx;
     unsigned char *len_ptr = NULL;
     uint32_t len_repr = htonl(keyout_len * 8);
     size_t len_repr_len = 4;
 
-    ctx = HMAC_CTX_new();
-    if (ctx == NULL) {
-        GOSTerr(GOST_F_GOST_KDFTREE2012_256, ERR_R_MALLOC_FAILURE);
-        return 0;
-    }
-
     if ((keyout_len == 0) || (keyout_len % 32 != 0)) {
         GOSTerr(GOST_F_GOST_KDFTREE2012_256, ERR_R_INTERNAL_ERROR);
         return 0;
@@ -199,79 +193,96 @@ int gost_kdftree2012_256(unsigned char *keyout, size_t keyout_len,
         len_repr_len--;
     }
 
+    /* Key pads are hashed once and reused for every output block */
+    gost2012_hmac_init(&ctx, 256, key, keylen);
     for (i = 1; i <= iters; i++) {
         uint32_t iter_net = htonl(i);
         unsigned char *rep_ptr =
             ((unsigned char *)&iter_net) + (4 - representation);
 
-        if (HMAC_Init_ex(ctx, key, keylen,
-                         EVP_get_digestbynid(NID_id_GostR3411_2012_256),
-                         NULL) <= 0
-            || HMAC_Update(ctx, rep_ptr, representation) <= 0
-            || HMAC_Update(ctx, label, label_len) <= 0
-            || HMAC_Update(ctx, &zero, 1) <= 0
-            || HMAC_Update(ctx, seed, seed_len) <= 0
-            || HMAC_Update(ctx, len_ptr, len_repr_len) <= 0
-            || HMAC_Final(ctx, ptr, NULL) <= 0) {
-            GOSTerr(GOST_F_GOST_KDFTREE2012_256, ERR_R_INTERNAL_ERROR);
-            HMAC_CTX_free(ctx);
-            return 0;
-        }
-
-        HMAC_CTX_reset(ctx);
+        gost2012_hmac_start(&ctx);
+        gost2012_hmac_update(&ctx, rep_ptr, representation);
+        gost2012_hmac_update(&ctx, label, label_len);
+        gost2012_hmac_update(&ctx, &zero, 1);
+        gost2012_hmac_update(&ctx, seed, seed_len);
+        gost2012_hmac_update(&ctx, len_ptr, len_repr_len);
+        gost2012_hmac_final(&ctx, ptr);
         ptr += 32;
     }
-
-    HMAC_CTX_free(ctx);
+    gost2012_hmac_cleanup(&ctx);
 
     return 1;
 }
 
-int gost_tlstree(int cipher_nid, const unsigned char *in, unsigned char *out,
-                 const unsigned char *tlsseq)
+/*
+ * Derives the TLSTREE key for tlsseq, recomputing only the levels whose
+ * masked sequence number differs from the previous call on tree. Each
+ * level is a KDF_TREE run, and level 1 only changes every 2^32 records
+ * or less often, so most records only recompute level 3 or nothing.
+ * Returns 2 if outkey is the same as for the previous record, 1 if it
+ * is new and 0 on error. tree->levels must be 0 for a new root key.
+ */
+int gost_tlstree_cached(GOST_TLSTREE_CTX *tree, int cipher_nid,
+                        const unsigned char *in, unsigned char *out,
+                        const unsigned char *tlsseq)
 {
 #ifndef L_ENDIAN
-    uint64_t gh_c1 = 0xFFFFFFFF00000000, gh_c2 = 0xFFFFFFFFFFF80000,
-        gh_c3 = 0xFFFFFFFFFFFFFFC0;
-    uint64_t mg_c1 = 0xFFFFFFC000000000, mg_c2 = 0xFFFFFFFFFE000000,
-        mg_c3 = 0xFFFFFFFFFFFFF000;
+    static const uint64_t gh_c[3] = { 0xFFFFFFFF00000000, 0xFFFFFFFFFFF80000,
+        0xFFFFFFFFFFFFFFC0 };
+    static const uint64_t mg_c[3] = { 0xFFFFFFC000000000, 0xFFFFFFFFFE000000,
+        0xFFFFFFFFFFFFF000 };
 #else
-    uint64_t gh_c1 = 0x00000000FFFFFFFF, gh_c2 = 0x0000F8FFFFFFFFFF,
-        gh_c3 = 0xC0FFFFFFFFFFFFFF;
-    uint64_t mg_c1 = 0x00000000C0FFFFFF, mg_c2 = 0x000000FEFFFFFFFF,
-        mg_c3 = 0x00F0FFFFFFFFFFFF;
+    static const uint64_t gh_c[3] = { 0x00000000FFFFFFFF, 0x0000F8FFFFFFFFFF,
+        0xC0FFFFFFFFFFFFFF };
+    static const uint64_t mg_c[3] = { 0x00000000C0FFFFFF, 0x000000FEFFFFFFFF,
+        0x00F0FFFFFFFFFFFF };
 #endif
-    uint64_t c1, c2, c3;
-    uint64_t seed1, seed2, seed3;
-    uint64_t seq;
-    unsigned char ko1[32], ko2[32];
+    static const char *const labels[3] = { "level1", "level2", "level3" };
+    const uint64_t *c;
+    uint64_t seq, seed;
+    int i, ret = 2;
 
     switch (cipher_nid) {
     case NID_magma_cbc:
-        c1 = mg_c1;
-        c2 = mg_c2;
-        c3 = mg_c3;
+        c = mg_c;
         break;
     case NID_grasshopper_cbc:
-        c1 = gh_c1;
-        c2 = gh_c2;
-        c3 = gh_c3;
+        c = gh_c;
         break;
     default:
         return 0;
     }
     memcpy(&seq, tlsseq, 8);
-    seed1 = seq & c1;
-    seed2 = seq & c2;
-    seed3 = seq & c3;
-
-    if (gost_kdftree2012_256(ko1, 32, in, 32, (const unsigned char *)"level1", 6,
-                         (const unsigned char *)&seed1, 8, 1) <= 0
-			  || gost_kdftree2012_256(ko2, 32, ko1, 32, (const unsigned char *)"level2", 6,
-                         (const unsigned char *)&seed2, 8, 1) <= 0
-        || gost_kdftree2012_256(out, 32, ko2, 32, (const unsigned char *)"level3", 6,
-                         (const unsigned char *)&seed3, 8, 1) <= 0)
-			return 0;
 
-    return 1;
+    for (i = 0; i < 3; i++) {
+        seed = seq & c[i];
+        if (i < tree->levels && memcmp(tree->seed[i], &seed, 8) == 0)
+            continue;
+        if (gost_kdftree2012_256(tree->key[i], 32,
+                                 i ? tree->key[i - 1] : in, 32,
+                                 (const unsigned char *)labels[i], 6,
+                                 (const unsigned char *)&seed, 8, 1) <= 0) {
+            tree->levels = 0;
+            return 0;
+        }
+        memcpy(tree->seed[i], &seed, 8);
+        tree->levels = i + 1;
+        ret = 1;
+    }
+    memcpy(out, tree->key[2], 32);
+
+    return ret;
+}
+
+int gost_tlstree(int cipher_nid, const unsigned char *in, unsigned char *out,
+                 const unsigned char *tlsseq)
+{
+    GOST_TLSTREE_CTX tree;
+    int ret;
+
+    tree.levels = 0;
+    ret = gost_tlstree_cached(&tree, cipher_nid, in, out, tlsseq) > 0;
+    OPENSSL_cleanse(&tree, sizeof(tree));
+
+    return ret;
 }
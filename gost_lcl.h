@@ -17,14 +17,34 @@
 # include <openssl/ec.h>
 # include "gost89.h"
 # include "gosthash.h"
+# include "gost_engine.h"
 /* Control commands */
 # define GOST_PARAM_CRYPT_PARAMS 0
 # define GOST_PARAM_PBE_PARAMS 1
 # define GOST_PARAM_PK_FORMAT 2
-# define GOST_PARAM_MAX 3
+# define GOST_PARAM_VERIFY_CACHE 3
+# define GOST_PARAM_PRESIGN_POOL 4
+# define GOST_PARAM_PUBKEY_CACHE 5
+# define GOST_PARAM_EPHEMERAL_POOL 6
+# define GOST_PARAM_NONCE 7
+# define GOST_PARAM_VERIFY_RESULTS 8
+# define GOST_PARAM_MAX 9
 # define GOST_CTRL_CRYPT_PARAMS (ENGINE_CMD_BASE+GOST_PARAM_CRYPT_PARAMS)
 # define GOST_CTRL_PBE_PARAMS   (ENGINE_CMD_BASE+GOST_PARAM_PBE_PARAMS)
 # define GOST_CTRL_PK_FORMAT   (ENGINE_CMD_BASE+GOST_PARAM_PK_FORMAT)
+# define GOST_CTRL_VERIFY_CACHE (ENGINE_CMD_BASE+GOST_PARAM_VERIFY_CACHE)
+# define GOST_CTRL_PRESIGN_POOL (ENGINE_CMD_BASE+GOST_PARAM_PRESIGN_POOL)
+# define GOST_CTRL_PUBKEY_CACHE (ENGINE_CMD_BASE+GOST_PARAM_PUBKEY_CACHE)
+# define GOST_CTRL_EPHEMERAL_POOL (ENGINE_CMD_BASE+GOST_PARAM_EPHEMERAL_POOL)
+# define GOST_CTRL_NONCE (ENGINE_CMD_BASE+GOST_PARAM_NONCE)
+# define GOST_CTRL_VERIFY_RESULTS (ENGINE_CMD_BASE+GOST_PARAM_VERIFY_RESULTS)
+/* Commands not backed by a parameter */
+# define GOST_CTRL_VERIFY_CACHE_STATS (ENGINE_CMD_BASE+0x100)
+# define GOST_CTRL_PRESIGN_FILL (ENGINE_CMD_BASE+0x101)
+# define GOST_CTRL_PUBKEY_CACHE_STATS (ENGINE_CMD_BASE+0x102)
+# define GOST_CTRL_EPHEMERAL_FILL (ENGINE_CMD_BASE+0x103)
+# define GOST_CTRL_VERIFY_RESULTS_STATS (ENGINE_CMD_BASE+0x104)
+/* GOST_CTRL_PBKDF2 (ENGINE_CMD_BASE+0x105) is in gost_engine.h */
 
 typedef struct R3410_ec {
     int nid;
@@ -62,6 +82,7 @@ int register_pmeth_gost(int id, EVP_PKEY_METHOD **pmeth, int flags);
 # define maclen_ctrl_string "size"
 # define EVP_PKEY_CTRL_GOST_MAC_HEXKEY (EVP_PKEY_ALG_CTRL+3)
 # define EVP_PKEY_CTRL_MAC_LEN (EVP_PKEY_ALG_CTRL+5)
+# define EVP_PKEY_CTRL_GOST_EPHEMERAL_KEY (EVP_PKEY_ALG_CTRL+6)
 /* Pmeth internal representation */
 struct gost_pmeth_data {
     int sign_param_nid;         /* Should be set whenever parameters are
@@ -71,6 +92,8 @@ struct gost_pmeth_data {
     size_t shared_ukm_size;     /* XXX temporary use shared_ukm and hash for 2018 CKE */
     int peer_key_used;
     int cipher_nid;             /* KExp15/KImp15 algs */
+    EVP_PKEY *eph_key;          /* ephemeral key shared by recipients */
+    int ukm_used;               /* shared_ukm already used with eph_key */
 };
 
 struct gost_mac_pmeth_data {
@@ -193,6 +216,7 @@ EVP_MD *digest_gost2012_256(void);
 EVP_MD *digest_gost2012_512(void);
 void digest_gost2012_256_destroy(void);
 void digest_gost2012_512_destroy(void);
+int gost_pbkdf2_ctrl(GOST_PBKDF2_PARAMS *params);
 /* EVP_MD structure for GOST 28147 in MAC mode */
 EVP_MD *imit_gost_cpa(void);
 void imit_gost_cpa_destroy(void);
@@ -204,12 +228,21 @@ EVP_MD *grasshopper_omac(void);
 EVP_MD *grasshopper_omac_acpkm(void);
 void grasshopper_omac_destroy(void);
 void grasshopper_omac_acpkm_destroy(void);
+/* TLSTREE keys derived for the last record, see gost_tlstree_cached() */
+typedef struct gost_tlstree_ctx {
+    int levels;                 /* valid levels, 0 after the root key changes */
+    unsigned char seed[3][8];
+    unsigned char key[3][32];
+} GOST_TLSTREE_CTX;
 /* Cipher context used for EVP_CIPHER operation */
 struct ossl_gost_cipher_ctx {
     int paramNID;
     unsigned int count;
     int key_meshing;
     gost_ctx cctx;
+    /* Magma CTR keeps the root key for TLSTREE */
+    unsigned char master_key[32];
+    GOST_TLSTREE_CTX tree;
 };
 /* Structure to map parameter NID to S-block */
 struct gost_cipher_info {
@@ -258,12 +291,46 @@ int pkey_gost_decrypt(EVP_PKEY_CTX *ctx, unsigned char *out,
 /* From gost_ec_keyx.c */
 int pkey_gost_ec_derive(EVP_PKEY_CTX *ctx, unsigned char *key, size_t *keylen);
 int fill_GOST_EC_params(EC_KEY *eckey, int nid);
+void gost_ec_groups_free(void);
+int gost_ec_verify_cache_set_size(long max);
+int gost_ec_verify_cache_stats(unsigned long *stats);
+void gost_ec_verify_cache_free(void);
+int gost_ec_verify_results_set_size(long max);
+int gost_ec_verify_results_stats(unsigned long *stats);
+void gost_ec_verify_results_free(void);
+int gost_ec_presign_set_size(long max);
+int gost_ec_presign_fill(void);
+int gost_ec_ephemeral_set_size(long max);
+int gost_ec_ephemeral_fill(void);
+int gost_ec_nonce_set_mode(const char *mode);
+void gost_ec_pools_free(void);
+BN_CTX *gost_bn_ctx_get(void);
+BN_CTX *gost_bn_ctx_secret(void);
+void gost_bn_ctx_put(BN_CTX *ctx);
+void gost_bn_ctx_free(void);
 int gost_ec_keygen(EC_KEY *ec);
+int gost_ec_keygen_batch(EC_KEY *const *keys, size_t count);
+int gost_ec_keygen_ephemeral(EC_KEY *ec);
 
 ECDSA_SIG *gost_ec_sign(const unsigned char *dgst, int dlen, EC_KEY *eckey);
+int gost_ec_sign_cp(const unsigned char *dgst, int dlen, EC_KEY *eckey,
+                    unsigned char *sig, int order);
+int gost_ec_sign_batch(const unsigned char *const *dgst, int dlen,
+                       EC_KEY *eckey, ECDSA_SIG **sig, size_t count);
 int gost_ec_verify(const unsigned char *dgst, int dgst_len,
                    ECDSA_SIG *sig, EC_KEY *ec);
+int gost_ec_verify_cp(const unsigned char *dgst, int dgst_len,
+                      const unsigned char *sigbuf, size_t siglen, EC_KEY *ec);
+int gost_ec_verify_batch(const unsigned char *const *dgst, int dgst_len,
+                         ECDSA_SIG *const *sig, EC_KEY *const *ec,
+                         size_t count, int *results);
 int gost_ec_compute_public(EC_KEY *ec);
+const EC_POINT *gost_ec_get0_public_key(const EC_KEY *ec);
+int gost_ec_point_mul(const EC_GROUP *group, BIGNUM *x, BIGNUM *y,
+                      const BIGNUM *n, const EC_POINT *q, const BIGNUM *m,
+                      BN_CTX *ctx);
+int gost_ec_point_mul_le(const EC_GROUP *group, unsigned char *out, int len,
+                         const EC_POINT *q, const BIGNUM *m, BN_CTX *ctx);
 
 /* VKO */
 int VKO_compute_key(unsigned char *shared_key,
@@ -280,6 +347,9 @@ int gost_kdftree2012_256(unsigned char *keyout, size_t keyout_len,
 
 int gost_tlstree(int cipher_nid, const unsigned char* inkey,
                 unsigned char *outkey, const unsigned char *tlsseq);
+int gost_tlstree_cached(GOST_TLSTREE_CTX *tree, int cipher_nid,
+                        const unsigned char *inkey, unsigned char *outkey,
+                        const unsigned char *tlsseq);
 /* KExp/KImp */
 int gost_kexp15(const unsigned char *shared_key, const int shared_len,
                 int cipher_nid, const unsigned char *cipher_key,
@@ -306,4 +376,8 @@ int pack_sign_cp(ECDSA_SIG *s, int order, unsigned char *sig, size_t *siglen);
 /* Get private key as BIGNUM from both 34.10-2001 keys*/
 /* Returns pointer into EVP_PKEY structure */
 BIGNUM *gost_get0_priv_key(const EVP_PKEY *pkey);
+/* Cache of public keys decoded from SubjectPublicKeyInfo */
+int gost_pubkey_cache_set_size(long max);
+int gost_pubkey_cache_stats(unsigned long *stats);
+void gost_pubkey_cache_free(void);
 #endif
@@ -9,8 +9,11 @@
  *                                                                    *
  **********************************************************************/
 
+#include <string.h>
 #include <openssl/evp.h>
 #include "gosthash2012.h"
+#include "gost_lcl.h"
+#include "e_gost_err.h"
 
 static int gost_digest_init512(EVP_MD_CTX *ctx);
 static int gost_digest_init256(EVP_MD_CTX *ctx);
@@ -166,3 +169,25 @@ static int gost_digest_ctrl_512(EVP_MD_CTX *ctx, int type, int arg, void *ptr)
         return 0;
     }
 }
+
+/*
+ * PBKDF2 with HMAC-Streebog, reached through the GOST_CTRL_PBKDF2 engine
+ * control so that nothing is registered outside the engine.
+ */
+int gost_pbkdf2_ctrl(GOST_PBKDF2_PARAMS *params)
+{
+    if (params == NULL || params->out == NULL || params->iter < 1
+        || (params->pass == NULL && params->passlen != 0)
+        || (params->salt == NULL && params->saltlen != 0)) {
+        GOSTerr(GOST_F_GOST_PBKDF2_CTRL, GOST_R_CTRL_CALL_FAILED);
+        return 0;
+    }
+    if (params->digest_bits != 256 && params->digest_bits != 512) {
+        GOSTerr(GOST_F_GOST_PBKDF2_CTRL, GOST_R_INVALID_DIGEST_TYPE);
+        return 0;
+    }
+    gost2012_pbkdf2(params->digest_bits, params->pass, params->passlen,
+                    params->salt, params->saltlen, params->iter,
+                    params->out, params->outlen);
+    return 1;
+}
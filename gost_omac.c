@@ -1,19 +1,32 @@
 #include <string.h>
-#include <openssl/cmac.h>
 #include <openssl/conf.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
 
 #include "e_gost_err.h"
 #include "gost_lcl.h"
+#include "gost_grasshopper_core.h"
 
 #define min(a,b) (((a) < (b)) ? (a) : (b))
 
+/*
+ * OMAC (CMAC) of GOST R 34.13-2015 on top of the block functions. Magma
+ * blocks are big-endian while gostcrypt() takes them little-endian, so
+ * the chaining value and subkeys of Magma are kept byte reversed and
+ * only the message is reversed on the way in.
+ */
 typedef struct omac_ctx {
-    CMAC_CTX *cmac_ctx;
     size_t dgst_size;
     int cipher_nid;
     int key_set;
+    unsigned int num;           /* bytes in buf, a full block is kept */
+    unsigned char buf[16];      /* until it is known not to be the last */
+    grasshopper_w128_t c;       /* chaining value */
+    grasshopper_w128_t k1, k2;  /* subkeys for a full and padded last block */
+    union {
+        gost_ctx magma;
+        grasshopper_round_keys_t grasshopper;
+    } ks;
 /* 
  * Here begins stuff related to TLSTREE processing
  * We MUST store the original key to derive TLSTREE keys from it
@@ -21,16 +34,12 @@ typedef struct omac_ctx {
  * */
     unsigned char key[32];
 /*
- * TODO
- * TLSTREE intermediate values should be recalculated only when 
+ * TLSTREE intermediate values are recalculated only when
  * C_i & (seq_no+1) != C_i & (seq_no)
- * so somewhen we will store C_i & (seq_no) in this structure 
- * to avoid redundant hash calculations.
  * */
+    GOST_TLSTREE_CTX tree;
 } OMAC_CTX;
 
-#define MAX_GOST_OMAC_SIZE 16
-
 static int omac_init(EVP_MD_CTX *ctx, int cipher_nid)
 {
     OMAC_CTX *c = EVP_MD_CTX_md_data(ctx);
@@ -61,31 +70,118 @@ static int grasshopper_imit_init(EVP_MD_CTX *ctx)
     return omac_init(ctx, NID_grasshopper_cbc);
 }
 
+static size_t omac_block_size(const OMAC_CTX *c)
+{
+    return c->cipher_nid == NID_magma_cbc ? 8 : 16;
+}
+
+/* Chains one block of input, xored with the subkey k for the last one */
+static void omac_block(OMAC_CTX *c, const unsigned char *in,
+                       const grasshopper_w128_t *k)
+{
+    grasshopper_w128_t buf;
+    int i;
+
+    if (c->cipher_nid == NID_magma_cbc) {
+        for (i = 0; i < 8; i++)
+            c->c.b[i] ^= in[7 - i];
+        if (k)
+            c->c.q[0] ^= k->q[0];
+        gostcrypt(&c->ks.magma, c->c.b, c->c.b);
+    } else {
+        for (i = 0; i < 16; i++)
+            c->c.b[i] ^= in[i];
+        if (k) {
+            c->c.q[0] ^= k->q[0];
+            c->c.q[1] ^= k->q[1];
+        }
+        grasshopper_encrypt_block(&c->ks.grasshopper, &c->c, &c->c, &buf);
+    }
+}
+
+/* Multiplication by x in GF(2^(8 * bs)), big-endian */
+static void omac_double(grasshopper_w128_t *out, const grasshopper_w128_t *in,
+                        size_t bs, unsigned char rb)
+{
+    unsigned char carry = in->b[0] >> 7;
+    size_t i;
+
+    for (i = 0; i < bs - 1; i++)
+        out->b[i] = (in->b[i] << 1) | (in->b[i + 1] >> 7);
+    out->b[bs - 1] = (in->b[bs - 1] << 1) ^ (rb & (0 - carry));
+}
+
+static void omac_reverse(grasshopper_w128_t *w)
+{
+    unsigned char t;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        t = w->b[i];
+        w->b[i] = w->b[7 - i];
+        w->b[7 - i] = t;
+    }
+}
+
 static int omac_imit_update(EVP_MD_CTX *ctx, const void *data, size_t count)
 {
     OMAC_CTX *c = EVP_MD_CTX_md_data(ctx);
+    const unsigned char *in = data;
+    size_t bs, n;
+
     if (!c->key_set) {
         GOSTerr(GOST_F_OMAC_IMIT_UPDATE, GOST_R_MAC_KEY_NOT_SET);
         return 0;
     }
+    if (count == 0)
+        return 1;
 
-    return CMAC_Update(c->cmac_ctx, data, count);
+    bs = omac_block_size(c);
+    if (c->num > 0) {
+        n = min(bs - c->num, count);
+        memcpy(c->buf + c->num, in, n);
+        c->num += n;
+        in += n;
+        count -= n;
+        if (count == 0)
+            return 1;
+        omac_block(c, c->buf, NULL);
+    }
+    while (count > bs) {
+        omac_block(c, in, NULL);
+        in += bs;
+        count -= bs;
+    }
+    memcpy(c->buf, in, count);
+    c->num = count;
+    return 1;
 }
 
 int omac_imit_final(EVP_MD_CTX *ctx, unsigned char *md)
 {
     OMAC_CTX *c = EVP_MD_CTX_md_data(ctx);
-    unsigned char mac[MAX_GOST_OMAC_SIZE];
-    size_t mac_size = sizeof(mac);
+    size_t bs, i;
 
     if (!c->key_set) {
         GOSTerr(GOST_F_OMAC_IMIT_FINAL, GOST_R_MAC_KEY_NOT_SET);
         return 0;
     }
 
-    CMAC_Final(c->cmac_ctx, mac, &mac_size);
+    bs = omac_block_size(c);
+    if (c->num == bs) {
+        omac_block(c, c->buf, &c->k1);
+    } else {
+        c->buf[c->num] = 0x80;
+        memset(c->buf + c->num + 1, 0, bs - c->num - 1);
+        omac_block(c, c->buf, &c->k2);
+    }
 
-    memcpy(md, mac, c->dgst_size);
+    if (c->cipher_nid == NID_magma_cbc) {
+        for (i = 0; i < c->dgst_size; i++)
+            md[i] = c->c.b[7 - i];
+    } else {
+        memcpy(md, c->c.b, c->dgst_size);
+    }
     return 1;
 }
 
@@ -94,25 +190,11 @@ int omac_imit_copy(EVP_MD_CTX *to, const EVP_MD_CTX *from)
     OMAC_CTX *c_to = EVP_MD_CTX_md_data(to);
     const OMAC_CTX *c_from = EVP_MD_CTX_md_data(from);
 
-    if (c_from && c_to) {
-        c_to->dgst_size = c_from->dgst_size;
-        c_to->cipher_nid = c_from->cipher_nid;
-        c_to->key_set = c_from->key_set;
-        memcpy(c_to->key, c_from->key, 32);
-    } else {
+    if (c_from == NULL || c_to == NULL)
         return 0;
-    }
-    if (!c_from->cmac_ctx) {
-        if (c_to->cmac_ctx) {
-            CMAC_CTX_free(c_to->cmac_ctx);
-            c_to->cmac_ctx = NULL;
-        }
-        return 1;
-    }
-    if (c_to->cmac_ctx == c_from->cmac_ctx) {
-        c_to->cmac_ctx = CMAC_CTX_new();
-    }
-    return CMAC_CTX_copy(c_to->cmac_ctx, c_from->cmac_ctx);
+    if (c_to != c_from)
+        memcpy(c_to, c_from, sizeof(OMAC_CTX));
+    return 1;
 }
 
 /* Clean up imit ctx */
@@ -120,29 +202,50 @@ int omac_imit_cleanup(EVP_MD_CTX *ctx)
 {
     OMAC_CTX *c = EVP_MD_CTX_md_data(ctx);
 
-    if (c) {
-        CMAC_CTX_free(c->cmac_ctx);
-        memset(EVP_MD_CTX_md_data(ctx), 0, sizeof(OMAC_CTX));
-    }
+    if (c)
+        OPENSSL_cleanse(c, sizeof(OMAC_CTX));
     return 1;
 }
 
-static int omac_key(OMAC_CTX * c, const EVP_CIPHER *cipher,
-                    const unsigned char *key, size_t key_size)
+/* Starts a new message under the current key */
+static void omac_restart(OMAC_CTX *c)
 {
-    int ret = 0;
-
-    CMAC_CTX_free(c->cmac_ctx);
-    c->cmac_ctx = CMAC_CTX_new();
-    if (c->cmac_ctx == NULL) {
-        GOSTerr(GOST_F_OMAC_KEY, ERR_R_MALLOC_FAILURE);
-        return 0;
-    }
+    memset(&c->c, 0, sizeof(c->c));
+    c->num = 0;
+}
 
-    ret = CMAC_Init(c->cmac_ctx, key, key_size, cipher, NULL);
-    if (ret > 0) {
-        c->key_set = 1;
+/*
+ * Sets up the key schedule and subkeys, the chaining value starts over.
+ * The Magma substitution tables are only built with the first key.
+ */
+static int omac_key(OMAC_CTX * c, const unsigned char *key)
+{
+    grasshopper_w128_t l, buf;
+    grasshopper_key_t k;
+    size_t bs = omac_block_size(c);
+
+    memset(&l, 0, sizeof(l));
+    if (c->cipher_nid == NID_magma_cbc) {
+        if (!c->key_set)
+            gost_init(&c->ks.magma, &Gost28147_TC26ParamSetZ);
+        magma_key(&c->ks.magma, key);
+        gostcrypt(&c->ks.magma, l.b, l.b);
+        omac_reverse(&l);
+        omac_double(&c->k1, &l, bs, 0x1b);
+        omac_double(&c->k2, &c->k1, bs, 0x1b);
+        omac_reverse(&c->k1);
+        omac_reverse(&c->k2);
+    } else {
+        memcpy(k.k.b, key, sizeof(k.k.b));
+        grasshopper_set_encrypt_key(&c->ks.grasshopper, &k);
+        grasshopper_encrypt_block(&c->ks.grasshopper, &l, &l, &buf);
+        omac_double(&c->k1, &l, bs, 0x87);
+        omac_double(&c->k2, &c->k1, bs, 0x87);
+        OPENSSL_cleanse(&k, sizeof(k));
     }
+    OPENSSL_cleanse(&l, sizeof(l));
+    omac_restart(c);
+    c->key_set = 1;
     return 1;
 }
 
@@ -156,7 +259,6 @@ int omac_imit_ctrl(EVP_MD_CTX *ctx, int type, int arg, void *ptr)
         {
             OMAC_CTX *c = EVP_MD_CTX_md_data(ctx);
             const EVP_MD *md = EVP_MD_CTX_md(ctx);
-            const EVP_CIPHER *cipher = NULL;
             int ret = 0;
 
             if (c->cipher_nid == NID_undef) {
@@ -170,10 +272,10 @@ int omac_imit_ctrl(EVP_MD_CTX *ctx, int type, int arg, void *ptr)
                     break;
                 }
             }
-            cipher = EVP_get_cipherbynid(c->cipher_nid);
-
-            if (cipher == NULL) {
+            if (c->cipher_nid != NID_magma_cbc
+                && c->cipher_nid != NID_grasshopper_cbc) {
                 GOSTerr(GOST_F_OMAC_IMIT_CTRL, GOST_R_CIPHER_NOT_FOUND);
+                return 0;
             }
 
             if (EVP_MD_meth_get_init(EVP_MD_CTX_md(ctx)) (ctx) <= 0) {
@@ -189,12 +291,12 @@ int omac_imit_ctrl(EVP_MD_CTX *ctx, int type, int arg, void *ptr)
 
             if (arg == 0) {
                 struct gost_mac_key *key = (struct gost_mac_key *)ptr;
-                ret = omac_key(c, cipher, key->key, 32);
+                ret = omac_key(c, key->key);
                 if (ret > 0)
                     memcpy(c->key, key->key, 32);
                 return ret;
             } else if (arg == 32) {
-                ret = omac_key(c, cipher, ptr, 32);
+                ret = omac_key(c, ptr);
                 if (ret > 0)
                     memcpy(c->key, ptr, 32);
                 return ret;
@@ -231,10 +333,17 @@ int omac_imit_ctrl(EVP_MD_CTX *ctx, int type, int arg, void *ptr)
             OMAC_CTX *c = EVP_MD_CTX_md_data(ctx);
             if (c->key_set) {
                 unsigned char diversed_key[32];
-                return gost_tlstree(c->cipher_nid, c->key, diversed_key,
-                                    (const unsigned char *)ptr) ?
-                    omac_key(c, EVP_get_cipherbynid(c->cipher_nid),
-                             diversed_key, 32) : 0;
+                int ret = gost_tlstree_cached(&c->tree, c->cipher_nid, c->key,
+                                              diversed_key,
+                                              (const unsigned char *)ptr);
+
+                /* Same key as for the previous record, keep the schedule */
+                if (ret == 2)
+                    omac_restart(c);
+                else if (ret == 1)
+                    ret = omac_key(c, diversed_key);
+                OPENSSL_cleanse(diversed_key, sizeof(diversed_key));
+                return ret > 0;
             }
             GOSTerr(GOST_F_OMAC_IMIT_CTRL, GOST_R_BAD_ORDER);
             return 0;
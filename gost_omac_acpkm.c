@@ -6,7 +6,6 @@
  * See https://www.openssl.org/source/license.html for details
  */
 #include <string.h>
-#include <openssl/cmac.h>
 #include <openssl/conf.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
@@ -14,22 +13,29 @@
 #include "e_gost_err.h"
 #include "gost_lcl.h"
 #include "gost_grasshopper_defines.h"
+#include "gost_grasshopper_core.h"
 #include "gost_grasshopper_cipher.h"
 
 #define ACPKM_T_MAX (GRASSHOPPER_KEY_SIZE + GRASSHOPPER_BLOCK_SIZE)
 /*
- * CMAC code from crypto/cmac/cmac.c with ACPKM tweaks
+ * CMAC code from crypto/cmac/cmac.c with ACPKM tweaks, on top of the
+ * Kuznyechik block function. Section keys and ACPKM-Master keys replace
+ * encryption round keys in place, so the context needs no allocations
+ * and is copied as a whole.
  */
 struct CMAC_ACPKM_CTX_st {
-    /* Cipher context to use */
-    EVP_CIPHER_CTX *cctx;
-    /* CTR-ACPKM cipher */
-    EVP_CIPHER_CTX *actx;
+    /* Round keys of the current section key K^i */
+    grasshopper_round_keys_t key;
+    /* CTR-ACPKM producing key material for the sections */
+    grasshopper_round_keys_t master;
+    grasshopper_w128_t ctr;
+    unsigned int master_section; /* T */
+    unsigned int master_num; /* bytes generated until master_section */
     unsigned char km[ACPKM_T_MAX]; /* Key material */
-    /* Temporary block */
-    unsigned char tbl[EVP_MAX_BLOCK_LENGTH];
+    /* Chaining value */
+    grasshopper_w128_t tbl;
     /* Last (possibly partial) block */
-    unsigned char last_block[EVP_MAX_BLOCK_LENGTH];
+    unsigned char last_block[GRASSHOPPER_BLOCK_SIZE];
     /* Number of bytes in last block: -1 means context not initialised */
     int nlast_block;
     unsigned int section_size; /* N */
@@ -37,8 +43,6 @@ struct CMAC_ACPKM_CTX_st {
 };
 typedef struct CMAC_ACPKM_CTX_st CMAC_ACPKM_CTX;
 
-static unsigned char zero_iv[ACPKM_T_MAX];
-
 /* Make temporary keys K1 and K2 */
 
 static void make_kn(unsigned char *k1, unsigned char *l, int bl)
@@ -55,167 +59,102 @@ static void make_kn(unsigned char *k1, unsigned char *l, int bl)
         k1[bl - 1] ^= bl == 16 ? 0x87 : 0x1b;
 }
 
-static CMAC_ACPKM_CTX *CMAC_ACPKM_CTX_new(void)
+static void CMAC_ACPKM_CTX_init(CMAC_ACPKM_CTX *ctx)
 {
-    CMAC_ACPKM_CTX *ctx;
-    ctx = OPENSSL_malloc(sizeof(CMAC_ACPKM_CTX));
-    if (!ctx)
-        return NULL;
-    ctx->cctx = EVP_CIPHER_CTX_new();
-    if (ctx->cctx == NULL) {
-        OPENSSL_free(ctx);
-        return NULL;
-    }
-    ctx->actx = EVP_CIPHER_CTX_new();
-    if (ctx->actx == NULL) {
-        EVP_CIPHER_CTX_free(ctx->cctx);
-        OPENSSL_free(ctx);
-        return NULL;
-    }
+    memset(ctx, 0, sizeof(*ctx));
     ctx->nlast_block = -1;
-    ctx->num = 0;
     ctx->section_size = 4096; /* recommended value for Kuznyechik */
-    return ctx;
+    ctx->master_section = 4096;
 }
 
 static void CMAC_ACPKM_CTX_cleanup(CMAC_ACPKM_CTX *ctx)
 {
-    EVP_CIPHER_CTX_cleanup(ctx->cctx);
-    EVP_CIPHER_CTX_cleanup(ctx->actx);
-    OPENSSL_cleanse(ctx->tbl, EVP_MAX_BLOCK_LENGTH);
-    OPENSSL_cleanse(ctx->km, ACPKM_T_MAX);
-    OPENSSL_cleanse(ctx->last_block, EVP_MAX_BLOCK_LENGTH);
+    OPENSSL_cleanse(ctx, sizeof(*ctx));
     ctx->nlast_block = -1;
 }
 
-static void CMAC_ACPKM_CTX_free(CMAC_ACPKM_CTX *ctx)
+static void CMAC_ACPKM_set_key(grasshopper_round_keys_t *rk,
+                               const unsigned char *key)
 {
-    if (!ctx)
-        return;
-    CMAC_ACPKM_CTX_cleanup(ctx);
-    EVP_CIPHER_CTX_free(ctx->cctx);
-    EVP_CIPHER_CTX_free(ctx->actx);
-    OPENSSL_free(ctx);
-}
+    grasshopper_key_t k;
 
-int CMAC_ACPKM_CTX_copy(CMAC_ACPKM_CTX *out, const CMAC_ACPKM_CTX *in)
-{
-    int bl;
-    if (in->nlast_block == -1)
-        return 0;
-    if (!EVP_CIPHER_CTX_copy(out->cctx, in->cctx))
-        return 0;
-    if (!EVP_CIPHER_CTX_copy(out->actx, in->actx))
-        return 0;
-    bl = EVP_CIPHER_CTX_block_size(in->cctx);
-    memcpy(out->km, in->km, ACPKM_T_MAX);
-    memcpy(out->tbl, in->tbl, bl);
-    memcpy(out->last_block, in->last_block, bl);
-    out->nlast_block = in->nlast_block;
-    out->section_size = in->section_size;
-    out->num = in->num;
-    return 1;
+    memcpy(k.k.b, key, GRASSHOPPER_KEY_SIZE);
+    grasshopper_set_encrypt_key(rk, &k);
+    OPENSSL_cleanse(&k, sizeof(k));
 }
 
-static int CMAC_ACPKM_Init(CMAC_ACPKM_CTX *ctx, const void *key, size_t keylen,
-                           const EVP_CIPHER *cipher, ENGINE *impl)
+/* Encrypt zeros with master key
+ * to generate T*-sized key material */
+static void CMAC_ACPKM_Master(CMAC_ACPKM_CTX *ctx)
 {
-    /* All zeros means restart */
-    if (!key && !cipher && !impl && keylen == 0) {
-        /* Not initialised */
-        if (ctx->nlast_block == -1)
-            return 0;
-        if (!EVP_EncryptInit_ex(ctx->cctx, NULL, NULL, NULL, zero_iv))
-            return 0;
-        memset(ctx->tbl, 0, EVP_CIPHER_CTX_block_size(ctx->cctx));
-        ctx->nlast_block = 0;
-        /* No restart for ACPKM */
-        return 1;
-    }
-    /* Initialise context */
-    if (cipher) {
-        const EVP_CIPHER *acpkm;
+    unsigned char newkey[GRASSHOPPER_KEY_SIZE];
+    grasshopper_w128_t buf;
+    int i;
 
-        if (!EVP_EncryptInit_ex(ctx->cctx, cipher, impl, NULL, NULL))
-            return 0;
-        switch (EVP_CIPHER_nid(cipher)) {
-            case NID_grasshopper_cbc:
-                acpkm = cipher_gost_grasshopper_ctracpkm();
-                break;
-            default:
-                return 0;
+    for (i = 0; i < ACPKM_T_MAX; i += GRASSHOPPER_BLOCK_SIZE) {
+        if (ctx->master_section && ctx->master_num >= ctx->master_section) {
+            gost_grasshopper_acpkm_key(&ctx->master, newkey, &buf);
+            CMAC_ACPKM_set_key(&ctx->master, newkey);
+            ctx->master_num = 0;
         }
-        if (!EVP_EncryptInit_ex(ctx->actx, acpkm, impl, NULL, NULL))
-            return 0;
+        grasshopper_encrypt_block(&ctx->master, &ctx->ctr,
+                                  (grasshopper_w128_t *)(ctx->km + i), &buf);
+        inc_counter(ctx->ctr.b, GRASSHOPPER_BLOCK_SIZE);
+        ctx->master_num += GRASSHOPPER_BLOCK_SIZE;
     }
-    /* Non-NULL key means initialisation is complete */
-    if (key) {
-        unsigned char acpkm_iv[EVP_MAX_BLOCK_LENGTH];
-        int block_size, key_len;
-
-        /* Initialize CTR for ACPKM-Master */
-        if (!EVP_CIPHER_CTX_cipher(ctx->actx))
-            return 0;
-        /* block size of ACPKM cipher could be 1, but,
-         * cbc cipher is same with correct block_size */
-        block_size = EVP_CIPHER_CTX_block_size(ctx->cctx);
-        /* Wide IV = 1^{n/2} || 0,
-         * where a^r denotes the string that consists of r 'a' bits */
-        memset(acpkm_iv, 0xff, block_size / 2);
-        memset(acpkm_iv + block_size / 2, 0, block_size / 2);
-        if (!EVP_EncryptInit_ex(ctx->actx, NULL, NULL, key, acpkm_iv))
-            return 0;
-        /* EVP_CIPHER key_len may be different from EVP_CIPHER_CTX key_len */
-        key_len = EVP_CIPHER_key_length(EVP_CIPHER_CTX_cipher(ctx->actx));
-
-        /* Generate first key material (K^1 || K^1_1) */
-        if (!EVP_Cipher(ctx->actx, ctx->km, zero_iv, key_len + block_size))
-            return 0;
-
-        /* Initialize cbc for CMAC */
-        if (!EVP_CIPHER_CTX_cipher(ctx->cctx) ||
-            !EVP_CIPHER_CTX_set_key_length(ctx->cctx, key_len))
-            return 0;
-        /* set CBC key to K^1 */
-        if (!EVP_EncryptInit_ex(ctx->cctx, NULL, NULL, ctx->km, zero_iv))
-            return 0;
-        ctx->nlast_block = 0;
-    }
-    return 1;
+    OPENSSL_cleanse(newkey, sizeof(newkey));
 }
 
-/* Encrypt zeros with master key
- * to generate T*-sized key material */
-static int CMAC_ACPKM_Master(CMAC_ACPKM_CTX *ctx)
+static int CMAC_ACPKM_Init(CMAC_ACPKM_CTX *ctx, const unsigned char *key)
 {
-    return EVP_Cipher(ctx->actx, ctx->km, zero_iv,
-        EVP_CIPHER_key_length(EVP_CIPHER_CTX_cipher(ctx->actx)) +
-        EVP_CIPHER_CTX_block_size(ctx->cctx));
+    /* Initialize CTR for ACPKM-Master, wide IV = 1^{n/2} || 0,
+     * where a^r denotes the string that consists of r 'a' bits */
+    CMAC_ACPKM_set_key(&ctx->master, key);
+    memset(ctx->ctr.b, 0xff, GRASSHOPPER_BLOCK_SIZE / 2);
+    memset(ctx->ctr.b + GRASSHOPPER_BLOCK_SIZE / 2, 0,
+           GRASSHOPPER_BLOCK_SIZE / 2);
+    ctx->master_num = 0;
+
+    /* Generate first key material (K^1 || K^1_1) */
+    CMAC_ACPKM_Master(ctx);
+    /* set CBC key to K^1 */
+    CMAC_ACPKM_set_key(&ctx->key, ctx->km);
+    memset(&ctx->tbl, 0, sizeof(ctx->tbl));
+    ctx->nlast_block = 0;
+    ctx->num = 0;
+    return 1;
 }
 
-static int CMAC_ACPKM_Mesh(CMAC_ACPKM_CTX *ctx)
+static void CMAC_ACPKM_Mesh(CMAC_ACPKM_CTX *ctx)
 {
     if (ctx->num < ctx->section_size)
-        return 1;
+        return;
     ctx->num = 0;
-    if (!CMAC_ACPKM_Master(ctx))
-        return 0;
-    /* Restart cbc with new key */
-    if (!EVP_EncryptInit_ex(ctx->cctx, NULL, NULL, ctx->km,
-            EVP_CIPHER_CTX_iv(ctx->cctx)))
-        return 0;
-    return 1;
+    CMAC_ACPKM_Master(ctx);
+    /* Continue the chain with new key */
+    CMAC_ACPKM_set_key(&ctx->key, ctx->km);
+}
+
+static void CMAC_ACPKM_Block(CMAC_ACPKM_CTX *ctx, const unsigned char *in)
+{
+    grasshopper_w128_t buf;
+    int i;
+
+    CMAC_ACPKM_Mesh(ctx);
+    for (i = 0; i < GRASSHOPPER_BLOCK_SIZE; i++)
+        ctx->tbl.b[i] ^= in[i];
+    grasshopper_encrypt_block(&ctx->key, &ctx->tbl, &ctx->tbl, &buf);
+    ctx->num += GRASSHOPPER_BLOCK_SIZE;
 }
 
 static int CMAC_ACPKM_Update(CMAC_ACPKM_CTX *ctx, const void *in, size_t dlen)
 {
     const unsigned char *data = in;
-    size_t bl;
+    size_t bl = GRASSHOPPER_BLOCK_SIZE;
     if (ctx->nlast_block == -1)
         return 0;
     if (dlen == 0)
         return 1;
-    bl = EVP_CIPHER_CTX_block_size(ctx->cctx);
     /* Copy into partial block if we need to */
     if (ctx->nlast_block > 0) {
         size_t nleft;
@@ -230,21 +169,13 @@ static int CMAC_ACPKM_Update(CMAC_ACPKM_CTX *ctx, const void *in, size_t dlen)
             return 1;
         data += nleft;
         /* Else not final block so encrypt it */
-        if (!CMAC_ACPKM_Mesh(ctx))
-            return 0;
-        if (!EVP_Cipher(ctx->cctx, ctx->tbl, ctx->last_block, bl))
-            return 0;
-        ctx->num += bl;
+        CMAC_ACPKM_Block(ctx, ctx->last_block);
     }
     /* Encrypt all but one of the complete blocks left */
     while (dlen > bl) {
-        if (!CMAC_ACPKM_Mesh(ctx))
-            return 0;
-        if (!EVP_Cipher(ctx->cctx, ctx->tbl, data, bl))
-            return 0;
+        CMAC_ACPKM_Block(ctx, data);
         dlen -= bl;
         data += bl;
-        ctx->num += bl;
     }
     /* Copy any data left to last block buffer */
     memcpy(ctx->last_block, data, dlen);
@@ -256,41 +187,37 @@ static int CMAC_ACPKM_Update(CMAC_ACPKM_CTX *ctx, const void *in, size_t dlen)
 static int CMAC_ACPKM_Final(CMAC_ACPKM_CTX *ctx, unsigned char *out,
                             size_t *poutlen)
 {
-    int i, bl, lb, key_len;
-    unsigned char *k1, k2[EVP_MAX_BLOCK_LENGTH];
+    int i, bl = GRASSHOPPER_BLOCK_SIZE, lb;
+    unsigned char *k1, k2[GRASSHOPPER_BLOCK_SIZE];
+    grasshopper_w128_t buf;
     if (ctx->nlast_block == -1)
         return 0;
-    bl = EVP_CIPHER_CTX_block_size(ctx->cctx);
     *poutlen = (size_t) bl;
     if (!out)
         return 1;
     lb = ctx->nlast_block;
 
-    if (!CMAC_ACPKM_Mesh(ctx))
-        return 0;
-    key_len = EVP_CIPHER_key_length(EVP_CIPHER_CTX_cipher(ctx->actx));
+    CMAC_ACPKM_Mesh(ctx);
     /* Keys k1 and k2 */
-    k1 = ctx->km + key_len;
-    make_kn(k2, ctx->km + key_len, bl);
+    k1 = ctx->km + GRASSHOPPER_KEY_SIZE;
+    make_kn(k2, k1, bl);
 
     /* Is last block complete? */
     if (lb == bl) {
         for (i = 0; i < bl; i++)
-            out[i] = ctx->last_block[i] ^ k1[i];
+            ctx->tbl.b[i] ^= ctx->last_block[i] ^ k1[i];
     } else {
         ctx->last_block[lb] = 0x80;
         if (bl - lb > 1)
             memset(ctx->last_block + lb + 1, 0, bl - lb - 1);
         for (i = 0; i < bl; i++)
-            out[i] = ctx->last_block[i] ^ k2[i];
+            ctx->tbl.b[i] ^= ctx->last_block[i] ^ k2[i];
     }
     OPENSSL_cleanse(k1, bl);
     OPENSSL_cleanse(k2, bl);
     OPENSSL_cleanse(ctx->km, ACPKM_T_MAX);
-    if (!EVP_Cipher(ctx->cctx, out, out, bl)) {
-        OPENSSL_cleanse(out, bl);
-        return 0;
-    }
+    grasshopper_encrypt_block(&ctx->key, &ctx->tbl, &ctx->tbl, &buf);
+    memcpy(out, ctx->tbl.b, bl);
     return 1;
 }
 
@@ -299,7 +226,7 @@ static int CMAC_ACPKM_Final(CMAC_ACPKM_CTX *ctx, unsigned char *out,
  */
 
 typedef struct omac_acpkm_ctx {
-    CMAC_ACPKM_CTX *cmac_ctx;
+    CMAC_ACPKM_CTX cmac_ctx;
     size_t dgst_size;
     int cipher_nid;
     int key_set;
@@ -311,6 +238,7 @@ static int omac_acpkm_init(EVP_MD_CTX *ctx, int cipher_nid)
 {
     OMAC_ACPKM_CTX *c = EVP_MD_CTX_md_data(ctx);
     memset(c, 0, sizeof(OMAC_ACPKM_CTX));
+    CMAC_ACPKM_CTX_init(&c->cmac_ctx);
     c->cipher_nid = cipher_nid;
     c->key_set = 0;
 
@@ -337,7 +265,7 @@ static int omac_acpkm_imit_update(EVP_MD_CTX *ctx, const void *data,
         return 0;
     }
 
-    return CMAC_ACPKM_Update(c->cmac_ctx, data, count);
+    return CMAC_ACPKM_Update(&c->cmac_ctx, data, count);
 }
 
 int omac_acpkm_imit_final(EVP_MD_CTX *ctx, unsigned char *md)
@@ -351,7 +279,7 @@ int omac_acpkm_imit_final(EVP_MD_CTX *ctx, unsigned char *md)
         return 0;
     }
 
-    CMAC_ACPKM_Final(c->cmac_ctx, mac, &mac_size);
+    CMAC_ACPKM_Final(&c->cmac_ctx, mac, &mac_size);
 
     memcpy(md, mac, c->dgst_size);
     return 1;
@@ -362,24 +290,11 @@ int omac_acpkm_imit_copy(EVP_MD_CTX *to, const EVP_MD_CTX *from)
     OMAC_ACPKM_CTX *c_to = EVP_MD_CTX_md_data(to);
     const OMAC_ACPKM_CTX *c_from = EVP_MD_CTX_md_data(from);
 
-    if (c_from && c_to) {
-        c_to->dgst_size = c_from->dgst_size;
-        c_to->cipher_nid = c_from->cipher_nid;
-        c_to->key_set = c_from->key_set;
-    } else {
+    if (c_from == NULL || c_to == NULL)
         return 0;
-    }
-    if (!c_from->cmac_ctx) {
-        if (c_to->cmac_ctx) {
-            CMAC_ACPKM_CTX_free(c_to->cmac_ctx);
-            c_to->cmac_ctx = NULL;
-        }
-        return 1;
-    }
-    if (c_to->cmac_ctx == c_from->cmac_ctx) {
-        c_to->cmac_ctx = CMAC_ACPKM_CTX_new();
-    }
-    return CMAC_ACPKM_CTX_copy(c_to->cmac_ctx, c_from->cmac_ctx);
+    if (c_to != c_from)
+        memcpy(c_to, c_from, sizeof(OMAC_ACPKM_CTX));
+    return 1;
 }
 
 /* Clean up imit ctx */
@@ -388,27 +303,16 @@ int omac_acpkm_imit_cleanup(EVP_MD_CTX *ctx)
     OMAC_ACPKM_CTX *c = EVP_MD_CTX_md_data(ctx);
 
     if (c) {
-        CMAC_ACPKM_CTX_free(c->cmac_ctx);
+        CMAC_ACPKM_CTX_cleanup(&c->cmac_ctx);
         memset(EVP_MD_CTX_md_data(ctx), 0, sizeof(OMAC_ACPKM_CTX));
     }
     return 1;
 }
 
-static int omac_acpkm_key(OMAC_ACPKM_CTX *c, const EVP_CIPHER *cipher,
-                          const unsigned char *key, size_t key_size)
+static int omac_acpkm_key(OMAC_ACPKM_CTX *c, const unsigned char *key)
 {
-    int ret = 0;
-
-    c->cmac_ctx = CMAC_ACPKM_CTX_new();
-    if (c->cmac_ctx == NULL) {
-        GOSTerr(GOST_F_OMAC_ACPKM_KEY, ERR_R_MALLOC_FAILURE);
-        return 0;
-    }
-
-    ret = CMAC_ACPKM_Init(c->cmac_ctx, key, key_size, cipher, NULL);
-    if (ret > 0) {
+    if (CMAC_ACPKM_Init(&c->cmac_ctx, key) > 0)
         c->key_set = 1;
-    }
     return 1;
 }
 
@@ -422,7 +326,6 @@ int omac_acpkm_imit_ctrl(EVP_MD_CTX *ctx, int type, int arg, void *ptr)
         {
             OMAC_ACPKM_CTX *c = EVP_MD_CTX_md_data(ctx);
             const EVP_MD *md = EVP_MD_CTX_md(ctx);
-            const EVP_CIPHER *cipher = NULL;
 
             if (c->cipher_nid == NID_undef) {
                 switch (EVP_MD_nid(md)) {
@@ -432,9 +335,9 @@ int omac_acpkm_imit_ctrl(EVP_MD_CTX *ctx, int type, int arg, void *ptr)
                     break;
                 }
             }
-            cipher = EVP_get_cipherbynid(c->cipher_nid);
-            if (cipher == NULL) {
+            if (c->cipher_nid != NID_grasshopper_cbc) {
                 GOSTerr(GOST_F_OMAC_ACPKM_IMIT_CTRL, GOST_R_CIPHER_NOT_FOUND);
+                return 0;
             }
             if (EVP_MD_meth_get_init(EVP_MD_CTX_md(ctx)) (ctx) <= 0) {
                 GOSTerr(GOST_F_OMAC_ACPKM_IMIT_CTRL, GOST_R_MAC_KEY_NOT_SET);
@@ -447,9 +350,9 @@ int omac_acpkm_imit_ctrl(EVP_MD_CTX *ctx, int type, int arg, void *ptr)
             }
             if (arg == 0) {
                 struct gost_mac_key *key = (struct gost_mac_key *)ptr;
-                return omac_acpkm_key(c, cipher, key->key, 32);
+                return omac_acpkm_key(c, key->key);
             } else if (arg == 32) {
-                return omac_acpkm_key(c, cipher, ptr, 32);
+                return omac_acpkm_key(c, ptr);
             }
             GOSTerr(GOST_F_OMAC_ACPKM_IMIT_CTRL, GOST_R_INVALID_MAC_KEY_SIZE);
             return 0;
@@ -459,11 +362,12 @@ int omac_acpkm_imit_ctrl(EVP_MD_CTX *ctx, int type, int arg, void *ptr)
             OMAC_ACPKM_CTX *c = EVP_MD_CTX_md_data(ctx);
             if (!arg || (arg % EVP_MD_block_size(EVP_MD_CTX_md(ctx))))
                 return -1;
-            c->cmac_ctx->section_size = arg;
+            c->cmac_ctx.section_size = arg;
             if (ptr && *(int *)ptr) {
                 /* Set parameter T */
-                if (!EVP_CIPHER_CTX_ctrl(c->cmac_ctx->actx, EVP_CTRL_KEY_MESH, *(int *)ptr, NULL))
+                if (*(int *)ptr < 0 || *(int *)ptr % GRASSHOPPER_BLOCK_SIZE)
                     return 0;
+                c->cmac_ctx.master_section = *(int *)ptr;
             }
             return 1;
         }
@@ -74,7 +74,10 @@ static int pkey_gost_copy(EVP_PKEY_CTX *dst, ossl3_const EVP_PKEY_CTX *src)
     *dst_data = *src_data;
     if (src_data->shared_ukm) {
         dst_data->shared_ukm = NULL;
+        dst_data->ukm_used = 0;
     }
+    if (src_data->eph_key)
+        EVP_PKEY_up_ref(src_data->eph_key);
     return 1;
 }
 
@@ -85,6 +88,7 @@ static void pkey_gost_cleanup(EVP_PKEY_CTX *ctx)
     if (!data)
         return;
     OPENSSL_free(data->shared_ukm);
+    EVP_PKEY_free(data->eph_key);
     OPENSSL_free(data);
 }
 
@@ -152,6 +156,9 @@ static int pkey_gost_ctrl(EVP_PKEY_CTX *ctx, int type, int p1, void *p2)
         return 1;
     case EVP_PKEY_CTRL_SET_IV:
         OPENSSL_assert(p2 != NULL);
+        OPENSSL_free(pctx->shared_ukm);
+        pctx->shared_ukm_size = 0;
+        pctx->ukm_used = 0;
         pctx->shared_ukm = OPENSSL_malloc((int)p1);
         if (pctx->shared_ukm == NULL) {
             GOSTerr(GOST_F_PKEY_GOST_CTRL, ERR_R_MALLOC_FAILURE);
@@ -163,6 +170,26 @@ static int pkey_gost_ctrl(EVP_PKEY_CTX *ctx, int type, int p1, void *p2)
     case EVP_PKEY_CTRL_CIPHER:
         pctx->cipher_nid = p1;
         return 1;
+    case EVP_PKEY_CTRL_GOST_EPHEMERAL_KEY:
+        {
+            /* Key pair used instead of a fresh one by key transport */
+            EVP_PKEY *key = EVP_PKEY_CTX_get0_pkey(ctx);
+            EVP_PKEY *eph = (EVP_PKEY *)p2;
+
+            if (eph != NULL && (key == NULL
+                                || EVP_PKEY_base_id(eph) != EVP_PKEY_base_id(key)
+                                || EVP_PKEY_cmp_parameters(eph, key) != 1
+                                || !gost_get0_priv_key(eph))) {
+                GOSTerr(GOST_F_PKEY_GOST_CTRL, GOST_R_INCOMPATIBLE_PEER_KEY);
+                return 0;
+            }
+            if (eph != NULL)
+                EVP_PKEY_up_ref(eph);
+            EVP_PKEY_free(pctx->eph_key);
+            pctx->eph_key = eph;
+            pctx->ukm_used = 0;
+            return 1;
+        }
     case EVP_PKEY_CTRL_PEER_KEY:
         if (p1 == 0 || p1 == 1) /* call from EVP_PKEY_derive_set_peer */
             return 1;
@@ -423,7 +450,6 @@ static int pkey_gost_ec_cp_sign(EVP_PKEY_CTX *ctx, unsigned char *sig,
                                 size_t *siglen, const unsigned char *tbs,
                                 size_t tbs_len)
 {
-    ECDSA_SIG *unpacked_sig = NULL;
     EVP_PKEY *pkey = EVP_PKEY_CTX_get0_pkey(ctx);
     int order = 0;
 
@@ -448,11 +474,10 @@ static int pkey_gost_ec_cp_sign(EVP_PKEY_CTX *ctx, unsigned char *sig,
         *siglen = order;
         return 1;
     }
-    unpacked_sig = gost_ec_sign(tbs, tbs_len, EVP_PKEY_get0(pkey));
-    if (!unpacked_sig) {
+    if (!gost_ec_sign_cp(tbs, tbs_len, EVP_PKEY_get0(pkey), sig, order / 2))
         return 0;
-    }
-    return pack_sign_cp(unpacked_sig, order / 2, sig, siglen);
+    *siglen = order;
+    return 1;
 }
 
 /* ------------------- verify callbacks ---------------------------*/
@@ -477,22 +502,12 @@ static int pkey_gost_ec_cp_verify(EVP_PKEY_CTX *ctx, const unsigned char *sig,
                                   size_t siglen, const unsigned char *tbs,
                                   size_t tbs_len)
 {
-    int ok = 0;
     EVP_PKEY *pub_key = EVP_PKEY_CTX_get0_pkey(ctx);
-    ECDSA_SIG *s = (sig) ? unpack_cp_signature(sig, siglen) : NULL;
-    if (!s)
+
+    if (!sig || !pub_key)
         return 0;
-#ifdef DEBUG_SIGN
-    fprintf(stderr, "R=");
-    BN_print_fp(stderr, ECDSA_SIG_get0_r(s));
-    fprintf(stderr, "\nS=");
-    BN_print_fp(stderr, ECDSA_SIG_get0_s(s));
-    fprintf(stderr, "\n");
-#endif
-    if (pub_key)
-        ok = gost_ec_verify(tbs, tbs_len, s, EVP_PKEY_get0(pub_key));
-    ECDSA_SIG_free(s);
-    return ok;
+    return gost_ec_verify_cp(tbs, tbs_len, sig, siglen,
+                             EVP_PKEY_get0(pub_key));
 }
 
 /* ------------- encrypt init -------------------------------------*/
@@ -979,7 +994,12 @@ static int pkey_gost_mac_signctx(EVP_PKEY_CTX *ctx, unsigned char *sig,
 /* Callback for both EVP_PKEY_check() and EVP_PKEY_public_check. */
 static int pkey_gost_check(EVP_PKEY *pkey)
 {
-    return EC_KEY_check_key(EVP_PKEY_get0(pkey));
+    EC_KEY *ec = EVP_PKEY_get0(pkey);
+
+    /* Imported private keys get their public key here */
+    if (ec != NULL)
+        gost_ec_get0_public_key(ec);
+    return EC_KEY_check_key(ec);
 }
 
 /* ----------------------------------------------------------------*/
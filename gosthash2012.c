@@ -235,3 +235,132 @@ void gost2012_finish_hash(gost2012_hash_ctx * CTX, unsigned char *digest)
     else
         memcpy(digest, &(CTX->h.QWORD[0]), 64);
 }
+
+static void gost2012_cleanse(void *ptr, size_t len)
+{
+    volatile unsigned char *p = ptr;
+
+    while (len--)
+        *p++ = 0;
+}
+
+/*
+ * Precompute HMAC key states: both pad blocks are exactly one
+ * compression, so after this the per-message cost is the message itself
+ * plus two finalisations.
+ */
+void gost2012_hmac_init(gost2012_hmac_ctx * CTX,
+                        const unsigned int digest_size,
+                        const unsigned char *key, size_t keylen)
+{
+    unsigned char pad[64];
+    size_t i;
+
+    memset(pad, 0, sizeof(pad));
+    if (keylen > sizeof(pad)) {
+        init_gost2012_hash_ctx(&CTX->ctx, digest_size);
+        gost2012_hash_block(&CTX->ctx, key, keylen);
+        gost2012_finish_hash(&CTX->ctx, pad);
+    } else {
+        memcpy(pad, key, keylen);
+    }
+
+    for (i = 0; i < sizeof(pad); i++)
+        pad[i] ^= 0x36;
+    init_gost2012_hash_ctx(&CTX->ipad, digest_size);
+    gost2012_hash_block(&CTX->ipad, pad, sizeof(pad));
+
+    for (i = 0; i < sizeof(pad); i++)
+        pad[i] ^= 0x36 ^ 0x5c;
+    init_gost2012_hash_ctx(&CTX->opad, digest_size);
+    gost2012_hash_block(&CTX->opad, pad, sizeof(pad));
+
+    gost2012_cleanse(pad, sizeof(pad));
+    CTX->ctx = CTX->ipad;
+}
+
+/*
+ * Start a new message with the key set by gost2012_hmac_init
+ */
+void gost2012_hmac_start(gost2012_hmac_ctx * CTX)
+{
+    CTX->ctx = CTX->ipad;
+}
+
+void gost2012_hmac_update(gost2012_hmac_ctx * CTX,
+                          const unsigned char *data, size_t len)
+{
+    gost2012_hash_block(&CTX->ctx, data, len);
+}
+
+/*
+ * Output digest_size / 8 bytes of MAC. The context has to be restarted
+ * with gost2012_hmac_start before the next message.
+ */
+void gost2012_hmac_final(gost2012_hmac_ctx * CTX, unsigned char *mac)
+{
+    unsigned char inner[64];
+    size_t len = CTX->ipad.digest_size / 8;
+
+    gost2012_finish_hash(&CTX->ctx, inner);
+    CTX->ctx = CTX->opad;
+    gost2012_hash_block(&CTX->ctx, inner, len);
+    gost2012_finish_hash(&CTX->ctx, mac);
+    gost2012_cleanse(inner, sizeof(inner));
+}
+
+void gost2012_hmac_cleanup(gost2012_hmac_ctx * CTX)
+{
+    gost2012_cleanse(CTX, sizeof(*CTX));
+}
+
+/*
+ * PBKDF2 (RFC 8018) with HMAC-Streebog as PRF, R 50.1.111-2016.
+ * Key pads are hashed only once for all the iterations.
+ */
+void gost2012_pbkdf2(const unsigned int digest_size,
+                     const unsigned char *pass, size_t passlen,
+                     const unsigned char *salt, size_t saltlen,
+                     unsigned long iter, unsigned char *out, size_t outlen)
+{
+    gost2012_hmac_ctx ctx;
+    union uint512_u U, T;
+    unsigned char counter[4];
+    size_t hlen = digest_size / 8, len;
+    unsigned long block = 1, j;
+    unsigned int i;
+
+    gost2012_hmac_init(&ctx, digest_size, pass, passlen);
+    memset(&U, 0, sizeof(U));
+
+    while (outlen > 0) {
+        counter[0] = (unsigned char)(block >> 24);
+        counter[1] = (unsigned char)(block >> 16);
+        counter[2] = (unsigned char)(block >> 8);
+        counter[3] = (unsigned char)block;
+
+        gost2012_hmac_start(&ctx);
+        gost2012_hmac_update(&ctx, salt, saltlen);
+        gost2012_hmac_update(&ctx, counter, sizeof(counter));
+        gost2012_hmac_final(&ctx, U.B);
+        T = U;
+
+        for (j = 1; j < iter; j++) {
+            gost2012_hmac_start(&ctx);
+            gost2012_hmac_update(&ctx, U.B, hlen);
+            gost2012_hmac_final(&ctx, U.B);
+            for (i = 0; i < 8; i++)
+                T.QWORD[i] ^= U.QWORD[i];
+        }
+
+        len = outlen < hlen ? outlen : hlen;
+        memcpy(out, T.B, len);
+        out += len;
+        outlen -= len;
+        block++;
+    }
+
+    gost2012_cleanse(&U, sizeof(U));
+    gost2012_cleanse(&T, sizeof(T));
+    gost2012_hmac_cleanup(&ctx);
+}
@@ -118,3 +118,28 @@ void init_gost2012_hash_ctx(gost2012_hash_ctx * CTX,
 void gost2012_hash_block(gost2012_hash_ctx * CTX,
                          const unsigned char *data, size_t len);
 void gost2012_finish_hash(gost2012_hash_ctx * CTX, unsigned char *digest);
+
+/*
+ * HMAC over GOST R 34.11-2012 (R 50.1.113-2016).
+ * Hash states after absorbing the ipad and opad key blocks are computed
+ * once per key, every message then starts from a copy of them.
+ */
+typedef struct gost2012_hmac_ctx {
+    gost2012_hash_ctx ipad;
+    gost2012_hash_ctx opad;
+    gost2012_hash_ctx ctx;
+} gost2012_hmac_ctx;
+
+void gost2012_hmac_init(gost2012_hmac_ctx * CTX,
+                        const unsigned int digest_size,
+                        const unsigned char *key, size_t keylen);
+void gost2012_hmac_start(gost2012_hmac_ctx * CTX);
+void gost2012_hmac_update(gost2012_hmac_ctx * CTX,
+                          const unsigned char *data, size_t len);
+void gost2012_hmac_final(gost2012_hmac_ctx * CTX, unsigned char *mac);
+void gost2012_hmac_cleanup(gost2012_hmac_ctx * CTX);
+
+void gost2012_pbkdf2(const unsigned int digest_size,
+                     const unsigned char *pass, size_t passlen,
+                     const unsigned char *salt, size_t saltlen,
+                     unsigned long iter, unsigned char *out, size_t outlen);
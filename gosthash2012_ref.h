@@ -23,17 +23,34 @@
     z->QWORD[7] = x->QWORD[7] ^ y->QWORD[7]; \
 }
 
+/*
+ * One output word of LPS: byte k of every input row goes through its
+ * own table. Shift counts are constants, so each lookup index is a single
+ * bitfield extract and all eight lookups are independent.
+ */
+#define __XLPS_WORD(k) ( \
+    Ax[0][(r0 >> ((k) << 3)) & 0xFF] ^ \
+    Ax[1][(r1 >> ((k) << 3)) & 0xFF] ^ \
+    Ax[2][(r2 >> ((k) << 3)) & 0xFF] ^ \
+    Ax[3][(r3 >> ((k) << 3)) & 0xFF] ^ \
+    Ax[4][(r4 >> ((k) << 3)) & 0xFF] ^ \
+    Ax[5][(r5 >> ((k) << 3)) & 0xFF] ^ \
+    Ax[6][(r6 >> ((k) << 3)) & 0xFF] ^ \
+    Ax[7][(r7 >> ((k) << 3)) & 0xFF])
+
 #ifndef __GOST3411_BIG_ENDIAN__
-# define __XLPS_FOR for (_i = 0; _i <= 7; _i++)
-# define _datai _i
+# define __XLPS_STORE(data, i, t) data->QWORD[i] = t
 #else
-# define __XLPS_FOR for (_i = 7; _i >= 0; _i--)
-# define _datai 7 - _i
+# define __XLPS_STORE(data, i, t) data->QWORD[7 - (i)] = t
 #endif
 
+/*
+ * Rows are computed into locals and stored once, so the output may alias
+ * either input and the compiler does not have to reload after each xor.
+ */
 #define XLPS(x, y, data) { \
-    register unsigned long long r0, r1, r2, r3, r4, r5, r6, r7; \
-    int _i; \
+    unsigned long long r0, r1, r2, r3, r4, r5, r6, r7; \
+    unsigned long long t0, t1, t2, t3, t4, t5, t6, t7; \
     \
     r0 = x->QWORD[0] ^ y->QWORD[0]; \
     r1 = x->QWORD[1] ^ y->QWORD[1]; \
@@ -44,17 +61,23 @@
     r6 = x->QWORD[6] ^ y->QWORD[6]; \
     r7 = x->QWORD[7] ^ y->QWORD[7]; \
     \
+    t0 = __XLPS_WORD(0); \
+    t1 = __XLPS_WORD(1); \
+    t2 = __XLPS_WORD(2); \
+    t3 = __XLPS_WORD(3); \
+    t4 = __XLPS_WORD(4); \
+    t5 = __XLPS_WORD(5); \
+    t6 = __XLPS_WORD(6); \
+    t7 = __XLPS_WORD(7); \
     \
-    __XLPS_FOR {\
-        data->QWORD[_datai]  = Ax[0][(r0 >> (_i << 3)) & 0xFF]; \
-        data->QWORD[_datai] ^= Ax[1][(r1 >> (_i << 3)) & 0xFF]; \
-        data->QWORD[_datai] ^= Ax[2][(r2 >> (_i << 3)) & 0xFF]; \
-        data->QWORD[_datai] ^= Ax[3][(r3 >> (_i << 3)) & 0xFF]; \
-        data->QWORD[_datai] ^= Ax[4][(r4 >> (_i << 3)) & 0xFF]; \
-        data->QWORD[_datai] ^= Ax[5][(r5 >> (_i << 3)) & 0xFF]; \
-        data->QWORD[_datai] ^= Ax[6][(r6 >> (_i << 3)) & 0xFF]; \
-        data->QWORD[_datai] ^= Ax[7][(r7 >> (_i << 3)) & 0xFF]; \
-    }\
+    __XLPS_STORE(data, 0, t0); \
+    __XLPS_STORE(data, 1, t1); \
+    __XLPS_STORE(data, 2, t2); \
+    __XLPS_STORE(data, 3, t3); \
+    __XLPS_STORE(data, 4, t4); \
+    __XLPS_STORE(data, 5, t5); \
+    __XLPS_STORE(data, 6, t6); \
+    __XLPS_STORE(data, 7, t7); \
 }
 
 #define ROUND(i, Ki, data) { \
@@ -5,12 +5,166 @@
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
 #include <openssl/obj_mac.h>
+#include <openssl/x509.h>
+#include <openssl/pkcs12.h>
+#include "gost_engine.h"
 #include "gost_lcl.h"
+#include "gosthash2012.h"
 #include "e_gost_err.h"
 #include "gost_grasshopper_cipher.h"
 #include "test.h"
 #include "ansi_terminal.h"
 
+/*
+ * Walks one TLSTREE context across the level 3, level 2 and level 1 key
+ * boundaries of the cipher and compares every key with a fresh derivation
+ */
+static int test_tlstree_walk(int cipher_nid, const unsigned char *kroot)
+{
+    /* Low bits of the sequence number covered by each level key */
+    const int gh_shift[3] = { 6, 19, 32 };
+    const int mg_shift[3] = { 12, 25, 38 };
+    const int *shift = cipher_nid == NID_magma_cbc ? mg_shift : gh_shift;
+    GOST_TLSTREE_CTX tree;
+    unsigned char tlsseq[8], out[32], out2[32];
+    uint64_t seq, prev = 0;
+    int i, j, k, ret, seen[3] = { 0, 0, 0 }, err = 0;
+
+    tree.levels = 0;
+    for (i = 0; i < 3; i++) {
+        for (j = -2; j < 2; j++) {
+            seq = ((uint64_t)1 << shift[i]) + j;
+            for (k = 0; k < 8; k++)
+                tlsseq[k] = (unsigned char)(seq >> (56 - 8 * k));
+
+            ret = gost_tlstree_cached(&tree, cipher_nid, kroot, out, tlsseq);
+            if (ret < 1 || ret > 2 || !gost_tlstree(cipher_nid, kroot, out2,
+                                                    tlsseq)) {
+                ERR_print_errors_fp(stderr);
+                return 1;
+            }
+            seen[ret]++;
+            /* The key changes only when the level 3 seed changes */
+            k = (i == 0 && j == -2) || seq >> shift[0] != prev >> shift[0];
+            if (ret != (k ? 1 : 2) || memcmp(out, out2, 32) != 0) {
+                fprintf(stdout, "ERROR! TLSTREE walk failed at %llx\n",
+                        (unsigned long long)seq);
+                err = 1;
+            }
+            prev = seq;
+        }
+    }
+    if (!seen[1] || !seen[2]) {
+        fprintf(stdout, "ERROR! TLSTREE keys are not reused\n");
+        err = 1;
+    }
+    OPENSSL_cleanse(&tree, sizeof(tree));
+
+    return err;
+}
+
+/*
+ * Decrypts a PBES2 PKCS#8 container with an HMAC-Streebog PRF using a key
+ * derived by the engine PBKDF2 control, and checks the result against
+ * PKCS8_decrypt()
+ */
+static int test_pkcs8_pbkdf2(ENGINE *eng)
+{
+    const char pass[] = "password";
+    unsigned char salt[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    unsigned char key[EVP_MAX_KEY_LENGTH], *der = NULL, *der2 = NULL;
+    unsigned char *plain = NULL;
+    const unsigned char *p;
+    EVP_PKEY *pkey = NULL, *pkey2 = NULL;
+    EVP_PKEY_CTX *ctx;
+    PKCS8_PRIV_KEY_INFO *p8inf, *p8inf2;
+    X509_SIG *p8;
+    X509_ALGOR *alg;
+    const X509_ALGOR *palg;
+    const ASN1_OCTET_STRING *enc;
+    PBE2PARAM *pbe2;
+    PBKDF2PARAM *kdf;
+    GOST_PBKDF2_PARAMS params;
+    EVP_CIPHER_CTX *cctx;
+    const EVP_CIPHER *cipher;
+    int derlen, len, len2, err = 0;
+
+    T(ctx = EVP_PKEY_CTX_new_id(NID_id_GostR3410_2012_256, NULL));
+    T(EVP_PKEY_keygen_init(ctx));
+    T(EVP_PKEY_CTX_ctrl_str(ctx, "paramset", "A"));
+    T(EVP_PKEY_keygen(ctx, &pkey));
+    EVP_PKEY_CTX_free(ctx);
+
+    /* Encrypted container as an application would load it */
+    T(p8inf = EVP_PKEY2PKCS8(pkey));
+    T(alg = PKCS5_pbe2_set_iv(EVP_aes_256_cbc(), 2000, salt, sizeof(salt),
+                              NULL, NID_id_tc26_hmac_gost_3411_2012_512));
+    T(p8 = PKCS8_set0_pbe(pass, strlen(pass), p8inf, alg));
+    PKCS8_PRIV_KEY_INFO_free(p8inf);
+    T((derlen = i2d_X509_SIG(p8, &der)) > 0);
+    X509_SIG_free(p8);
+    p = der;
+    T(p8 = d2i_X509_SIG(NULL, &p, derlen));
+
+    /* PBKDF2 parameters of PBES2 */
+    X509_SIG_get0(p8, &palg, &enc);
+    T(OBJ_obj2nid(palg->algorithm) == NID_pbes2);
+    T(pbe2 = ASN1_TYPE_unpack_sequence(ASN1_ITEM_rptr(PBE2PARAM),
+                                       palg->parameter));
+    T(OBJ_obj2nid(pbe2->keyfunc->algorithm) == NID_id_pbkdf2);
+    T(kdf = ASN1_TYPE_unpack_sequence(ASN1_ITEM_rptr(PBKDF2PARAM),
+                                      pbe2->keyfunc->parameter));
+    T(kdf->prf != NULL && OBJ_obj2nid(kdf->prf->algorithm)
+      == NID_id_tc26_hmac_gost_3411_2012_512);
+    T(cipher = EVP_get_cipherbyobj(pbe2->encryption->algorithm));
+
+    params.digest_bits = 512;
+    params.pass = (const unsigned char *)pass;
+    params.passlen = strlen(pass);
+    params.salt = kdf->salt->value.octet_string->data;
+    params.saltlen = kdf->salt->value.octet_string->length;
+    params.iter = ASN1_INTEGER_get(kdf->iter);
+    params.out = key;
+    params.outlen = EVP_CIPHER_key_length(cipher);
+    T(ENGINE_ctrl(eng, GOST_CTRL_PBKDF2, 0, &params, NULL) == 1);
+
+    T(cctx = EVP_CIPHER_CTX_new());
+    T(EVP_DecryptInit_ex(cctx, cipher, NULL, NULL, NULL));
+    T(EVP_CIPHER_asn1_to_param(cctx, pbe2->encryption->parameter) > 0);
+    T(EVP_DecryptInit_ex(cctx, NULL, NULL, key, NULL));
+    T(plain = OPENSSL_malloc(enc->length));
+    p = plain;
+    if (!EVP_DecryptUpdate(cctx, plain, &len, enc->data, enc->length)
+        || !EVP_DecryptFinal_ex(cctx, plain + len, &len2)
+        || (p8inf = d2i_PKCS8_PRIV_KEY_INFO(NULL, &p, len + len2)) == NULL) {
+        ERR_print_errors_fp(stderr);
+        err = 1;
+    } else {
+        pkey2 = EVP_PKCS82PKEY(p8inf);
+        T(p8inf2 = PKCS8_decrypt(p8, pass, strlen(pass)));
+        hexdump(stdout, "PKCS#8 PBKDF2 control key", key, params.outlen);
+        if (pkey2 == NULL || EVP_PKEY_cmp(pkey, pkey2) != 1
+            || i2d_PKCS8_PRIV_KEY_INFO(p8inf2, &der2) != len + len2
+            || memcmp(der2, plain, len + len2) != 0) {
+            fprintf(stdout, "ERROR! test failed\n");
+            err = 1;
+        }
+        PKCS8_PRIV_KEY_INFO_free(p8inf);
+        PKCS8_PRIV_KEY_INFO_free(p8inf2);
+    }
+
+    OPENSSL_cleanse(key, sizeof(key));
+    OPENSSL_free(plain);
+    EVP_CIPHER_CTX_free(cctx);
+    PBKDF2PARAM_free(kdf);
+    PBE2PARAM_free(pbe2);
+    X509_SIG_free(p8);
+    OPENSSL_free(der);
+    OPENSSL_free(der2);
+    EVP_PKEY_free(pkey2);
+    EVP_PKEY_free(pkey);
+    return err;
+}
 
 int main(void)
 {
@@ -73,6 +227,29 @@ int main(void)
         0x4e, 0x5b, 0xf0, 0xff, 0x64, 0x1a, 0x19, 0xff,
     };
 
+    /* Magma divisors, sequence number 0x000000400200103F */
+    const unsigned char tlstree_mg_seq[] = {
+        0x00, 0x00, 0x00, 0x40, 0x02, 0x00, 0x10, 0x3F
+    };
+    const unsigned char tlstree_mg_etalon[] = {
+        0x73, 0xe0, 0x3b, 0xa0, 0xb3, 0x7c, 0xd0, 0x68,
+        0xa9, 0x35, 0x27, 0x47, 0x5d, 0xaa, 0x37, 0xcf,
+        0x03, 0x75, 0x89, 0x41, 0x17, 0x88, 0x68, 0x1e,
+        0x57, 0x34, 0xaf, 0x5c, 0xd0, 0xfc, 0x06, 0x19,
+    };
+
+    /* R 50.1.111-2016, PBKDF2 with HMAC_GOSTR3411_2012_512, c = 4096 */
+    const unsigned char pbkdf2_etalon[] = {
+        0xe5, 0x2d, 0xeb, 0x9a, 0x2d, 0x2a, 0xaf, 0xf4,
+        0xe2, 0xac, 0x9d, 0x47, 0xa4, 0x1f, 0x34, 0xc2,
+        0x03, 0x76, 0x59, 0x1c, 0x67, 0x80, 0x7f, 0x04,
+        0x77, 0xe3, 0x25, 0x49, 0xdc, 0x34, 0x1b, 0xc7,
+        0x86, 0x7c, 0x09, 0x84, 0x1b, 0x6d, 0x58, 0xe2,
+        0x9d, 0x03, 0x47, 0xc9, 0x96, 0x30, 0x1d, 0x55,
+        0xdf, 0x0d, 0x34, 0xe4, 0x7c, 0xf6, 0x8f, 0x4e,
+        0x3c, 0x2c, 0xda, 0xf1, 0xd9, 0xab, 0x86, 0xc3,
+    };
+
     unsigned char buf[32 + 16];
     int ret = 0, err = 0;
     int outlen = 40;
@@ -152,6 +329,58 @@ int main(void)
         }
     }
 
+    ret = gost_tlstree(NID_magma_cbc, kroot, out, tlstree_mg_seq);
+    if (ret <= 0) {
+        ERR_print_errors_fp(stderr);
+        err = 11;
+    } else {
+        hexdump(stdout, "Gost TLSTREE - magma", out, 32);
+        if (memcmp(out, tlstree_mg_etalon, 32) != 0) {
+            fprintf(stdout, "ERROR! test failed\n");
+            err = 12;
+        }
+    }
+
+    if (test_tlstree_walk(NID_grasshopper_cbc, kroot)
+        || test_tlstree_walk(NID_magma_cbc, kroot))
+        err = 13;
+
+    gost2012_pbkdf2(512, (const unsigned char *)"password", 8,
+                    (const unsigned char *)"salt", 4, 4096, kdf_result, 64);
+    hexdump(stdout, "PBKDF2 HMAC_GOSTR3411_2012_512", kdf_result, 64);
+    if (memcmp(kdf_result, pbkdf2_etalon, 64) != 0) {
+        fprintf(stdout, "ERROR! test failed\n");
+        err = 9;
+    }
+
+    /* The engine PBKDF2 control matches the generic OpenSSL PBKDF2 */
+    {
+        GOST_PBKDF2_PARAMS params;
+        unsigned char out2[32];
+
+        params.digest_bits = 256;
+        params.pass = (const unsigned char *)"password";
+        params.passlen = 8;
+        params.salt = (const unsigned char *)"saltsalt";
+        params.saltlen = 8;
+        params.iter = 2000;
+        params.out = out;
+        params.outlen = 32;
+        T(ENGINE_ctrl(eng, GOST_CTRL_PBKDF2, 0, &params, NULL));
+        T(PKCS5_PBKDF2_HMAC("password", 8, (unsigned char *)"saltsalt", 8,
+                            2000,
+                            EVP_get_digestbynid(NID_id_GostR3411_2012_256),
+                            32, out2));
+        hexdump(stdout, "PBKDF2 control HMAC_GOSTR3411_2012_256", out, 32);
+        if (memcmp(out, out2, 32) != 0) {
+            fprintf(stdout, "ERROR! test failed\n");
+            err = 10;
+        }
+    }
+
+    if (test_pkcs8_pbkdf2(eng))
+        err = 14;
+
     ENGINE_finish(eng);
     ENGINE_free(eng);
 
@@ -15,6 +15,7 @@
 #include <openssl/rand.h>
 #include <openssl/err.h>
 #include <openssl/asn1.h>
+#include <openssl/x509.h>
 #include <openssl/obj_mac.h>
 #include <openssl/ec.h>
 #include <openssl/bn.h>
@@ -63,6 +64,21 @@ static void print_test_result(int err)
         ERR_print_errors_fp(stderr);
 }
 
+/* Key pair of the given type on the given parameter set */
+static EVP_PKEY *keygen(int type, int param_nid)
+{
+    EVP_PKEY *pkey = NULL;
+    EVP_PKEY_CTX *ctx;
+
+    T(ctx = EVP_PKEY_CTX_new_id(type, NULL));
+    T(EVP_PKEY_keygen_init(ctx));
+    T(EVP_PKEY_CTX_ctrl(ctx, type, -1, EVP_PKEY_CTRL_GOST_PARAMSET,
+                        param_nid, NULL));
+    T(EVP_PKEY_keygen(ctx, &pkey));
+    EVP_PKEY_CTX_free(ctx);
+    return pkey;
+}
+
 static int test_sign(struct test_sign *t)
 {
     int ret = 0, err;
@@ -190,6 +206,47 @@ static int test_sign(struct test_sign *t)
     print_test_result(err);
     ret |= err != 1;
 
+    /* Repeated Verify, served from the table cache from the second one. */
+    int i;
+    hash[0] = 1;
+    for (i = 0, err = 1; i < 3 && err == 1; i++) {
+        T(EVP_PKEY_verify_init(ctx));
+        err = EVP_PKEY_verify(ctx, sig, siglen, hash, len);
+    }
+    if (err == 1) {
+        T(EVP_PKEY_verify_init(ctx));
+        hash[0]++;
+        err = EVP_PKEY_verify(ctx, sig, siglen, hash, len);
+        err = (err < 0) ? err : !err;
+    }
+    printf("\tCached verify:\t\t");
+    print_test_result(err);
+    ret |= err != 1;
+
+    /* Batch verify with one of the digests changed after signing. */
+    EC_KEY *eckey = EVP_PKEY_get0(priv_key);
+    unsigned char dgsts[4][64];
+    const unsigned char *dgstp[4];
+    ECDSA_SIG *sigs[4];
+    EC_KEY *keys[4];
+    int results[4];
+    for (i = 0; i < 4; i++) {
+        T(RAND_bytes(dgsts[i], len));
+        dgstp[i] = dgsts[i];
+        keys[i] = eckey;
+    }
+    /* One signed alone, the others as a batch */
+    T(sigs[0] = gost_ec_sign(dgsts[0], len, eckey));
+    T(gost_ec_sign_batch(dgstp + 1, len, eckey, sigs + 1, 3));
+    dgsts[2][0] ^= 1;
+    err = gost_ec_verify_batch(dgstp, len, sigs, keys, 4, results) == 0
+        && results[0] && results[1] && !results[2] && results[3];
+    printf("\tBatch verify:\t\t");
+    print_test_result(err);
+    ret |= err != 1;
+    for (i = 0; i < 4; i++)
+        ECDSA_SIG_free(sigs[i]);
+
     EVP_PKEY_CTX_free(ctx);
     OPENSSL_free(sig);
     OPENSSL_free(hash);
@@ -199,6 +256,517 @@ static int test_sign(struct test_sign *t)
     return ret;
 }
 
+/* Signing with presignatures taken from the pool and computed inline */
+static int test_presign(ENGINE *eng)
+{
+    int ret = 0, err, i;
+    const int type = NID_id_GostR3410_2012_256;
+    size_t len = 32, siglen;
+    unsigned char hash[32] = { 1 }, sigs[4][64];
+
+    printf(cBLUE "Test presignature pool:\n" cNORM);
+    T(ENGINE_ctrl_cmd_string(eng, "PRESIGN_POOL", "2", 0));
+
+    EVP_PKEY *pkey = NULL;
+    EVP_PKEY_CTX *ctx;
+    T(pkey = keygen(type, NID_id_tc26_gost_3410_2012_256_paramSetB));
+    T(ctx = EVP_PKEY_CTX_new(pkey, NULL));
+
+    /* The first signature enables the pool of the curve, fill it */
+    for (i = 0; i < 4; i++) {
+        siglen = sizeof(sigs[i]);
+        T(EVP_PKEY_sign_init(ctx));
+        TE(EVP_PKEY_sign(ctx, sigs[i], &siglen, hash, len) == 1);
+        if (i == 0)
+            T(ENGINE_ctrl_cmd_string(eng, "PRESIGN_FILL", NULL, 0));
+        T(EVP_PKEY_verify_init(ctx));
+        err = EVP_PKEY_verify(ctx, sigs[i], siglen, hash, len);
+        printf("\tSign and verify %d:\t", i);
+        print_test_result(err);
+        ret |= err != 1;
+    }
+    err = memcmp(sigs[1], sigs[2], siglen) && memcmp(sigs[2], sigs[3], siglen)
+        && memcmp(sigs[1], sigs[3], siglen);
+    printf("\tSingle use:\t\t");
+    print_test_result(err);
+    ret |= err != 1;
+
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(pkey);
+    T(ENGINE_ctrl_cmd_string(eng, "PRESIGN_POOL", "0", 0));
+    return ret;
+}
+
+/* Key transport with ephemeral keys taken from the pool */
+static int test_ephemeral(ENGINE *eng)
+{
+    int ret = 0, err, i;
+    const int type = NID_id_GostR3410_2012_256;
+    unsigned char key[32] = { 1, 2, 3 }, out[3][256], dec[32];
+    size_t outlen[3], declen;
+
+    printf(cBLUE "Test ephemeral key pool:\n" cNORM);
+    T(ENGINE_ctrl_cmd_string(eng, "EPHEMERAL_POOL", "2", 0));
+
+    EVP_PKEY *pkey = NULL;
+    EVP_PKEY_CTX *ctx;
+    T(pkey = keygen(type, NID_id_tc26_gost_3410_2012_256_paramSetB));
+
+    /* The first encryption enables the pool of the curve, fill it */
+    for (i = 0; i < 3; i++) {
+        /* Decryption sets the peer key, so every round gets a context */
+        T(ctx = EVP_PKEY_CTX_new(pkey, NULL));
+        outlen[i] = sizeof(out[i]);
+        T(EVP_PKEY_encrypt_init(ctx));
+        TE(EVP_PKEY_encrypt(ctx, out[i], &outlen[i], key, sizeof(key)) == 1);
+        if (i == 0)
+            T(ENGINE_ctrl_cmd_string(eng, "EPHEMERAL_FILL", NULL, 0));
+        T(EVP_PKEY_decrypt_init(ctx));
+        declen = sizeof(dec);
+        err = EVP_PKEY_decrypt(ctx, dec, &declen, out[i], outlen[i]) == 1
+            && declen == sizeof(key) && memcmp(dec, key, declen) == 0;
+        printf("\tEncrypt and decrypt %d:\t", i);
+        print_test_result(err);
+        ret |= err != 1;
+        EVP_PKEY_CTX_free(ctx);
+    }
+    err = outlen[1] != outlen[2] || memcmp(out[1], out[2], outlen[1]);
+    printf("\tSingle use:\t\t");
+    print_test_result(err);
+    ret |= err != 1;
+
+    EVP_PKEY_free(pkey);
+    T(ENGINE_ctrl_cmd_string(eng, "EPHEMERAL_POOL", "0", 0));
+    return ret;
+}
+
+static int contains(const unsigned char *buf, size_t len,
+                    const unsigned char *sub, size_t sublen)
+{
+    size_t i;
+
+    for (i = 0; i + sublen <= len; i++)
+        if (memcmp(buf + i, sub, sublen) == 0)
+            return 1;
+    return 0;
+}
+
+/* Signature nonces derived from the key and the digest */
+static int test_nonce(ENGINE *eng)
+{
+    int ret = 0, err, i;
+    const int type = NID_id_GostR3410_2012_256;
+    unsigned char hash[32], sig[3][64];
+    size_t siglen;
+    /* s || r, checked against RFC 6979 over OpenSSL HMAC */
+    static const unsigned char kat[64] = {
+        0x1c, 0x7a, 0x30, 0xf2, 0xc7, 0x89, 0x51, 0x97,
+        0x80, 0xa2, 0x77, 0xed, 0x90, 0x6a, 0x1c, 0x58,
+        0x05, 0x68, 0xe6, 0xdd, 0xf3, 0x66, 0x56, 0xb4,
+        0x93, 0xbc, 0x3d, 0x30, 0xe3, 0x13, 0x96, 0x10,
+        0x04, 0x2c, 0x43, 0x43, 0xa0, 0x81, 0xc9, 0x34,
+        0xcc, 0x80, 0x25, 0x7f, 0xd4, 0x82, 0x79, 0x00,
+        0x24, 0x96, 0x09, 0xa4, 0xa7, 0x7e, 0x50, 0xe1,
+        0x2f, 0x19, 0xe6, 0x80, 0x17, 0xd5, 0x94, 0x88
+    };
+
+    printf(cBLUE "Test signature nonces:\n" cNORM);
+    for (i = 0; i < 32; i++)
+        hash[i] = i;
+
+    EVP_PKEY *pkey = NULL;
+    EVP_PKEY_CTX *ctx;
+    T(pkey = keygen(type, NID_id_tc26_gost_3410_2012_256_paramSetA));
+
+    /* Fixed key */
+    EC_KEY *ec = EVP_PKEY_get0(pkey);
+    const EC_GROUP *group = EC_KEY_get0_group(ec);
+    BIGNUM *d = NULL;
+    EC_POINT *pub;
+    T(BN_hex2bn(&d, "3A4F6C8B2D1E09F7A5C3B1E8D6F4A2C0"
+                    "9E7D5B3F1A8C6E4D2B0F9A7C5E3D1B8F"));
+    T(pub = EC_POINT_new(group));
+    T(EC_POINT_mul(group, pub, d, NULL, NULL, NULL));
+    T(EC_KEY_set_private_key(ec, d));
+    T(EC_KEY_set_public_key(ec, pub));
+    EC_POINT_free(pub);
+    BN_free(d);
+
+    err = ENGINE_ctrl_cmd_string(eng, "NONCE", "SOMETIMES", 0) == 0;
+    ERR_clear_error();
+    printf("\tUnknown mode:\t\t");
+    print_test_result(err);
+    ret |= err != 1;
+
+    T(ENGINE_ctrl_cmd_string(eng, "NONCE", "DETERMINISTIC", 0));
+    for (i = 0; i < 3; i++) {
+        if (i == 2)
+            T(ENGINE_ctrl_cmd_string(eng, "NONCE", "HEDGED", 0));
+        T(ctx = EVP_PKEY_CTX_new(pkey, NULL));
+        T(EVP_PKEY_sign_init(ctx));
+        siglen = sizeof(sig[i]);
+        TE(EVP_PKEY_sign(ctx, sig[i], &siglen, hash, sizeof(hash)) == 1);
+        T(EVP_PKEY_verify_init(ctx));
+        TE(EVP_PKEY_verify(ctx, sig[i], siglen, hash, sizeof(hash)) == 1);
+        EVP_PKEY_CTX_free(ctx);
+    }
+    err = memcmp(sig[0], sig[1], sizeof(sig[0])) == 0;
+    printf("\tDeterministic:\t\t");
+    print_test_result(err);
+    ret |= err != 1;
+
+    err = memcmp(sig[0], kat, sizeof(kat)) == 0;
+    printf("\tKnown answer:\t\t");
+    print_test_result(err);
+    ret |= err != 1;
+
+    err = memcmp(sig[0], sig[2], sizeof(sig[0])) != 0;
+    printf("\tHedged:\t\t\t");
+    print_test_result(err);
+    ret |= err != 1;
+
+    T(ENGINE_ctrl_cmd_string(eng, "NONCE", "RANDOM", 0));
+    EVP_PKEY_free(pkey);
+    return ret;
+}
+
+/* Key transport to several recipients with one ephemeral key */
+static int test_shared_ephemeral(void)
+{
+    int ret = 0, err, i, derlen;
+    const int type = NID_id_GostR3410_2012_256;
+    const int params[3] = {
+        NID_id_tc26_gost_3410_2012_256_paramSetB,
+        NID_id_tc26_gost_3410_2012_256_paramSetB,
+        NID_id_tc26_gost_3410_2012_256_paramSetA
+    };
+    unsigned char key[32] = { 4, 5, 6 }, out[256], dec[32], *der = NULL;
+    size_t outlen, declen;
+
+    printf(cBLUE "Test shared ephemeral key:\n" cNORM);
+
+    EVP_PKEY *pkey[3] = { NULL }, *eph = NULL;
+    EVP_PKEY_CTX *ctx;
+    for (i = 0; i < 3; i++)
+        T(pkey[i] = keygen(type, params[i]));
+    T(eph = keygen(type, params[0]));
+    T((derlen = i2d_PUBKEY(eph, &der)) > 0);
+
+    for (i = 0; i < 2; i++) {
+        T(ctx = EVP_PKEY_CTX_new(pkey[i], NULL));
+        T(EVP_PKEY_encrypt_init(ctx));
+        T(EVP_PKEY_CTX_ctrl(ctx, -1, -1, EVP_PKEY_CTRL_GOST_EPHEMERAL_KEY,
+                            0, eph) == 1);
+        outlen = sizeof(out);
+        TE(EVP_PKEY_encrypt(ctx, out, &outlen, key, sizeof(key)) == 1);
+        EVP_PKEY_CTX_free(ctx);
+
+        T(ctx = EVP_PKEY_CTX_new(pkey[i], NULL));
+        T(EVP_PKEY_decrypt_init(ctx));
+        declen = sizeof(dec);
+        err = EVP_PKEY_decrypt(ctx, dec, &declen, out, outlen) == 1
+            && declen == sizeof(key) && memcmp(dec, key, declen) == 0
+            /* The key is there with implicit tag */
+            && contains(out, outlen, der + 1, derlen - 1);
+        printf("\tRecipient %d:\t\t", i);
+        print_test_result(err);
+        ret |= err != 1;
+        EVP_PKEY_CTX_free(ctx);
+    }
+
+    /* With an application UKM every message needs a new one */
+    unsigned char ukm[32] = { 1, 2, 3 };
+    T(ctx = EVP_PKEY_CTX_new(pkey[0], NULL));
+    T(EVP_PKEY_encrypt_init(ctx));
+    T(EVP_PKEY_CTX_ctrl(ctx, -1, -1, EVP_PKEY_CTRL_GOST_EPHEMERAL_KEY,
+                        0, eph) == 1);
+    T(EVP_PKEY_CTX_ctrl(ctx, -1, -1, EVP_PKEY_CTRL_CIPHER,
+                        NID_grasshopper_ctr, NULL) == 1);
+    T(EVP_PKEY_CTX_ctrl(ctx, -1, -1, EVP_PKEY_CTRL_SET_IV,
+                        sizeof(ukm), ukm) == 1);
+    outlen = sizeof(out);
+    TE(EVP_PKEY_encrypt(ctx, out, &outlen, key, sizeof(key)) == 1);
+    outlen = sizeof(out);
+    err = EVP_PKEY_encrypt(ctx, out, &outlen, key, sizeof(key)) <= 0;
+    ERR_clear_error();
+    ukm[0]++;
+    T(EVP_PKEY_CTX_ctrl(ctx, -1, -1, EVP_PKEY_CTRL_SET_IV,
+                        sizeof(ukm), ukm) == 1);
+    outlen = sizeof(out);
+    TE(EVP_PKEY_encrypt(ctx, out, &outlen, key, sizeof(key)) == 1);
+    EVP_PKEY_CTX_free(ctx);
+
+    T(ctx = EVP_PKEY_CTX_new(pkey[0], NULL));
+    T(EVP_PKEY_decrypt_init(ctx));
+    T(EVP_PKEY_CTX_ctrl(ctx, -1, -1, EVP_PKEY_CTRL_CIPHER,
+                        NID_grasshopper_ctr, NULL) == 1);
+    T(EVP_PKEY_CTX_ctrl(ctx, -1, -1, EVP_PKEY_CTRL_SET_IV,
+                        sizeof(ukm), ukm) == 1);
+    declen = sizeof(dec);
+    err = err && EVP_PKEY_decrypt(ctx, dec, &declen, out, outlen) == 1
+        && declen == sizeof(key) && memcmp(dec, key, declen) == 0;
+    printf("\tSame UKM again:\t\t");
+    print_test_result(err);
+    ret |= err != 1;
+    EVP_PKEY_CTX_free(ctx);
+
+    /* The key must be on the parameters of the recipient */
+    T(ctx = EVP_PKEY_CTX_new(pkey[2], NULL));
+    T(EVP_PKEY_encrypt_init(ctx));
+    err = EVP_PKEY_CTX_ctrl(ctx, -1, -1, EVP_PKEY_CTRL_GOST_EPHEMERAL_KEY,
+                            0, eph) <= 0;
+    ERR_clear_error();
+    printf("\tOther parameters:\t");
+    print_test_result(err);
+    ret |= err != 1;
+    EVP_PKEY_CTX_free(ctx);
+
+    OPENSSL_free(der);
+    EVP_PKEY_free(eph);
+    for (i = 0; i < 3; i++)
+        EVP_PKEY_free(pkey[i]);
+    return ret;
+}
+
+/* Key pairs generated together */
+static int test_keygen_batch(void)
+{
+    int ret = 0, err, i, j;
+    const int params[2] = {
+        NID_id_GostR3410_2001_CryptoPro_A_ParamSet,
+        NID_id_tc26_gost_3410_2012_512_paramSetC
+    };
+    EC_KEY *keys[40];
+
+    printf(cBLUE "Test batch key generation:\n" cNORM);
+    for (j = 0; j < 2; j++) {
+        EVP_PKEY *pkey = NULL;
+        EVP_PKEY_CTX *ctx;
+        int type = j ? NID_id_GostR3410_2012_512 : NID_id_GostR3410_2012_256;
+
+        T(ctx = EVP_PKEY_CTX_new_id(type, NULL));
+        T(EVP_PKEY_paramgen_init(ctx));
+        T(EVP_PKEY_CTX_ctrl(ctx, type, -1, EVP_PKEY_CTRL_GOST_PARAMSET,
+                            params[j], NULL));
+        T(EVP_PKEY_paramgen(ctx, &pkey));
+        EVP_PKEY_CTX_free(ctx);
+
+        for (i = 0; i < 40; i++) {
+            T(keys[i] = EC_KEY_new());
+            T(EC_KEY_set_group(keys[i],
+                               EC_KEY_get0_group(EVP_PKEY_get0(pkey))));
+        }
+        err = gost_ec_keygen_batch(keys, 40);
+        for (i = 0; i < 40; i++) {
+            err = err && EC_KEY_check_key(keys[i]) == 1
+                && (i == 0 || BN_cmp(EC_KEY_get0_private_key(keys[i]),
+                            EC_KEY_get0_private_key(keys[i - 1])) != 0);
+            EC_KEY_free(keys[i]);
+        }
+        printf("\t%s:\t", OBJ_nid2sn(params[j]));
+        print_test_result(err);
+        ret |= err != 1;
+        EVP_PKEY_free(pkey);
+    }
+    return ret;
+}
+
+/* Public key of an imported private key is computed on demand */
+static int test_lazy_public(void)
+{
+    int ret = 0, err, derlen;
+    const int type = NID_id_GostR3410_2012_512;
+    unsigned char *der = NULL;
+    const unsigned char *p;
+
+    printf(cBLUE "Test imported private key:\n" cNORM);
+
+    EVP_PKEY *pkey, *priv;
+    T(pkey = keygen(type, NID_id_tc26_gost_3410_2012_512_paramSetA));
+    T((derlen = i2d_PrivateKey(pkey, &der)) > 0);
+    p = der;
+    T(priv = d2i_PrivateKey(type, NULL, &p, derlen));
+
+    err = EC_KEY_get0_public_key(EVP_PKEY_get0(priv)) == NULL;
+    printf("\tNo public key:\t\t");
+    print_test_result(err);
+    ret |= err != 1;
+
+    err = EVP_PKEY_cmp(priv, pkey) == 1
+        && EC_KEY_get0_public_key(EVP_PKEY_get0(priv)) != NULL;
+    printf("\tComputed on compare:\t");
+    print_test_result(err);
+    ret |= err != 1;
+
+    OPENSSL_free(der);
+    EVP_PKEY_free(priv);
+    EVP_PKEY_free(pkey);
+    return ret;
+}
+
+/* Decoding the same SubjectPublicKeyInfo twice shares the key */
+static int test_pubkey_cache(ENGINE *eng)
+{
+    int ret = 0, err;
+    const int type = NID_id_GostR3410_2012_256;
+    size_t len = 32, siglen;
+    unsigned char hash[32] = { 1 }, sig[64], *der = NULL;
+    const unsigned char *p;
+    unsigned long stats[3];
+    int derlen;
+
+    printf(cBLUE "Test public key cache:\n" cNORM);
+    T(ENGINE_ctrl_cmd_string(eng, "PUBKEY_CACHE", "2", 0));
+
+    EVP_PKEY *pkey = NULL, *k1, *k2, *k3;
+    EVP_PKEY_CTX *ctx;
+    T(pkey = keygen(type, NID_id_tc26_gost_3410_2012_256_paramSetA));
+    T((derlen = i2d_PUBKEY(pkey, &der)) > 0);
+
+    p = der;
+    T(k1 = d2i_PUBKEY(NULL, &p, derlen));
+    p = der;
+    T(k2 = d2i_PUBKEY(NULL, &p, derlen));
+    err = EVP_PKEY_get0(k1) != EVP_PKEY_get0(k2) && EVP_PKEY_cmp(k2, pkey) == 1;
+    printf("\tOwn key:\t\t");
+    print_test_result(err);
+    ret |= err != 1;
+
+    /* Changing a decoded key must not show up in later decodes */
+    {
+        EC_KEY *ec = EVP_PKEY_get0(k1);
+        EVP_PKEY *k4;
+
+        T(EC_KEY_set_public_key(ec,
+                                EC_GROUP_get0_generator(EC_KEY_get0_group(ec))));
+        p = der;
+        T(k4 = d2i_PUBKEY(NULL, &p, derlen));
+        err = EVP_PKEY_cmp(k4, pkey) == 1 && EVP_PKEY_cmp(k1, pkey) != 1;
+        printf("\tModified key:\t\t");
+        print_test_result(err);
+        ret |= err != 1;
+        EVP_PKEY_free(k4);
+    }
+
+    T(ctx = EVP_PKEY_CTX_new(pkey, NULL));
+    T(EVP_PKEY_sign_init(ctx));
+    siglen = sizeof(sig);
+    T(EVP_PKEY_sign(ctx, sig, &siglen, hash, len) == 1);
+    EVP_PKEY_CTX_free(ctx);
+    T(ctx = EVP_PKEY_CTX_new(k2, NULL));
+    T(EVP_PKEY_verify_init(ctx));
+    err = EVP_PKEY_verify(ctx, sig, siglen, hash, len);
+    printf("\tVerify with cached:\t");
+    print_test_result(err);
+    ret |= err != 1;
+    EVP_PKEY_CTX_free(ctx);
+
+    /* Other key bits must not hit the cache */
+    der[derlen - 1] ^= 1;
+    p = der;
+    k3 = d2i_PUBKEY(NULL, &p, derlen);
+    ERR_clear_error();
+    err = k3 == NULL || EVP_PKEY_cmp(k3, pkey) != 1;
+    printf("\tOther key:\t\t");
+    print_test_result(err);
+    ret |= err != 1;
+
+    T(ENGINE_ctrl(eng, GOST_CTRL_PUBKEY_CACHE_STATS, 0, stats, NULL));
+    err = stats[0] == 2 && stats[2] >= 1;
+    printf("\tCache hits:\t\t");
+    print_test_result(err);
+    ret |= err != 1;
+
+    EVP_PKEY_free(k3);
+    EVP_PKEY_free(k2);
+    EVP_PKEY_free(k1);
+    EVP_PKEY_free(pkey);
+    OPENSSL_free(der);
+    T(ENGINE_ctrl_cmd_string(eng, "PUBKEY_CACHE", "0", 0));
+    return ret;
+}
+
+/* Repeated verifications served from the result cache, failures not */
+static int test_verify_results(ENGINE *eng)
+{
+    int ret = 0, err, i;
+    const int type = NID_id_GostR3410_2012_256;
+    size_t len = 32, siglen;
+    unsigned char hash[32] = { 1 }, sig[64];
+    unsigned long stats[3];
+
+    printf(cBLUE "Test verify result cache:\n" cNORM);
+    T(ENGINE_ctrl_cmd_string(eng, "VERIFY_RESULTS", "8", 0));
+
+    EVP_PKEY *pkey = NULL, *other = NULL;
+    EVP_PKEY_CTX *ctx;
+    T(pkey = keygen(type, NID_id_tc26_gost_3410_2012_256_paramSetA));
+    T(other = keygen(type, NID_id_tc26_gost_3410_2012_256_paramSetA));
+
+    T(ctx = EVP_PKEY_CTX_new(pkey, NULL));
+    T(EVP_PKEY_sign_init(ctx));
+    siglen = sizeof(sig);
+    T(EVP_PKEY_sign(ctx, sig, &siglen, hash, len) == 1);
+    T(EVP_PKEY_verify_init(ctx));
+    for (i = 0, err = 1; i < 3 && err == 1; i++)
+        err = EVP_PKEY_verify(ctx, sig, siglen, hash, len);
+    T(ENGINE_ctrl(eng, GOST_CTRL_VERIFY_RESULTS_STATS, 0, stats, NULL));
+    err = err == 1 && stats[0] == 2 && stats[2] == 1;
+    printf("\tRepeated verify:\t");
+    print_test_result(err);
+    ret |= err != 1;
+
+    /* Anything else than the cached object must be checked in full */
+    hash[0]++;
+    err = EVP_PKEY_verify(ctx, sig, siglen, hash, len) != 1;
+    hash[0]--;
+    sig[0] ^= 1;
+    err = err && EVP_PKEY_verify(ctx, sig, siglen, hash, len) != 1;
+    sig[0] ^= 1;
+    EVP_PKEY_CTX_free(ctx);
+    T(ctx = EVP_PKEY_CTX_new(other, NULL));
+    T(EVP_PKEY_verify_init(ctx));
+    err = err && EVP_PKEY_verify(ctx, sig, siglen, hash, len) != 1;
+    ERR_clear_error();
+    T(ENGINE_ctrl(eng, GOST_CTRL_VERIFY_RESULTS_STATS, 0, stats, NULL));
+    err = err && stats[0] == 2 && stats[2] == 1;
+    printf("\tFailures not cached:\t");
+    print_test_result(err);
+    ret |= err != 1;
+    EVP_PKEY_CTX_free(ctx);
+
+    T(ENGINE_ctrl_cmd_string(eng, "VERIFY_RESULTS", "0", 0));
+    T(ENGINE_ctrl(eng, GOST_CTRL_VERIFY_RESULTS_STATS, 0, stats, NULL));
+    err = stats[2] == 0;
+    printf("\tCache disabled:\t\t");
+    print_test_result(err);
+    ret |= err != 1;
+
+    /* A negated part must not match the cached signature */
+    EC_KEY *ec = EVP_PKEY_get0(pkey);
+    ECDSA_SIG *s;
+    BIGNUM *r;
+    T(gost_ec_verify_results_set_size(8));
+    T(s = gost_ec_sign(hash, len, ec));
+    for (i = 0, err = 1; i < 2 && err == 1; i++)
+        err = gost_ec_verify(hash, len, s, ec);
+    r = (BIGNUM *)ECDSA_SIG_get0_r(s);
+    BN_set_negative(r, 1);
+    err = err == 1 && gost_ec_verify(hash, len, s, ec) != 1;
+    BN_set_negative(r, 0);
+    err = err && gost_ec_verify(hash, len, s, ec) == 1;
+    ERR_clear_error();
+    T(gost_ec_verify_results_set_size(0));
+    ECDSA_SIG_free(s);
+    printf("\tNegative part:\t\t");
+    print_test_result(err);
+    ret |= err != 1;
+
+    EVP_PKEY_free(other);
+    EVP_PKEY_free(pkey);
+    return ret;
+}
+
 int main(int argc, char **argv)
 {
     int ret = 0;
@@ -211,9 +779,43 @@ int main(int argc, char **argv)
     T(ENGINE_init(eng));
     T(ENGINE_set_default(eng, ENGINE_METHOD_ALL));
 
+    T(ENGINE_ctrl_cmd_string(eng, "VERIFY_CACHE", "4", 0));
+
     struct test_sign *sp;
     for (sp = test_signs; sp->name; sp++)
         ret |= test_sign(sp);
+    ret |= test_presign(eng);
+    ret |= test_ephemeral(eng);
+    ret |= test_shared_ephemeral();
+    ret |= test_nonce(eng);
+    ret |= test_lazy_public();
+    ret |= test_keygen_batch();
+    ret |= test_pubkey_cache(eng);
+    ret |= test_verify_results(eng);
+
+    unsigned long stats[3];
+    T(ENGINE_ctrl(eng, GOST_CTRL_VERIFY_CACHE_STATS, 0, stats, NULL));
+    printf(cBLUE "Verify cache: %lu hits, %lu misses, %lu keys\n" cNORM,
+           stats[0], stats[1], stats[2]);
+    if (stats[0] == 0 || stats[2] != 4) {
+        printf(cRED "Verify cache is not used\n" cNORM);
+        ret |= 1;
+    }
+
+    /* Caches and locks keep working when the engine is bound again */
+    ENGINE_unregister_ciphers(eng);
+    ENGINE_unregister_digests(eng);
+    ENGINE_unregister_pkey_meths(eng);
+    ENGINE_unregister_pkey_asn1_meths(eng);
+    ENGINE_finish(eng);
+    ENGINE_remove(eng);
+    ENGINE_free(eng);
+    printf(cBLUE "Engine bound again:\n" cNORM);
+    T(eng = ENGINE_by_id("gost"));
+    T(ENGINE_init(eng));
+    T(ENGINE_set_default(eng, ENGINE_METHOD_ALL));
+    ret |= test_lazy_public();
+    ret |= test_pubkey_cache(eng);
 
     ENGINE_finish(eng);
     ENGINE_free(eng);
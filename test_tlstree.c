@@ -74,6 +74,37 @@ int main(void)
     unsigned char data63_processed[4096+16];
     unsigned char mac63[16];
 
+    /* Magma-CTR records, the IV is advanced by seq mod 2^32 */
+    const unsigned char magma_iv[] = {
+        0xFF, 0xFF, 0xFF, 0xF0, 0x00, 0x00, 0x00, 0x00,
+    };
+
+    unsigned char magma_seq0[] = {
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    };
+
+    unsigned char magma_seq1[] = {
+        0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x20,
+    };
+
+    const unsigned char magma_data[24] = {
+        0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF,
+        0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77
+    };
+
+    const unsigned char magma_enc0_etl[24] = {
+        0x5E, 0x74, 0xA6, 0xFC, 0x73, 0x9B, 0xD9, 0x49, 0x95, 0x6A, 0x44, 0x85, 0xF6, 0x02, 0xFA, 0x35,
+        0xFB, 0x9F, 0x8C, 0xE7, 0xD9, 0x57, 0x0D, 0xA7
+    };
+
+    const unsigned char magma_enc1_etl[24] = {
+        0xB4, 0xD3, 0xD2, 0x23, 0x0B, 0x9D, 0x17, 0xCA, 0xC0, 0x3B, 0x21, 0x7C, 0x0D, 0x27, 0x34, 0x87,
+        0x3E, 0x73, 0xF9, 0xD7, 0x87, 0xA2, 0x8A, 0xF7
+    };
+
+    unsigned char magma_key[32];
+    unsigned char magma_processed[24];
+
     EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
     EVP_CIPHER_CTX *enc = NULL;
     const EVP_MD *md;
@@ -163,6 +194,52 @@ int main(void)
         fprintf(stderr, "ENC63 mismatch: tail");
         exit(1);
     }
+    EVP_CIPHER_CTX_free(enc);
+
+    for (i = 0; i < 32; i++)
+        magma_key[i] = i;
+    ciph = EVP_get_cipherbynid(NID_magma_ctr);
+    enc = EVP_CIPHER_CTX_new();
+    EVP_EncryptInit_ex(enc, ciph, NULL, magma_key, magma_iv);
+
+    /* Encryption gets the incremented seq, as for Kuznyechik above */
+    for (i = 7; i >= 0; i--) {
+        ++magma_seq0[i];
+        if (magma_seq0[i] != 0)
+            break;
+    }
+    EVP_CIPHER_CTX_ctrl(enc, EVP_CTRL_TLS1_2_TLSTREE, 0, magma_seq0);
+    EVP_Cipher(enc, magma_processed, magma_data, sizeof(magma_data));
+    if (memcmp(magma_enc0_etl, magma_processed, sizeof(magma_processed)) != 0) {
+        fprintf(stderr, "Magma ENC0 mismatch");
+        exit(1);
+    }
+
+    /* Next tree levels and a wrapped IV on the same context */
+    for (i = 7; i >= 0; i--) {
+        ++magma_seq1[i];
+        if (magma_seq1[i] != 0)
+            break;
+    }
+    EVP_CIPHER_CTX_ctrl(enc, EVP_CTRL_TLS1_2_TLSTREE, 0, magma_seq1);
+    EVP_Cipher(enc, magma_processed, magma_data, sizeof(magma_data));
+    if (memcmp(magma_enc1_etl, magma_processed, sizeof(magma_processed)) != 0) {
+        fprintf(stderr, "Magma ENC1 mismatch");
+        exit(1);
+    }
+    EVP_CIPHER_CTX_free(enc);
+
+    /* Decryption takes seq as is */
+    magma_seq1[7]--;
+    enc = EVP_CIPHER_CTX_new();
+    EVP_DecryptInit_ex(enc, ciph, NULL, magma_key, magma_iv);
+    EVP_CIPHER_CTX_ctrl(enc, EVP_CTRL_TLS1_2_TLSTREE, 0, magma_seq1);
+    EVP_Cipher(enc, magma_processed, magma_enc1_etl, sizeof(magma_enc1_etl));
+    if (memcmp(magma_data, magma_processed, sizeof(magma_processed)) != 0) {
+        fprintf(stderr, "Magma DEC1 mismatch");
+        exit(1);
+    }
+    EVP_CIPHER_CTX_free(enc);
 
 #endif
     return 0;
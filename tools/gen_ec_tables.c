@@ -0,0 +1,107 @@
+/**********************************************************************
+ *                        gen_ec_tables.c                             *
+ *         This file is distributed under the same license as OpenSSL *
+ *                                                                    *
+ *   Build time generator of the fixed-base tables for GOST R 34.10   *
+ *   parameter sets, writes gost_ec_precomputed() as C source         *
+ **********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gost_ec_arith.h"
+
+/* The tables being generated are not there yet */
+const gost_limb *gost_ec_precomputed(int nid)
+{
+    return NULL;
+}
+
+struct table {
+    int nid;
+    int same;                   /* index of an identical table or -1 */
+    size_t size;
+    gost_limb *limbs;
+};
+
+static int gen_table(struct table *t, const R3410_ec_params *params)
+{
+    GOST_EC_CURVE curve;
+
+    if (!gost_ec_curve_init(&curve, params))
+        return 0;
+    t->nid = params->nid;
+    t->same = -1;
+    t->size = gost_ec_curve_comb_size(&curve);
+    t->limbs = malloc(t->size * sizeof(gost_limb));
+    if (t->limbs == NULL)
+        return 0;
+    gost_ec_curve_comb(&curve, t->limbs);
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    R3410_ec_params *sets[] = { R3410_2001_paramset, R3410_2012_512_paramset };
+    struct table tables[32];
+    FILE *out = stdout;
+    size_t i, j, n = 0;
+    const R3410_ec_params *params;
+
+    if (argc > 1 && (out = fopen(argv[1], "w")) == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(sets) / sizeof(sets[0]); i++) {
+        for (params = sets[i]; params->nid != NID_undef; params++) {
+            if (n == sizeof(tables) / sizeof(tables[0])) {
+                fprintf(stderr, "too many parameter sets\n");
+                return 1;
+            }
+            if (!gen_table(&tables[n], params))
+                continue;
+            for (j = 0; j < n; j++) {
+                if (tables[j].same < 0 && tables[j].size == tables[n].size
+                    && memcmp(tables[j].limbs, tables[n].limbs,
+                              tables[n].size * sizeof(gost_limb)) == 0) {
+                    tables[n].same = j;
+                    break;
+                }
+            }
+            n++;
+        }
+    }
+
+    fprintf(out, "/* Generated by gen_ec_tables, do not edit */\n"
+            "#include \"gost_ec_arith.h\"\n");
+    for (i = 0; i < n; i++) {
+        if (tables[i].same >= 0)
+            continue;
+        fprintf(out, "\n/* %s */\nstatic const gost_limb comb_%d[%u] = {",
+                OBJ_nid2sn(tables[i].nid), tables[i].nid,
+                (unsigned)tables[i].size);
+        for (j = 0; j < tables[i].size; j++)
+            fprintf(out, "%s0x%016llx,", j % 3 ? " " : "\n    ",
+                    (unsigned long long)tables[i].limbs[j]);
+        fprintf(out, "\n};\n");
+    }
+
+    fprintf(out, "\nconst gost_limb *gost_ec_precomputed(int nid)\n"
+            "{\n    switch (nid) {\n");
+    for (i = 0; i < n; i++) {
+        const struct table *t = tables[i].same >= 0
+            ? &tables[tables[i].same] : &tables[i];
+
+        fprintf(out, "    case %d:\n        return comb_%d;\n",
+                tables[i].nid, t->nid);
+    }
+    fprintf(out, "    default:\n        return NULL;\n    }\n}\n");
+
+    for (i = 0; i < n; i++)
+        free(tables[i].limbs);
+    if (out != stdout && fclose(out) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    return 0;
+}